@@ -0,0 +1,167 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* Copyright (c) 2002-2010 InMon Corp. Licensed under the terms of the InMon sFlow licence: */
+/* http://www.inmon.com/technology/sflowlicense.txt */
+
+/*_________________---------------------------__________________
+  _________________   URI class trie bench    __________________
+  -----------------___________________________------------------
+  Times sflow_uri_class() against tries compiled by the module's own
+  sfwb_loadUriClasses(),  from a generated classes.http rules file.
+  The module source is included whole so that the static functions
+  are the real ones;  nothing outside the trie code is run.  See
+  bench/Makefile.
+
+    uri_trie_bench [<rules> [<passes>]]
+
+  With no arguments it runs 100,  1000 and 4000 rules.  The request
+  URIs are about 40 characters,  and 3 in 4 of them match a rule.
+*/
+
+#include "../mod_sflow.c"
+
+#include <stdarg.h>
+#include "apr_general.h" /* apr_initialize() */
+#include "apr_file_io.h"
+
+#define BENCH_URIS 4096
+#define BENCH_URI_LEN 40
+#define BENCH_PASSES 2000
+
+/* the only httpd function the trie code calls */
+AP_DECLARE(void) ap_log_error_(const char *file, int line, int module_index,
+                               int level, apr_status_t status,
+                               const server_rec *s, const char *fmt, ...)
+{
+    va_list ap;
+    if((level & APLOG_LEVELMASK) > APLOG_WARNING) return;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+/* same sequence every run */
+static apr_uint32_t bench_rand_state = 2463534242U;
+
+static apr_uint32_t bench_rand(void)
+{
+    apr_uint32_t x = bench_rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return (bench_rand_state = x);
+}
+
+/* append a path segment of 2-8 lowercase letters and digits */
+static void bench_segment(char *buf, apr_size_t bufLen)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    apr_size_t len = strlen(buf);
+    apr_uint32_t n = 2 + (bench_rand() % 7), i;
+    if(len + n + 2 >= bufLen) return;
+    buf[len++] = '/';
+    for(i = 0; i < n; i++) buf[len++] = chars[bench_rand() % (sizeof(chars) - 1)];
+    buf[len] = '\0';
+}
+
+static double bench_run(apr_pool_t *pool, SFWB *sm, apr_uint32_t num_rules, apr_uint32_t passes)
+{
+    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+    char **rule = apr_palloc(pool, num_rules * sizeof(char *));
+    char **uri = apr_palloc(pool, BENCH_URIS * sizeof(char *));
+    const char *tmpdir = NULL;
+    char *fname;
+    apr_file_t *f;
+    apr_uint32_t i, p;
+
+    /* the rules:  one or two segments,  every 8th one an exact path */
+    apr_temp_dir_get(&tmpdir, pool);
+    fname = apr_pstrcat(pool, tmpdir, "/uri_trie_benchXXXXXX", NULL);
+    if(apr_file_mktemp(&f, fname, 0, pool) != APR_SUCCESS) {
+        fprintf(stderr, "cannot create rules file %s\n", fname);
+        exit(1);
+    }
+    for(i = 0; i < num_rules; i++) {
+        char buf[SFWB_MAX_LINELEN];
+        buf[0] = '\0';
+        bench_segment(buf, sizeof(buf));
+        if(bench_rand() & 1) bench_segment(buf, sizeof(buf));
+        rule[i] = apr_pstrdup(pool, buf);
+        apr_file_printf(f, "c%u %s%s\n", i % SFWB_MAX_URI_CLASSES, buf, (i % 8) ? "" : "$");
+    }
+    apr_file_close(f);
+
+    /* the requests */
+    for(i = 0; i < BENCH_URIS; i++) {
+        char buf[BENCH_URI_LEN * 2];
+        apr_uint32_t r = bench_rand() % num_rules;
+        buf[0] = '\0';
+        if((i % 4) == 3) {
+            /* no rule starts with a capital */
+            apr_cpystrn(buf, "/Z", sizeof(buf));
+        }
+        else apr_cpystrn(buf, rule[r], sizeof(buf));
+        if((i % 4) == 3 || (r % 8)) {
+            while(strlen(buf) < BENCH_URI_LEN) bench_segment(buf, sizeof(buf));
+        }
+        uri[i] = apr_pstrdup(pool, buf);
+    }
+
+    /* compile */
+    sm->config->uri_classes_file = fname;
+    sfwb_loadUriClasses(sm, NULL);
+    apr_file_remove(fname, pool);
+
+    /* and look up */
+    apr_uint32_t matched = 0;
+    for(i = 0; i < BENCH_URIS; i++) {
+        if(sflow_uri_class(shared, uri[i]) >= 0) matched++;
+    }
+    struct timespec start, end;
+    volatile apr_int32_t sink = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(p = 0; p < passes; p++) {
+        for(i = 0; i < BENCH_URIS; i++) sink += sflow_uri_class(shared, uri[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double nS = ((double)(end.tv_sec - start.tv_sec) * 1e9) + (double)(end.tv_nsec - start.tv_nsec);
+    nS /= ((double)passes * BENCH_URIS);
+
+    printf("%5u rules  %6u nodes  %3u%% matched  %6.1f ns/lookup\n",
+           num_rules,
+           shared->uri_trie[shared->uri_trie_active & 1].num_nodes,
+           (matched * 100) / BENCH_URIS,
+           nS);
+    return nS;
+}
+
+int main(int argc, char **argv)
+{
+    static const apr_uint32_t defaultRules[] = { 100, 1000, 4000 };
+    apr_uint32_t passes = (argc > 2) ? strtoul(argv[2], NULL, 0) : BENCH_PASSES;
+    apr_pool_t *pool;
+    SFWB sm;
+    apr_uint32_t i;
+
+    apr_initialize();
+    atexit(apr_terminate);
+    apr_pool_create(&pool, NULL);
+
+    /* just enough of the master's state for the compiler */
+    memset(&sm, 0, sizeof(sm));
+    sm.configPool = pool;
+    sm.config = apr_pcalloc(pool, sizeof(SFWBConfig));
+    sm.shared_mem_base = apr_pcalloc(pool, sizeof(SFWBShared));
+
+    if(argc > 1) {
+        apr_uint32_t num_rules = strtoul(argv[1], NULL, 0);
+        bench_run(pool, &sm, num_rules ? num_rules : 1, passes ? passes : 1);
+    }
+    else {
+        for(i = 0; i < (sizeof(defaultRules) / sizeof(defaultRules[0])); i++) {
+            bench_run(pool, &sm, defaultRules[i], passes ? passes : 1);
+        }
+    }
+    apr_pool_destroy(pool);
+    return 0;
+}
@@ -107,11 +107,17 @@
 #include "apr_network_io.h"
 #include "apr_optional.h"
 #include "apr_signal.h"
+#include "apr_strings.h"
+#include "apr_portable.h" /* apr_os_thread_current(),  apr_os_sock_get() */
+
+#include <arpa/inet.h> /* inet_pton() */
+#include <time.h> /* clock_gettime() */
 
 /* Apache HTTPD includes */
 #include "httpd.h"
 #include "http_config.h"
 #include "http_protocol.h"
+#include "http_core.h" /* ap_get_conn_socket() */
 #include "http_log.h"
 #include "ap_listen.h"
 
@@ -143,6 +149,22 @@
 /* whether to include app_workers or not */
 #define SFWB_APP_WORKERS
 
+/* whether to include app_resources or not (read from /proc for each
+   child process in the scoreboard, so Linux only) */
+#if defined(__linux__) && defined(SFWB_APP_WORKERS)
+#define SFWB_APP_RESOURCES
+#include <stdio.h>
+#include <unistd.h> /* sysconf(), readlink() */
+#include <dirent.h>
+#endif
+
+/* for reading the accept backlog of the listen sockets (req_delayed) */
+#if defined(__linux__) && defined(SFWB_APP_WORKERS)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h> /* TCP_INFO */
+#endif
+
 /* whether to enable even more logging/tracing */
 /* #define SFWB_DEBUG */
 
@@ -215,6 +237,13 @@ static APR_OPTIONAL_FN_TYPE(ap_logio_get_last_bytes) *pfn_ap_logio_get_last_byte
 #define SFWB_MAX_LINELEN 1024
 #define SFWB_MAX_COLLECTORS 10
 #define SFWB_CONFIG_CHECK_S 10
+/* max tokens on a config line (1 var and up to 4 values) */
+#define SFWB_MAX_TOKENS 5
+/* default max datagram size for a collector on the loopback interface,
+   where there is no MTU to worry about (e.g. a local hsflowd) */
+#define SFWB_LOOPBACK_DATAGRAM_SIZE 65000
+/* in failover mode, how long to wait before trying an unreachable collector again */
+#define SFWB_COLLECTOR_RETRY_S 30
 
 /*_________________---------------------------__________________
   _________________   child sFlow defs        __________________
@@ -223,6 +252,291 @@ static APR_OPTIONAL_FN_TYPE(ap_logio_get_last_bytes) *pfn_ap_logio_get_last_byte
 
 #define SFWB_CHILD_TICK_US 2000000
 
+/* the duration histogram and the totals are per-thread,  and padded out to
+   whole cache-lines so the threads are not fighting over the same lines */
+#define SFWB_CACHE_LINE 64
+
+typedef struct _SFWBThreadCounters {
+    SFLHTTP_histogram histogram;
+    /* 64-bit totals,  kept as {lo,hi} pairs (see sflow_add64) */
+    apr_uint32_t bytes_in[2];
+    apr_uint32_t bytes_out[2];
+    apr_uint32_t duration_uS[2];
+    apr_uint32_t excluded;
+    apr_uint32_t queue_wait_uS[2];
+    apr_uint32_t queue_waits;
+} SFWBThreadCounters;
+
+typedef union _SFWBThreadSlot {
+    SFWBThreadCounters c;
+    char pad[(sizeof(SFWBThreadCounters) + SFWB_CACHE_LINE - 1) & ~(SFWB_CACHE_LINE - 1)];
+} SFWBThreadSlot;
+
+/*_________________---------------------------__________________
+  _________________   stratified sampling     __________________
+  -----------------___________________________------------------
+  Errors and slow requests can be sampled at their own (higher)
+  rate.  Every request falls into exactly one stratum,  and each
+  stratum is exported as a separate data source with its own
+  sample_pool,  so a collector can scale each one up independently
+  and add them together.  The sFlow flow_sample does not carry the
+  ds_instance,  so the strata are told apart by ds_index:
+  ds_index = (stratum << 16) + <listen port>.
+*/
+
+#define SFWB_STRATUM_ALL 0   /* everything not in another stratum */
+#define SFWB_STRATUM_5XX 1   /* status 5xx */
+#define SFWB_STRATUM_SLOW 2  /* duration >= threshold */
+#define SFWB_NUM_STRATA 3
+#define SFWB_STRATUM_DS_INDEX(stratum, port) (((stratum) << 16) + (port))
+
+/*_________________---------------------------__________________
+  _________________   virtual hosts           __________________
+  -----------------___________________________------------------
+  With datasource.http=vhost every virtual host is a data source of
+  its own,  numbered in the order they appear in the httpd config
+  (0 is the main server).  The main stratum is then sampled and
+  counted per-vhost instead of server-wide,  so the server-wide and
+  strata data sources are still there too.  The compact sFlow
+  encoding packs the ds_class into the top 8 bits of the data
+  source,  leaving only 24 bits for the ds_index,  which is not
+  enough for a port and a vhost number both.  So the vhosts,  and
+  everything after them,  are numbered densely from just above the
+  strata:  ds_index = SFWB_DS_INDEX_BASE + vhost.  The listen port
+  is still there in the parent (the server-wide data source).
+*/
+
+#define SFWB_DS_INDEX_BASE (SFWB_NUM_STRATA << 16)
+#define SFWB_MAX_VHOSTS 4096
+#define SFWB_NO_VHOST 0xFFFFFFFF
+#define SFWB_VHOST_DS_INDEX(vhost) (SFWB_DS_INDEX_BASE + (vhost))
+#define SFWB_DS_INDEX_VHOST(dsIndex) ((dsIndex) - SFWB_DS_INDEX_BASE)
+
+/*_________________---------------------------__________________
+  _________________   URI classes             __________________
+  -----------------___________________________------------------
+  classes.http=<file> names a file of "<class> <uri-prefix>" rules.
+  The master compiles them into a byte-wise trie in the shared mem,
+  and the request threads walk r->uri down it once,  taking the
+  longest matching prefix (or an exact match,  for a rule ending in
+  '$').  Each class is counted separately and exported as a data
+  source of its own,  with ds_index placed after the vhosts.  The
+  class numbers are kept for the life of the master,  so a class
+  keeps its data source when the rules are edited.  There are two
+  tries,  and a reload builds the idle one and then switches over.
+*/
+
+#ifdef SFL_USE_32BIT_INDEX
+#define SFWB_MAX_URI_CLASSES 1024
+#else
+#define SFWB_MAX_URI_CLASSES 64
+#endif
+/* (URI classes and client groups are both "shards" of the counters,  with a name) */
+#define SFWB_MAX_SHARD_NAME 32
+#define SFWB_URI_TRIE_MAX_NODES 65536
+#define SFWB_URI_CLASS_DS_INDEX(cls) (SFWB_VHOST_DS_INDEX(SFWB_MAX_VHOSTS) + (cls))
+#define SFWB_DS_INDEX_URI_CLASS(dsIndex) ((dsIndex) - SFWB_URI_CLASS_DS_INDEX(0))
+/* child->master message id for the per-class counters (not an sFlow tag) */
+#define SFWB_MSG_URI_CLASS_COUNTERS 0xFFFF0001
+
+/*_________________---------------------------__________________
+  _________________   client groups           __________________
+  -----------------___________________________------------------
+  clients.http=<file> names a file of "<group> <address>/<bits>"
+  rules,  and every request is counted in the group of the longest
+  prefix that matches the client address.  The master builds a
+  binary radix tree from the rules and flattens it into a sorted
+  table of address ranges,  each starting where the answer changes,
+  so a lookup is just a binary search of an array.  As with the URI
+  classes there are two tables,  swapped on reload,  and each group
+  is a data source of its own,  after the URI classes.
+*/
+
+#ifdef SFL_USE_32BIT_INDEX
+#define SFWB_MAX_CLIENT_GROUPS 1024
+#else
+#define SFWB_MAX_CLIENT_GROUPS 59
+#endif
+#define SFWB_MAX_CLIENT_PREFIXES 8192
+#define SFWB_MAX_CLIENT_RANGES ((2 * (SFWB_MAX_CLIENT_PREFIXES + SFWB_MAX_EXCLUDE_RULES)) + 1)
+#define SFWB_CLIENT_GROUP_DS_INDEX(grp) (SFWB_URI_CLASS_DS_INDEX(SFWB_MAX_URI_CLASSES) + (grp))
+#define SFWB_MSG_CLIENT_GROUP_COUNTERS 0xFFFF0002
+
+/*_________________---------------------------__________________
+  _________________   exclusions              __________________
+  -----------------___________________________------------------
+  exclude.http.uri=<prefix>[$],  exclude.http.client=<address>/<bits>
+  and exclude.http.useragent=<prefix> pick out requests (such as load
+  balancer health checks) that should be neither counted nor sampled.
+  The URI and client rules are compiled into the same trie and range
+  table as the classes and groups,  with a reserved marker in place
+  of the class or group,  so they cost nothing extra to look up.  The
+  User-Agent prefixes are just a short list in the shared mem.  An
+  excluded request only adds to the excluded_requests counter.
+*/
+
+#define SFWB_MAX_EXCLUDE_RULES 32
+#define SFWB_MAX_EXCLUDE_USERAGENTS 8
+#define SFWB_MAX_EXCLUDE_USERAGENT_LEN 64
+/* the marker in the trie and range table (in place of class or group + 1) */
+#define SFWB_SHARD_EXCLUDED 0xFFFF
+/* and what sflow_uri_class() and sflow_client_group() return for it */
+#define SFWB_EXCLUDED -2
+
+/*_________________---------------------------__________________
+  _________________   heavy hitters           __________________
+  -----------------___________________________------------------
+  topk.http=on keeps a space-saving sketch of the busiest URI paths
+  and Host headers,  fed by every request.  Each request thread is
+  given a slot of its own the first time through (thread-local),  and
+  each slot has a small sketch,  and two of them:  the child tick swaps
+  them over,  and merges the one that was idle since the last tick into
+  a bigger per-child sketch,  which goes up to the master.  A sketch is
+  only written by whoever holds its busy flag,  since a slot can still
+  be shared (more threads than ThreadsPerChild,  such as the mod_http2
+  workers,  or a thread that was slow to let go at the swap).  The master merges
+  those in turn,  and at the end of each window (the polling
+  interval) publishes the top few in the shared mem,  for the
+  handler and for counter blocks 4004 and 4005 on a data source of
+  their own,  after the client groups.  The memory is fixed however
+  many different URIs there are,  and a count can only be too high,
+  by at most the error that goes with it.
+*/
+
+#define SFWB_TOPK_URI 0
+#define SFWB_TOPK_HOST 1
+#define SFWB_TOPK_KINDS 2
+#define SFWB_TOPK_THREAD 32
+#define SFWB_TOPK_CHILD 64
+#define SFWB_TOPK_MASTER 256
+#define SFWB_TOPK_EXPORT SFLHTTP_TOP_MAX
+#define SFWB_TOPK_NAME SFLHTTP_TOP_MAX_NAME
+#define SFWB_TOPK_DS_INDEX SFWB_CLIENT_GROUP_DS_INDEX(SFWB_MAX_CLIENT_GROUPS)
+#define SFWB_MSG_TOPK 0xFFFF0003
+/* (the window is the polling interval,  or this if polling is off) */
+#define SFWB_DEFAULT_WINDOW_S 60
+
+/*_________________---------------------------__________________
+  _________________   distinct clients        __________________
+  -----------------___________________________------------------
+  distinct.http=on[ <cookie>] estimates how many different client
+  addresses,  and how many different sessions,  there were in each
+  window,  with a HyperLogLog sketch (Flajolet et al.) for each.  The
+  merge of two sketches is just the larger of each pair of registers,
+  so the request threads take the max straight into the registers in
+  the shared mem,  with a compare-and-swap that is hardly ever needed
+  once a window is under way.  There are two sets of registers:  at
+  the end of each window the master switches the children over,
+  works out the estimates from the old set,  and clears it.  A
+  session is the value of the named cookie,  or without one the
+  client address and User-Agent together.  2^12 registers gives a
+  standard error of about 1.6%.
+*/
+
+#define SFWB_HLL_BITS 12
+#define SFWB_HLL_REGISTERS (1 << SFWB_HLL_BITS)
+#define SFWB_HLL_CLIENTS 0
+#define SFWB_HLL_SESSIONS 1
+#define SFWB_HLL_KINDS 2
+#define SFWB_MAX_SESSION_COOKIE_LEN 64
+#define SFWB_FNV64_INIT 14695981039346656037ULL
+
+/*_________________---------------------------__________________
+  _________________   in-flight requests      __________________
+  -----------------___________________________------------------
+  A request is normally only seen when it is logged,  so one that is
+  stuck is invisible until it finishes or times out.  With
+  inflight.http=<seconds> the master also walks the scoreboard every
+  second (this needs ExtendedStatus On),  and takes a sample of any
+  request that has been running longer than that.  These go out on a
+  data source of their own,  after the heavy hitters,  with status 0
+  and the duration so far.  A request is sampled again each time its
+  duration doubles,  and there is a cap on the samples per second so
+  a pile-up can't flood the collector (the rest count as drops).
+*/
+
+#define SFWB_INFLIGHT_DS_INDEX (SFWB_TOPK_DS_INDEX + 1)
+#define SFWB_DEFAULT_INFLIGHT_SAMPLES 10
+/* the most an in-flight sample can take up in a datagram (for the rate limit):
+   the sample header,  the http element with a full URI and host,  and a socket6 element */
+#define SFWB_INFLIGHT_SAMPLE_BYTES (52 + 8 + 32 + (4 + SFLHTTP_MAX_URI_LEN + 1) + (4 + SFLHTTP_MAX_HOST_LEN) + (5 * 4) + 8 + XDRSIZ_SFLEXTENDED_SOCKET6)
+
+/*_________________---------------------------__________________
+  _________________   phase timing            __________________
+  -----------------___________________________------------------
+  The main stratum's sampling decision is made at post_read_request,
+  so a request that is going to be sampled can have the time noted as
+  it goes:  headers parsed (then),  handler start (insert_filter),  and
+  the first response bytes and the end of the response (a filter that
+  is only added to these requests).  The others only carry a marker,
+  or with queue.http just the queue wait,  so that it can still go
+  into a sample that one of the other strata takes at log time.
+  A request that turns out to be in another stratum,  or excluded,  is
+  taken back out of the main stratum's sample_pool at log time.  The
+  thread's CPU clock is read at the same two points,  where there is
+  one.
+*/
+
+typedef struct _SFWBRequest {
+    bool_t sampled; /* by the main stratum,  at post_read_request */
+    bool_t hashed; /* decided by sampling.http.hash rather than the skip */
+    apr_uint32_t hash; /* and the request-id's hash,  if so */
+    apr_time_t headers;
+    apr_time_t handler;
+    apr_time_t first_byte;
+    apr_time_t handler_end;
+    apr_uint64_t cpu_nS; /* thread CPU clock at post_read_request */
+    apr_os_thread_t thread; /* and the thread it belongs to */
+    bool_t queued; /* queue.http,  and it could be measured */
+    apr_uint32_t queue_wait_uS;
+} SFWBRequest;
+
+#define SFWB_PHASES_FILTER "SFLOW_PHASES"
+
+/* marks a request that the main stratum decided not to sample,  and
+   that has no queue wait to keep either */
+static SFWBRequest sflow_unsampled;
+static ap_filter_rec_t *sflow_phases_filter_handle;
+
+/*_________________---------------------------__________________
+  _________________   consistent sampling     __________________
+  -----------------___________________________------------------
+  Optionally,  a request carrying a request-id header is kept or
+  skipped according to a hash of that header rather than the random
+  skip,  so that every tier using the same hash and the same 1-in-N
+  picks the same requests:  keep if FNV-1a-32(id) <= 0xFFFFFFFF / N.
+  For a W3C traceparent header only the trace-id is hashed,  since
+  the parent-id changes at every hop.
+*/
+
+#define SFWB_MAX_HASH_HEADER_LEN 64
+/* only hash this much of the request-id */
+#define SFWB_MAX_REQUEST_ID_LEN 256
+#define SFWB_TRACEPARENT_TRACEID_OFFSET 3
+#define SFWB_TRACEPARENT_TRACEID_LEN 32
+
+/*_________________---------------------------__________________
+  _________________   adaptive sampling defs  __________________
+  -----------------___________________________------------------
+*/
+
+/* how often the master re-evaluates the sampling rate (must be
+   longer than the child tick so the counters have caught up) */
+#define SFWB_ADAPT_INTERVAL_S 10
+/* only change the rate when the sample rate is this far (%) from the target */
+#define SFWB_ADAPT_HYSTERESIS_PC 25
+
+/*_________________---------------------------__________________
+  _________________   burst sampling defs     __________________
+  -----------------___________________________------------------
+*/
+
+/* an authenticated POST to the sflow handler can override the sampling
+   rate for a while, e.g. POST /sflow?burst=30&sampling=1 */
+#define SFWB_BURST_DEFAULT_S 30
+#define SFWB_BURST_MAX_S 600
+#define SFWB_BURST_DEFAULT_N 1
+
 /*_________________---------------------------__________________
   _________________   unknown output defs     __________________
   -----------------___________________________------------------
@@ -231,30 +545,129 @@ static APR_OPTIONAL_FN_TYPE(ap_logio_get_last_bytes) *pfn_ap_logio_get_last_byte
 #define SFLOW_DURATION_UNKNOWN 0
 #define SFLOW_TOKENS_UNKNOWN 0
 
+/* application name for the app_operations counters */
+#define SFWB_APPLICATION_NAME "httpd"
+
 /*_________________---------------------------__________________
   _________________   structure definitions   __________________
   -----------------___________________________------------------
 */
 
 typedef struct _SFWBCollector {
+    char *name;
     apr_sockaddr_t *sa;
     apr_uint16_t priority;
+    apr_uint32_t max_datagram;
+    /* sampling rate for this collector,  and countdown for subsampling the child samples */
+    apr_uint32_t sampling_n;
+    apr_uint32_t subsample_skip;
+    /* token-bucket rate limit (0 == unlimited) */
+    apr_uint32_t bytes_per_s;
+    apr_uint32_t pkts_per_s;
+    apr_int64_t bucket_bytes;
+    apr_int64_t bucket_pkts;
+    /* failover state */
+    bool_t active;
+    apr_time_t down_until;
+    apr_socket_t *socket; /* connected socket, so we hear about ICMP errors */
+    /* master sFlow agent objects for this collector.  Each collector has an
+       agent of its own,  with just the one receiver (index 1) */
+    SFLAgent *agent;
+    SFLReceiver *receiver;
+    SFLSampler *sampler[SFWB_NUM_STRATA]; /* indexed by stratum */
+    SFLPoller *poller;
+    /* per-vhost data sources (datasource.http=vhost),  indexed by vhost */
+    SFLSampler **vhostSampler;
+    SFLPoller **vhostPoller;
+    /* in-flight requests from the scoreboard (inflight.http) */
+    SFLSampler *inflightSampler;
 } SFWBCollector;
 
+/* per-collector settings,  which may appear before or after the collector line */
+typedef struct _SFWBCollectorOpts {
+    char *name;
+    apr_uint32_t max_datagram;
+    apr_uint32_t sampling_n;
+    apr_uint32_t bytes_per_s;
+    apr_uint32_t pkts_per_s;
+} SFWBCollectorOpts;
+
+#define SFWB_EXCLUDE_URI 1
+#define SFWB_EXCLUDE_USERAGENT 2
+#define SFWB_EXCLUDE_CLIENT 3
+
+typedef struct _SFWBExcludeRule {
+    apr_uint32_t type;
+    char *value;
+} SFWBExcludeRule;
+
 typedef struct _SFWBConfig {
     apr_int32_t error;
     apr_uint32_t sampling_n;
+    apr_uint32_t sampling_target;
+    apr_uint32_t sampling_n_5xx;
+    apr_uint32_t sampling_n_slow;
+    apr_uint32_t slow_mS;
+    char *hash_header;
+    bool_t scoreboard_counters;
+    bool_t vhost_datasources;
+    char *uri_classes_file;
+    char *client_groups_file;
+    bool_t client_groups_useragent;
+    bool_t topk;
+    bool_t distinct;
+    char *session_cookie;
+    apr_uint32_t inflight_S;
+    apr_uint32_t inflight_samples;
+    bool_t queue_wait;
+    apr_uint32_t num_exclude_rules;
+    SFWBExcludeRule exclude_rules[SFWB_MAX_EXCLUDE_RULES];
     apr_uint32_t polling_secs;
     bool_t got_sampling_n_http;
     bool_t got_polling_secs_http;
     SFLAddress agentIP;
     apr_uint32_t parent_ds_index;
+    bool_t collector_failover;
     apr_uint32_t num_collectors;
     SFWBCollector collectors[SFWB_MAX_COLLECTORS];
+    apr_uint32_t num_collector_opts;
+    SFWBCollectorOpts collector_opts[SFWB_MAX_COLLECTORS];
     apr_pool_t *pool;
 } SFWBConfig;
 
 
+/* a space-saving sketch (see sfwb_topkAdd).  The hashes are kept
+   apart,  so the search is over one small array */
+typedef struct _SFWBTopKEntry {
+    apr_uint32_t count;
+    apr_uint32_t error;
+    char name[SFWB_TOPK_NAME];
+} SFWBTopKEntry;
+
+typedef struct _SFWBTopK {
+    apr_uint32_t busy; /* claimed with a CAS by the one thread writing it */
+    apr_uint32_t size;
+    apr_uint32_t num;
+    apr_uint32_t total;
+    apr_uint32_t *hash;
+    SFWBTopKEntry *entry;
+} SFWBTopK;
+
+/* the per-vhost state in each child,  found by r->server in O(1) */
+typedef struct _SFWBChildVhost {
+    SFLSampler *sampler;
+    apr_uint32_t hash_pool;
+    SFLHTTP_counters http;
+} SFWBChildVhost;
+
+/* the per-class or per-group counters in each child */
+typedef struct _SFWBChildShard {
+    SFLHTTP_counters http;
+    apr_uint32_t bytes_in[2];
+    apr_uint32_t bytes_out[2];
+    apr_uint32_t duration_uS[2];
+} SFWBChildShard;
+
 typedef struct _SFWBChild {
     apr_thread_mutex_t *mutex;
     bool_t sflow_disabled;
@@ -262,7 +675,32 @@ typedef struct _SFWBChild {
     SFLAgent *agent;
     SFLReceiver *receiver;
     SFLSampler *sampler;
+    SFLSampler *sampler_5xx;
+    SFLSampler *sampler_slow;
+    apr_uint32_t slow_uS;
+    bool_t scoreboard_counters;
+    const char *hash_header;
+    bool_t hash_traceparent;
+    apr_uint32_t hash_threshold;
+    apr_uint32_t hash_pool;
     SFLCounters_sample_element http_counters;
+    SFLCounters_sample_element app_operations;
+    bool_t vhost_datasources;
+    SFWBChildVhost *vhosts;
+    apr_uint32_t num_vhosts;
+    SFWBChildShard *uriClasses; /* indexed by class */
+    SFWBChildShard *clientGroups; /* indexed by group */
+    bool_t client_groups_useragent;
+    bool_t topk_enabled;
+    SFWBTopK *topk; /* per thread slot:  two of each kind (see sflow_topk_count) */
+    SFWBTopK *topkMerged;
+    apr_uint32_t topk_active;
+    apr_uint32_t topk_threads; /* threads given a slot so far */
+    bool_t distinct_enabled;
+    const char *session_cookie;
+    bool_t queue_wait;
+    SFWBThreadSlot *threadSlots;
+    apr_uint32_t num_threadSlots;
     apr_time_t lastTickTime;
     apr_pool_t *childPool;
 } SFWBChild;
@@ -280,6 +718,15 @@ typedef struct _SFWB {
     /* int mpm_is_async; */
 #endif
 
+    /* virtual hosts.  Each vhost server_rec gets its own small SFWB,
+       pointing back to the main one,  so the request hook can find
+       both with one lookup (see sfwb_lookup) */
+    struct _SFWB *main;
+    apr_uint32_t vhostIdx;
+    apr_uint32_t num_vhosts;
+    server_rec **vhostServers; /* indexed by vhost */
+    apr_uint16_t servicePort;
+
     /* master process */
     apr_proc_t *sFlowProc;
     apr_pool_t *masterPool;
@@ -292,15 +739,46 @@ typedef struct _SFWB {
     apr_int32_t configCountDown;
     char *configFile;
     apr_time_t configFile_modTime;
+    apr_time_t uriClassesFile_modTime;
+    apr_time_t clientGroupsFile_modTime;
     SFWBConfig *config;
 
+    /* adaptive sampling */
+    apr_uint32_t sampling_n_base;
+    apr_uint32_t sampling_n_adapted;
+    apr_int32_t adaptCountDown;
+    apr_uint32_t adapt_lastRequests;
+
+    /* heavy hitters,  merged from the children (one of each kind) */
+    SFWBTopK *topk;
+    apr_int32_t topkCountDown;
+
+    /* distinct clients */
+    apr_int32_t distinctCountDown;
+
     /* master sFlow agent */
     apr_socket_t *socket4;
     apr_socket_t *socket6;
-    SFLAgent *agent;
-    SFLReceiver *receiver;
-    SFLSampler *sampler;
-    SFLPoller *poller;
+    SFLAgent *agents; /* SFWB_MAX_COLLECTORS of them,  or NULL before sflow_init */
+    apr_uint32_t num_agents;
+    /* (one agent,  receiver,  sampler and poller for each collector,  see SFWBCollector) */
+
+#ifdef SFWB_APP_WORKERS
+    /* scoreboard counter mode - the last access_count and bytes_served
+       of every worker slot */
+    apr_uint32_t *sb_access_count;
+    apr_uint64_t *sb_bytes_served;
+    /* in-flight samples - the request each worker slot was last sampled
+       for,  and the duration at which to sample it again */
+    apr_time_t *inflight_start;
+    apr_uint64_t *inflight_next_uS;
+#endif
+
+#ifdef SFWB_APP_RESOURCES
+    /* app_resources,  read at most once per second (there may be several pollers) */
+    SFLAPPResources appResources;
+    apr_time_t appResourcesTime;
+#endif
 
     /* pipe for child->master IPC */
     apr_file_t *pipe_read;
@@ -316,17 +794,120 @@ typedef struct _SFWB {
     SFWBChild *child;
 } SFWB;
 
+/* the compiled URI class rules.  Node 0 is the root,  and a node's
+   edges are contiguous and sorted,  each one (<char> << 24) + <node> */
+typedef struct _SFWBUriTrieNode {
+    apr_uint32_t firstEdge;
+    apr_uint16_t numEdges;
+    apr_uint16_t prefixClass; /* class + 1,  or 0 */
+    apr_uint16_t exactClass;  /* class + 1,  or 0 */
+    apr_uint16_t pad;
+} SFWBUriTrieNode;
+
+typedef struct _SFWBUriTrie {
+    apr_uint32_t num_nodes;
+    SFWBUriTrieNode node[SFWB_URI_TRIE_MAX_NODES];
+    apr_uint32_t edge[SFWB_URI_TRIE_MAX_NODES];
+} SFWBUriTrie;
+
+typedef struct _SFWBShardShared {
+    char name[SFWB_MAX_SHARD_NAME];
+    SFLHTTP_counters http;
+    SFLHTTP_totals totals;
+} SFWBShardShared;
+
+/* the client groups as address ranges,  sorted.  Each range runs
+   up to the start of the next one,  and the first starts at 0. */
+typedef struct _SFWBClientRange4 {
+    apr_uint32_t start;
+    apr_uint32_t group; /* group + 1,  or 0 */
+} SFWBClientRange4;
+
+typedef struct _SFWBClientRange6 {
+    apr_uint64_t start_hi;
+    apr_uint64_t start_lo;
+    apr_uint32_t group; /* group + 1,  or 0 */
+    apr_uint32_t pad;
+} SFWBClientRange6;
+
+typedef struct _SFWBClientTable {
+    apr_uint32_t num_v4;
+    apr_uint32_t num_v6;
+    SFWBClientRange4 v4[SFWB_MAX_CLIENT_RANGES];
+    SFWBClientRange6 v6[SFWB_MAX_CLIENT_RANGES];
+} SFWBClientTable;
+
+/* the top few of one kind,  as of the end of the last window */
+typedef struct _SFWBTopKShared {
+    apr_uint32_t window_S;
+    apr_uint32_t total;
+    apr_uint32_t num;
+    SFWBTopKEntry entry[SFWB_TOPK_EXPORT];
+} SFWBTopKShared;
+
 typedef struct _SFWBShared {
     apr_uint32_t sflow_skip;
+    apr_uint32_t sflow_skip_5xx;
+    apr_uint32_t sflow_skip_slow;
+    apr_uint32_t slow_mS;
+    char hash_header[SFWB_MAX_HASH_HEADER_LEN];
+    bool_t scoreboard_counters;
+    /* written by a child (see sflow_handler),  not the master */
+    apr_uint32_t burst_sampling_n;
+    apr_uint32_t burst_until_S;
     SFLCounters_sample_element http_counters;
+    SFLCounters_sample_element http_histogram;
+    SFLCounters_sample_element http_totals;
+    SFLCounters_sample_element http_excluded;
+    SFLCounters_sample_element http_queue;
+    SFLCounters_sample_element app_operations;
+    bool_t vhost_datasources;
+    /* URI classes.  Only the master writes these,  and only ever appends a class */
+    apr_uint32_t uri_trie_active;
+    apr_uint32_t num_uri_classes;
+    SFWBUriTrie uri_trie[2];
+    SFWBShardShared uri_class[SFWB_MAX_URI_CLASSES];
+    /* client groups,  the same way */
+    apr_uint32_t client_table_active;
+    apr_uint32_t num_client_groups;
+    bool_t client_groups_useragent;
+    SFWBClientTable client_table[2];
+    SFWBShardShared client_group[SFWB_MAX_CLIENT_GROUPS];
+    /* exclusions.  The URI and client rules live in the trie and table above */
+    bool_t exclude_lookups;
+    apr_uint32_t num_exclude_useragents;
+    apr_uint32_t exclude_useragent_len[SFWB_MAX_EXCLUDE_USERAGENTS];
+    char exclude_useragent[SFWB_MAX_EXCLUDE_USERAGENTS][SFWB_MAX_EXCLUDE_USERAGENT_LEN];
+    /* heavy hitters */
+    bool_t topk_enabled;
+    SFWBTopKShared topk[SFWB_TOPK_KINDS];
+    /* queue wait (queue.http) */
+    bool_t queue_wait;
+    /* distinct clients.  The registers are written by the children */
+    bool_t distinct_enabled;
+    char session_cookie[SFWB_MAX_SESSION_COOKIE_LEN];
+    apr_uint32_t hll_active;
+    apr_uint32_t hll[2][SFWB_HLL_KINDS][SFWB_HLL_REGISTERS];
+    SFLHTTP_distinct distinct;
+    /* followed by num_vhosts of these... */
 } SFWBShared;
 
+typedef struct _SFWBVhostShared {
+    SFLCounters_sample_element http_counters;
+} SFWBVhostShared;
+
+#define SFWB_SHARED_VHOSTS(shared) ((SFWBVhostShared *)((SFWBShared *)(shared) + 1))
+
 /*_________________---------------------------__________________
   _________________   forward declarations    __________________
   -----------------___________________________------------------
 */
 
 static void sflow_init(SFWB *sm, server_rec *s);
+static void sfwb_selectCollectors(SFWB *sm);
+static void sfwb_loadUriClasses(SFWB *sm, server_rec *s);
+static void sfwb_loadClientGroups(SFWB *sm, server_rec *s);
+static SFLHTTP_method methodNumberLookup(int method);
 
 /*_________________---------------------------__________________
   _________________      mutex utils          __________________
@@ -341,6 +922,21 @@ static bool_t releaseOK(apr_thread_mutex_t *sem) {
     return (sem == NULL || apr_thread_mutex_unlock(sem) == 0);
 }
 
+/*_________________---------------------------__________________
+  _________________      server lookup        __________________
+  -----------------___________________________------------------
+  r->server may be a virtual host.  If so its module config just
+  points back to the main server's state and says which vhost it is.
+*/
+
+static SFWB *sfwb_lookup(server_rec *s, apr_uint32_t *p_vhostIdx)
+{
+    SFWB *sm = GET_CONFIG_DATA(s);
+    if(p_vhostIdx) *p_vhostIdx = sm ? sm->vhostIdx : 0;
+    if(sm && sm->main) sm = sm->main;
+    return sm;
+}
+
 #define SEMLOCK_DO(_sem, _ctrl, _ok) for((_ctrl)=(_ok)=lockOK(_sem); (_ctrl); (_ctrl)=0,(_ok)=releaseOK(_sem))
 
 /*_________________---------------------------__________________
@@ -366,19 +962,180 @@ static void sfwb_cb_error(void *magic, SFLAgent *agent, char *msg)
     ap_log_error(APLOG_MARK, APLOG_ERR, 0, sm->server_rec, "sFlow agent error: %s", msg);
 }
 
+#ifdef SFWB_APP_RESOURCES
+
+/*_________________---------------------------__________________
+  _________________   app_resources           __________________
+  -----------------___________________________------------------
+  Add up the CPU,  memory and file descriptors of every live child
+  process in the scoreboard,  as seen in /proc.  The totals can go
+  backwards when a child exits (e.g. MaxConnectionsPerChild).
+*/
+
+static void sfwb_readProcResources(pid_t pid, SFLAPPResources *res)
+{
+    char path[64];
+    char line[SFWB_MAX_LINELEN+1];
+    FILE *f;
+    DIR *dir;
+
+    /* cpu and memory from /proc/<pid>/stat (fields 14,15 and 24) */
+    apr_snprintf(path, sizeof(path), "/proc/%u/stat", (apr_uint32_t)pid);
+    if((f = fopen(path, "r")) != NULL) {
+        if(fgets(line, SFWB_MAX_LINELEN, f)) {
+            /* skip past the (command name),  which may contain spaces */
+            char *p = strrchr(line, ')');
+            unsigned long utime, stime;
+            long rss;
+            if(p && sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+                           &utime, &stime, &rss) == 3) {
+                long hz = sysconf(_SC_CLK_TCK);
+                if(hz > 0) {
+                    res->user_time += (apr_uint32_t)((utime * 1000) / hz);
+                    res->system_time += (apr_uint32_t)((stime * 1000) / hz);
+                }
+                res->mem_used += (apr_uint64_t)rss * sysconf(_SC_PAGESIZE);
+            }
+        }
+        fclose(f);
+    }
+
+    /* fd limit from /proc/<pid>/limits */
+    apr_snprintf(path, sizeof(path), "/proc/%u/limits", (apr_uint32_t)pid);
+    if((f = fopen(path, "r")) != NULL) {
+        while(fgets(line, SFWB_MAX_LINELEN, f)) {
+            if(strncmp(line, "Max open files", 14) == 0) {
+                unsigned long soft;
+                if(sscanf(line + 14, "%lu", &soft) == 1) res->fd_max += soft;
+                break;
+            }
+        }
+        fclose(f);
+    }
+
+    /* open fds (and how many of them are sockets) from /proc/<pid>/fd */
+    apr_snprintf(path, sizeof(path), "/proc/%u/fd", (apr_uint32_t)pid);
+    if((dir = opendir(path)) != NULL) {
+        struct dirent *de;
+        while((de = readdir(dir)) != NULL) {
+            char fdpath[96];
+            char target[16];
+            ssize_t len;
+            if(de->d_name[0] == '.') continue;
+            res->fd_open++;
+            apr_snprintf(fdpath, sizeof(fdpath), "%s/%s", path, de->d_name);
+            len = readlink(fdpath, target, sizeof(target) - 1);
+            if(len > 7 && strncmp(target, "socket:", 7) == 0) res->conn_open++;
+        }
+        closedir(dir);
+    }
+}
+
+static apr_uint64_t sfwb_procTotalMem(void)
+{
+    char line[SFWB_MAX_LINELEN+1];
+    unsigned long kB = 0;
+    FILE *f;
+    if((f = fopen("/proc/meminfo", "r")) != NULL) {
+        while(fgets(line, SFWB_MAX_LINELEN, f)) {
+            if(sscanf(line, "MemTotal: %lu", &kB) == 1) break;
+        }
+        fclose(f);
+    }
+    return (apr_uint64_t)kB * 1024;
+}
+
+static void sfwb_appResources(SFWB *sm, SFLAPPResources *res)
+{
+    apr_int32_t i;
+    int threads = 1;
+
+    if(sm->appResourcesTime == sm->currentTime) {
+        *res = sm->appResources;
+        return;
+    }
+
+    memset(res, 0, sizeof(*res));
+    if(ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads) != APR_SUCCESS || threads < 1) {
+        threads = 1;
+    }
+    for (i = 0; i < sm->mpm_server_limit; i++) {
+        process_score *ps_record = ap_get_scoreboard_process(i);
+        if(ps_record
+           && ps_record->pid
+           && !ps_record->quiescing) {
+            sfwb_readProcResources(ps_record->pid, res);
+            /* one connection per worker thread (more with the event mpm) */
+            res->conn_max += threads;
+        }
+    }
+    /* (the listen sockets are counted in conn_open too) */
+    res->mem_max = sfwb_procTotalMem();
+
+    sm->appResources = *res;
+    sm->appResourcesTime = sm->currentTime;
+}
+
+#endif /* SFWB_APP_RESOURCES */
+
+#ifdef SFWB_APP_WORKERS
+
+/*_________________---------------------------__________________
+  _________________   listen backlog          __________________
+  -----------------___________________________------------------
+  Connections that the kernel has accepted but no worker has picked
+  up yet.  For a listening socket,  Linux reports the current accept
+  queue length in tcpi_unacked.  (The master inherited the listen
+  sockets when it was forked.)
+*/
+
+static apr_uint32_t sfwb_listenBacklog(void)
+{
+    apr_uint32_t backlog = 0;
+#if defined(TCP_INFO) && defined(__linux__)
+    ap_listen_rec *lr;
+    for(lr = ap_listeners; lr; lr = lr->next) {
+        apr_os_sock_t fd;
+        struct tcp_info ti;
+        socklen_t len = sizeof(ti);
+        if(lr->sd == NULL
+           || apr_os_sock_get(&fd, lr->sd) != APR_SUCCESS) continue;
+        memset(&ti, 0, sizeof(ti));
+        if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0
+           && ti.tcpi_state == TCP_LISTEN) {
+            backlog += ti.tcpi_unacked;
+        }
+    }
+#endif
+    return backlog;
+}
+
+#endif /* SFWB_APP_WORKERS */
+
 static void sfwb_cb_counters(void *magic, SFLPoller *poller, SFL_COUNTERS_SAMPLE_TYPE *cs)
 {
     SFWB *sm = (SFWB *)poller->magic;
     SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+    SFWBCollector *coll = (SFWBCollector *)poller->userData;
     SFLCounters_sample_element parElem = { 0 };
+    SFLCounters_sample_element distinctElem = { 0 };
 #ifdef SFWB_APP_WORKERS
     SFLCounters_sample_element app_workers = { 0 };
+    SFLCounters_sample_element worker_states = { 0 };
+#endif
+#ifdef SFWB_APP_RESOURCES
+    SFLCounters_sample_element app_resources = { 0 };
 #endif
 
     if(sm->config == NULL) {
         /* config is disabled */
         return;
     }
+
+    if(coll && !coll->active) {
+        /* standby collector - nothing to do */
+        return;
+    }
     
     if(sm->config->polling_secs == 0) {
         /* polling is off */
@@ -387,6 +1144,27 @@ static void sfwb_cb_counters(void *magic, SFLPoller *poller, SFL_COUNTERS_SAMPLE
 
     /* per-child counters have been accumulated into this shared-memory block, so we can just submit it */
     SFLADD_ELEMENT(cs, &shared->http_counters);
+    /* and the same for the duration histogram and totals */
+    SFLADD_ELEMENT(cs, &shared->http_histogram);
+    SFLADD_ELEMENT(cs, &shared->http_totals);
+    /* and requests left out by exclude.http rules,  if there are any rules */
+    if(shared->exclude_lookups || shared->num_exclude_useragents) {
+        SFLADD_ELEMENT(cs, &shared->http_excluded);
+    }
+    /* and the time spent waiting for a worker,  if queue.http=on */
+    if(shared->queue_wait) {
+        SFLADD_ELEMENT(cs, &shared->http_queue);
+    }
+    /* (set the application name here,  in the process that will encode it) */
+    shared->app_operations.counterBlock.app_operations.application.str = SFWB_APPLICATION_NAME;
+    shared->app_operations.counterBlock.app_operations.application.len = strlen(SFWB_APPLICATION_NAME);
+    SFLADD_ELEMENT(cs, &shared->app_operations);
+    /* distinct clients and sessions in the last complete window (see sfwb_distinctWindow) */
+    if(shared->distinct_enabled) {
+        distinctElem.tag = SFLCOUNTERS_HTTP_DISTINCT;
+        distinctElem.counterBlock.http_distinct = shared->distinct;
+        SFLADD_ELEMENT(cs, &distinctElem);
+    }
 
     if(sm->config->parent_ds_index) {
         /* we learned the parent_ds_index from the config file, so add a parent structure too. */
@@ -413,39 +1191,84 @@ static void sfwb_cb_counters(void *magic, SFLPoller *poller, SFL_COUNTERS_SAMPLE
         }
 #endif
         
+        /* only walk the threads of live processes,  and only as many as each
+           child actually runs,  rather than the whole ServerLimit x ThreadLimit
+           grid.  (AP_MPMQ_MAX_DAEMON_USED would be a stale copy in this process,
+           so all the process slots are still checked.) */
+        int max_daemons = sm->mpm_server_limit;
+        int threads_per_child = sm->mpm_thread_limit;
+        if(ap_mpm_query(AP_MPMQ_MAX_DAEMONS, &max_daemons) != APR_SUCCESS
+           || max_daemons <= 0
+           || max_daemons > sm->mpm_server_limit) {
+            max_daemons = sm->mpm_server_limit;
+        }
+        if(ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads_per_child) != APR_SUCCESS
+           || threads_per_child <= 0
+           || threads_per_child > sm->mpm_thread_limit) {
+            threads_per_child = sm->mpm_thread_limit;
+        }
+
         /* fill in an app-workers structure too, by querying the scoreboard just like in mod_status */
         app_workers.tag = SFLCOUNTERS_APP_WORKERS;
-        app_workers.counterBlock.app_workers.workers_max = sm->mpm_server_limit * sm->mpm_thread_limit;
+        /* (i.e. MaxRequestWorkers) */
+        app_workers.counterBlock.app_workers.workers_max = max_daemons * threads_per_child;
+        /* and the detailed breakdown */
+        worker_states.tag = SFLCOUNTERS_HTTP_WORKER_STATES;
+        SFLHTTP_worker_states *states = &worker_states.counterBlock.http_worker_states;
         
         for (i = 0; i < sm->mpm_server_limit; i++) {
             ps_record = ap_get_scoreboard_process(i);
-            if(ps_record) {
-                for (j = 0; j < sm->mpm_thread_limit; j++) {
+            if(ps_record == NULL
+               || ps_record->pid == 0) {
+                /* empty slot - don't bother with its threads */
+                continue;
+            }
+            for (j = 0; j < threads_per_child; j++) {
 #if ((AP_SERVER_MAJORVERSION_NUMBER < 3) && (AP_SERVER_MINORVERSION_NUMBER < 3))
-                    ws_record = ap_get_scoreboard_worker(i, j);
+                ws_record = ap_get_scoreboard_worker(i, j);
 #else
-                    ws_record = ap_get_scoreboard_worker_from_indexes(i, j);
+                ws_record = ap_get_scoreboard_worker_from_indexes(i, j);
 #endif
-                    if(ws_record) {
-                        res = ws_record->status;
-                        if(!ps_record->quiescing
-                           && ps_record->pid) {
-                            if(res == SERVER_READY) {
-                                if(ps_record->generation == mpm_generation) {
-                                    app_workers.counterBlock.app_workers.workers_idle++;
-                                }
-                            }
-                            else if(res != SERVER_DEAD
-                                    && res != SERVER_STARTING
-                                    && res != SERVER_IDLE_KILL) {
-                                app_workers.counterBlock.app_workers.workers_active++;
+                if(ws_record) {
+                    res = ws_record->status;
+                    if(!ps_record->quiescing) {
+                        if(res == SERVER_READY) {
+                            if(ps_record->generation == mpm_generation) {
+                                app_workers.counterBlock.app_workers.workers_idle++;
                             }
                         }
+                        else if(res != SERVER_DEAD
+                                && res != SERVER_STARTING
+                                && res != SERVER_IDLE_KILL) {
+                            app_workers.counterBlock.app_workers.workers_active++;
+                        }
+                    }
+                    switch(res) {
+                    case SERVER_STARTING: states->starting++; break;
+                    case SERVER_READY: states->ready++; break;
+                    case SERVER_BUSY_READ: states->reading++; break;
+                    case SERVER_BUSY_WRITE: states->writing++; break;
+                    case SERVER_BUSY_KEEPALIVE: states->keepalive++; break;
+                    case SERVER_BUSY_LOG: states->logging++; break;
+                    case SERVER_BUSY_DNS: states->dns++; break;
+                    case SERVER_CLOSING: states->closing++; break;
+                    case SERVER_GRACEFUL: states->graceful++; break;
+                    case SERVER_IDLE_KILL: states->idle_kill++; break;
+                    default: break;
                     }
                 }
             }
         }
+        /* connections waiting in the listen queue for a worker */
+        app_workers.counterBlock.app_workers.req_delayed = sfwb_listenBacklog();
         SFLADD_ELEMENT(cs, &app_workers);
+        SFLADD_ELEMENT(cs, &worker_states);
+
+#ifdef SFWB_APP_RESOURCES
+        app_resources.tag = SFLCOUNTERS_APP_RESOURCES;
+        sfwb_appResources(sm, &app_resources.counterBlock.app_resources);
+        SFLADD_ELEMENT(cs, &app_resources);
+#endif
     }
 
 #endif /* SFWB_APP_WORKERS */
@@ -453,62 +1276,318 @@ static void sfwb_cb_counters(void *magic, SFLPoller *poller, SFL_COUNTERS_SAMPLE
     sfl_poller_writeCountersSample(poller, cs);
 }
 
+static void sfwb_cb_vhost_counters(void *magic, SFLPoller *poller, SFL_COUNTERS_SAMPLE_TYPE *cs)
+{
+    SFWB *sm = (SFWB *)poller->magic;
+    SFWBCollector *coll = (SFWBCollector *)poller->userData;
+    SFLCounters_sample_element parElem = { 0 };
+    apr_uint32_t vhostIdx = SFWB_DS_INDEX_VHOST(SFL_DS_INDEX(poller->dsi));
+
+    if(sm->config == NULL
+       || sm->config->polling_secs == 0
+       || (coll && !coll->active)
+       || vhostIdx >= sm->num_vhosts) {
+        return;
+    }
+
+    /* the counters for this vhost,  accumulated by the master as for the server-wide ones */
+    SFLADD_ELEMENT(cs, &SFWB_SHARED_VHOSTS(sm->shared_mem_base)[vhostIdx].http_counters);
+
+    /* and the server-wide data source is the parent */
+    parElem.tag = SFLCOUNTERS_HOST_PAR;
+    parElem.counterBlock.host_par.dsClass = SFL_DSCLASS_LOGICAL_ENTITY;
+    parElem.counterBlock.host_par.dsIndex = sm->servicePort;
+    SFLADD_ELEMENT(cs, &parElem);
+
+    sfl_poller_writeCountersSample(poller, cs);
+}
+
+static void sfwb_cb_shard_counters(void *magic, SFLPoller *poller, SFL_COUNTERS_SAMPLE_TYPE *cs)
+{
+    SFWB *sm = (SFWB *)poller->magic;
+    SFWBCollector *coll = (SFWBCollector *)poller->userData;
+    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+    SFLCounters_sample_element httpElem = { 0 };
+    SFLCounters_sample_element totalsElem = { 0 };
+    SFLCounters_sample_element parElem = { 0 };
+    SFWBShardShared *shard = NULL;
+    /* a URI class,  or a client group after them */
+    apr_uint32_t idx = SFWB_DS_INDEX_URI_CLASS(SFL_DS_INDEX(poller->dsi));
+    if(idx < SFWB_MAX_URI_CLASSES) {
+        if(idx < shared->num_uri_classes) shard = &shared->uri_class[idx];
+    }
+    else {
+        idx -= SFWB_MAX_URI_CLASSES;
+        if(idx < shared->num_client_groups) shard = &shared->client_group[idx];
+    }
+
+    if(sm->config == NULL
+       || sm->config->polling_secs == 0
+       || (coll && !coll->active)
+       || shard == NULL) {
+        return;
+    }
+
+    /* (the shared copy is just the counters,  not whole counter elements) */
+    httpElem.tag = SFLCOUNTERS_HTTP;
+    httpElem.counterBlock.http = shard->http;
+    SFLADD_ELEMENT(cs, &httpElem);
+    totalsElem.tag = SFLCOUNTERS_HTTP_TOTALS;
+    totalsElem.counterBlock.http_totals = shard->totals;
+    SFLADD_ELEMENT(cs, &totalsElem);
+
+    /* and the server-wide data source is the parent */
+    parElem.tag = SFLCOUNTERS_HOST_PAR;
+    parElem.counterBlock.host_par.dsClass = SFL_DSCLASS_LOGICAL_ENTITY;
+    parElem.counterBlock.host_par.dsIndex = sm->servicePort;
+    SFLADD_ELEMENT(cs, &parElem);
+
+    sfl_poller_writeCountersSample(poller, cs);
+}
+
+static void sfwb_cb_topk_counters(void *magic, SFLPoller *poller, SFL_COUNTERS_SAMPLE_TYPE *cs)
+{
+    SFWB *sm = (SFWB *)poller->magic;
+    SFWBCollector *coll = (SFWBCollector *)poller->userData;
+    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+    SFLCounters_sample_element topElem[SFWB_TOPK_KINDS];
+    SFLCounters_sample_element parElem = { 0 };
+    apr_uint32_t k, i;
+
+    if(sm->config == NULL
+       || sm->config->polling_secs == 0
+       || (coll && !coll->active)
+       || !shared->topk_enabled) {
+        return;
+    }
+
+    /* the last complete window (see sfwb_topkPublish) */
+    for(k = 0; k < SFWB_TOPK_KINDS; k++) {
+        SFWBTopKShared *pub = &shared->topk[k];
+        SFLHTTP_top *top = &topElem[k].counterBlock.http_top;
+        memset(&topElem[k], 0, sizeof(topElem[k]));
+        topElem[k].tag = (k == SFWB_TOPK_URI) ? SFLCOUNTERS_HTTP_TOP_URIS : SFLCOUNTERS_HTTP_TOP_HOSTS;
+        top->window_S = pub->window_S;
+        top->total = pub->total;
+        top->num_entries = (pub->num < SFWB_TOPK_EXPORT) ? pub->num : SFWB_TOPK_EXPORT;
+        for(i = 0; i < top->num_entries; i++) {
+            top->entry[i].count = pub->entry[i].count;
+            top->entry[i].error = pub->entry[i].error;
+            top->entry[i].name.str = pub->entry[i].name;
+            top->entry[i].name.len = strlen(pub->entry[i].name);
+        }
+        SFLADD_ELEMENT(cs, &topElem[k]);
+    }
+
+    /* and the server-wide data source is the parent */
+    parElem.tag = SFLCOUNTERS_HOST_PAR;
+    parElem.counterBlock.host_par.dsClass = SFL_DSCLASS_LOGICAL_ENTITY;
+    parElem.counterBlock.host_par.dsIndex = sm->servicePort;
+    SFLADD_ELEMENT(cs, &parElem);
+
+    sfl_poller_writeCountersSample(poller, cs);
+}
+
 static void sfwb_cb_sendPkt(void *magic, SFLAgent *agent, SFLReceiver *receiver, u_char *pkt, apr_uint32_t pktLen)
 {
     SFWB *sm = (SFWB *)magic;
     apr_socket_t *soc = NULL;
-    apr_int32_t c = 0;
     if(!sm->config) {
         /* config is disabled */
         return;
     }
 
-    for(c = 0; c < sm->config->num_collectors; c++) {
-        SFWBCollector *coll = &sm->config->collectors[c];
-        if(coll->sa) {
-            soc = (coll->sa->family == APR_INET6) ? sm->socket6 : sm->socket4;
-            apr_size_t len = (apr_size_t)pktLen;
-            apr_status_t rc = apr_socket_sendto(soc, coll->sa, 0, (char *)pkt, &len);
-            if(rc != APR_SUCCESS && errno != EINTR) {
-                ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL, "socket sendto error");
-            }
-            if(len == 0) {
-                ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL, "socket sendto transmitted 0 bytes");
+    /* each collector has its own receiver,  so that it can have its own datagram size */
+    SFWBCollector *coll = (SFWBCollector *)receiver->userData;
+    if(coll && coll->sa && coll->active) {
+        /* charge this datagram to the collector's budget. The budget is enforced
+           when flow samples are added (see sfwb_overBudget),  so we may go
+           a little overdrawn here.  That will be paid back on the next refill. */
+        coll->bucket_bytes -= pktLen;
+        coll->bucket_pkts--;
+        apr_size_t len = (apr_size_t)pktLen;
+        apr_status_t rc;
+        if(coll->socket) {
+            /* connected socket (failover mode) */
+            rc = apr_socket_send(coll->socket, (char *)pkt, &len);
+            if(APR_STATUS_IS_ECONNREFUSED(rc)
+               || APR_STATUS_IS_EHOSTUNREACH(rc)
+               || APR_STATUS_IS_ENETUNREACH(rc)) {
+                /* an ICMP error came back from an earlier datagram. Fail over to the next collector */
+                ap_log_error(APLOG_MARK, APLOG_INFO, rc, sm->server_rec, "collector %s unreachable - failing over", coll->name);
+                coll->down_until = sm->currentTime + SFWB_COLLECTOR_RETRY_S;
+                sfwb_selectCollectors(sm);
+                /* This datagram is dropped.  It was encoded by this collector's
+                   receiver,  with its sequence numbers,  so it can't simply be
+                   sent on to the next collector. */
+                return;
             }
         }
+        else {
+            soc = (coll->sa->family == APR_INET6) ? sm->socket6 : sm->socket4;
+            rc = apr_socket_sendto(soc, coll->sa, 0, (char *)pkt, &len);
+        }
+        if(rc != APR_SUCCESS && errno != EINTR) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL, "socket sendto error");
+        }
+        if(len == 0) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL, "socket sendto transmitted 0 bytes");
+        }
     }
 }
 
 /*_________________---------------------------__________________
-  _________________   ipv4MappedAddress       __________________
+  _________________   collector failover      __________________
   -----------------___________________________------------------
+  Normally every collector gets every datagram.  In failover mode
+  only the healthy collector with the lowest priority number is
+  active (like DNS SRV priority).  A collector that bounces an ICMP
+  error is skipped for SFWB_COLLECTOR_RETRY_S seconds.
 */
 
-static bool_t ipv4MappedAddress(SFLIPv6 *ipv6addr, SFLIPv4 *ip4addr) {
-    static char mapped_prefix[] = { 0,0,0,0,0,0,0,0,0,0,0xFF,0xFF };
-    static char compat_prefix[] = { 0,0,0,0,0,0,0,0,0,0,0,0 };
-    if(!memcmp(ipv6addr->addr, mapped_prefix, 12) ||
-       !memcmp(ipv6addr->addr, compat_prefix, 12)) {
-        memcpy(ip4addr, ipv6addr->addr + 12, 4);
-        return true;
+static void sfwb_selectCollectors(SFWB *sm)
+{
+    SFWBCollector *best = NULL;
+    SFWBCollector *bestDown = NULL;
+    apr_uint32_t c;
+    for(c = 0; c < sm->config->num_collectors; c++) {
+        SFWBCollector *coll = &sm->config->collectors[c];
+        coll->active = (coll->sa && !sm->config->collector_failover);
+        if(coll->sa == NULL || !sm->config->collector_failover) continue;
+        if(coll->down_until <= sm->currentTime) {
+            if(best == NULL || coll->priority < best->priority) best = coll;
+        }
+        else {
+            if(bestDown == NULL || coll->priority < bestDown->priority) bestDown = coll;
+        }
+    }
+    if(sm->config->collector_failover) {
+        /* if they are all down, just keep trying the preferred one */
+        if(best == NULL) best = bestDown;
+        if(best) best->active = true;
     }
-    return false;
 }
 
 /*_________________---------------------------__________________
-  _________________   sflow_sample_http       __________________
+  _________________   collector subsampling   __________________
   -----------------___________________________------------------
+  The children sample at the lowest sampling_n of any collector.
+  Collectors that asked for a higher sampling_n just get every
+  Nth of those samples (on average),  and the sampling_rate in
+  the sample is scaled up to match.  The sample_pool is the same
+  for every collector.  A sample that was picked by its request-id
+  hash (sampling.http.hash) is kept if the hash is under the
+  collector's own threshold instead,  so that each collector gets
+  the same requests as any other tier sampling at its rate.
 */
 
-
-static int my_strnlen(const char *s, apr_size_t max) {
-    apr_int32_t i;
-    if(s == NULL) return 0;
-    for(i = 0; i < max; i++) if(s[i] == '\0') return i;
-    return max;
+static apr_uint32_t sfwb_childSamplingRate(SFWBConfig *config)
+{
+    apr_uint32_t c, n = 0;
+    for(c = 0; c < config->num_collectors; c++) {
+        apr_uint32_t cn = config->collectors[c].sampling_n;
+        if(cn && (n == 0 || cn < n)) n = cn;
+    }
+    return n ? n : config->sampling_n;
 }
 
-static void sflow_sample_http(SFLSampler *sampler, struct conn_rec *connection, SFLHTTP_method method, apr_uint32_t proto_num, const char *uri, const char *host, const char *referrer, const char *useragent, const char *xff, const char *authuser, const char *mimetype, apr_uint64_t req_bytes, apr_uint64_t resp_bytes, apr_uint32_t duration_uS, apr_uint32_t status)
+static bool_t sfwb_subsample(SFWBCollector *coll, apr_uint32_t ratio, bool_t hashed, apr_uint32_t hash, apr_uint32_t child_sampling_n)
+{
+    if(ratio <= 1) return true;
+    if(hashed) return (hash <= (0xFFFFFFFF / (child_sampling_n * ratio)));
+    if(coll->subsample_skip == 0
+       || coll->subsample_skip >= (2 * ratio)) {
+        /* first time, or the ratio came down */
+        coll->subsample_skip = sfl_random((2 * ratio) - 1);
+    }
+    if(--coll->subsample_skip == 0) {
+        coll->subsample_skip = sfl_random((2 * ratio) - 1);
+        return true;
+    }
+    return false;
+}
+
+/*_________________---------------------------__________________
+  _________________   collector rate limit    __________________
+  -----------------___________________________------------------
+  Each collector has a token bucket for bytes and another for
+  datagrams,  refilled every second up to one second's worth.  A
+  flow sample only goes in if there are bytes left for it,  on top
+  of what is already waiting in the datagram.
+*/
+
+static void sfwb_refillBuckets(SFWB *sm)
+{
+    apr_uint32_t c;
+    for(c = 0; c < sm->config->num_collectors; c++) {
+        SFWBCollector *coll = &sm->config->collectors[c];
+        coll->bucket_bytes += coll->bytes_per_s;
+        if(coll->bucket_bytes > coll->bytes_per_s) coll->bucket_bytes = coll->bytes_per_s;
+        coll->bucket_pkts += coll->pkts_per_s;
+        if(coll->bucket_pkts > coll->pkts_per_s) coll->bucket_pkts = coll->pkts_per_s;
+    }
+}
+
+static bool_t sfwb_overBudget(SFWBCollector *coll, apr_uint32_t sampleBytes)
+{
+    if(coll->bytes_per_s
+       && (coll->bucket_bytes - (apr_int64_t)coll->receiver->sampleCollector.pktlen) < (apr_int64_t)sampleBytes) return true;
+    if(coll->pkts_per_s
+       && coll->bucket_pkts <= 0) return true;
+    return false;
+}
+
+/*_________________---------------------------__________________
+  _________________   ipv4MappedAddress       __________________
+  -----------------___________________________------------------
+*/
+
+static bool_t ipv4MappedAddress(SFLIPv6 *ipv6addr, SFLIPv4 *ip4addr) {
+    static char mapped_prefix[] = { 0,0,0,0,0,0,0,0,0,0,0xFF,0xFF };
+    static char compat_prefix[] = { 0,0,0,0,0,0,0,0,0,0,0,0 };
+    if(!memcmp(ipv6addr->addr, mapped_prefix, 12) ||
+       !memcmp(ipv6addr->addr, compat_prefix, 12)) {
+        memcpy(ip4addr, ipv6addr->addr + 12, 4);
+        return true;
+    }
+    return false;
+}
+
+/*_________________---------------------------__________________
+  _________________   loopbackAddress         __________________
+  -----------------___________________________------------------
+*/
+
+static bool_t loopbackAddress(apr_sockaddr_t *sa) {
+    static char loopback6[] = { 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1 };
+    SFLIPv4 ip4addr;
+    if(sa == NULL) return false;
+    if(sa->family == APR_INET) {
+        return (((apr_byte_t *)sa->ipaddr_ptr)[0] == 127);
+    }
+    if(sa->family == APR_INET6) {
+        if(!memcmp(sa->ipaddr_ptr, loopback6, 16)) return true;
+        if(ipv4MappedAddress((SFLIPv6 *)sa->ipaddr_ptr, &ip4addr)) {
+            return (((apr_byte_t *)&ip4addr.addr)[0] == 127);
+        }
+    }
+    return false;
+}
+
+/*_________________---------------------------__________________
+  _________________   sflow_sample_http       __________________
+  -----------------___________________________------------------
+*/
+
+
+static int my_strnlen(const char *s, apr_size_t max) {
+    apr_int32_t i;
+    if(s == NULL) return 0;
+    for(i = 0; i < max; i++) if(s[i] == '\0') return i;
+    return max;
+}
+
+static void sflow_sample_http(SFLSampler *sampler, struct conn_rec *connection, SFLHTTP_method method, apr_uint32_t proto_num, const char *uri, const char *host, const char *referrer, const char *useragent, const char *xff, const char *authuser, const char *mimetype, apr_uint64_t req_bytes, apr_uint64_t resp_bytes, apr_uint32_t duration_uS, apr_uint32_t status, SFLFlow_sample_element *extra)
 {
     
     SFL_FLOW_SAMPLE_TYPE fs = { 0 };
@@ -610,6 +1689,13 @@ static void sflow_sample_http(SFLSampler *sampler, struct conn_rec *connection,
             }
         }
     }
+
+    /* and any others the caller has (SFLADD_ELEMENT overwrites nxt) */
+    while(extra) {
+        SFLFlow_sample_element *nxt = extra->nxt;
+        SFLADD_ELEMENT(&fs, extra);
+        extra = nxt;
+    }
     
     sfl_sampler_writeFlowSample(sampler, &fs);
 }
@@ -681,6 +1767,19 @@ static void sfwb_syntaxError(SFWBConfig *cfg, apr_uint32_t line, char *msg) {
     ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL, "syntax error on line %u: %s", line, msg);
 }    
 
+static SFWBCollectorOpts *sfwb_collectorOpts(SFWBConfig *cfg, char *name, bool_t create) {
+    apr_uint32_t i;
+    for(i = 0; i < cfg->num_collector_opts; i++) {
+        if(strcasecmp(cfg->collector_opts[i].name, name) == 0) return &cfg->collector_opts[i];
+    }
+    if(create && cfg->num_collector_opts < SFWB_MAX_COLLECTORS) {
+        SFWBCollectorOpts *opts = &cfg->collector_opts[cfg->num_collector_opts++];
+        opts->name = apr_pstrdup(cfg->pool, name);
+        return opts;
+    }
+    return NULL;
+}
+
 static SFWBConfig *sfwb_readConfig(SFWB *sm, server_rec *s)
 {
     apr_uint32_t rev_start = 0;
@@ -706,7 +1805,7 @@ static SFWBConfig *sfwb_readConfig(SFWB *sm, server_rec *s)
     }
     char line[SFWB_MAX_LINELEN+1];
     apr_uint32_t lineNo = 0;
-    char *tokv[5];
+    char *tokv[SFWB_MAX_TOKENS + 1];
     apr_uint32_t tokc;
     while(fgets(line, SFWB_MAX_LINELEN, cfg)) {
         apr_int32_t i;
@@ -714,11 +1813,11 @@ static SFWBConfig *sfwb_readConfig(SFWB *sm, server_rec *s)
         lineNo++;
         /* comments start with '#' */
         p[strcspn(p, "#")] = '\0';
-        /* 1 var and up to 3 value tokens, so detect up to 5 tokens overall */
+        /* 1 var and up to 4 value tokens, so detect one more than that */
         /* so we know if there was an extra one that should be flagged as a */
         /* syntax error. */
         tokc = 0;
-        for(i = 0; i < 5; i++) {
+        for(i = 0; i < (SFWB_MAX_TOKENS + 1); i++) {
             apr_size_t len;
             p += strspn(p, SFWB_SEPARATORS);
             if((len = strcspn(p, SFWB_SEPARATORS)) == 0) break;
@@ -757,6 +1856,94 @@ static SFWBConfig *sfwb_readConfig(SFWB *sm, server_rec *s)
                 config->sampling_n = strtol(tokv[1], NULL, 0);
                 config->got_sampling_n_http = true;
             }
+            else if(strcasecmp(tokv[0], "sampling.http.target") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 2, "sampling.http.target=<samples/sec>")) {
+                config->sampling_target = strtol(tokv[1], NULL, 0);
+            }
+            else if(strcasecmp(tokv[0], "sampling.http.5xx") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 2, "sampling.http.5xx=<int>")) {
+                config->sampling_n_5xx = strtol(tokv[1], NULL, 0);
+            }
+            else if(strcasecmp(tokv[0], "sampling.http.slow") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 3, 3, "sampling.http.slow=<int> <mS>")) {
+                config->sampling_n_slow = strtol(tokv[1], NULL, 0);
+                config->slow_mS = strtol(tokv[2], NULL, 0);
+            }
+            else if(strcasecmp(tokv[0], "sampling.http.hash") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 2, "sampling.http.hash=<request-id header>")) {
+                if(strlen(tokv[1]) < SFWB_MAX_HASH_HEADER_LEN) config->hash_header = apr_pstrdup(pool, tokv[1]);
+                else sfwb_syntaxError(config, lineNo, "header name too long");
+            }
+            else if(strcasecmp(tokv[0], "counters.http") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 2, "counters.http=hook|scoreboard")) {
+                if(strcasecmp(tokv[1], "scoreboard") == 0) config->scoreboard_counters = true;
+                else if(strcasecmp(tokv[1], "hook") == 0) config->scoreboard_counters = false;
+                else sfwb_syntaxError(config, lineNo, "expected counters.http=hook|scoreboard");
+            }
+            else if(strcasecmp(tokv[0], "datasource.http") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 2, "datasource.http=server|vhost")) {
+                if(strcasecmp(tokv[1], "vhost") == 0) config->vhost_datasources = true;
+                else if(strcasecmp(tokv[1], "server") == 0) config->vhost_datasources = false;
+                else sfwb_syntaxError(config, lineNo, "expected datasource.http=server|vhost");
+            }
+            else if(strcasecmp(tokv[0], "classes.http") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 2, "classes.http=<file>")) {
+                config->uri_classes_file = apr_pstrdup(pool, tokv[1]);
+            }
+            else if(strcasecmp(tokv[0], "clients.http") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 3, "clients.http=<file>[ connection|useragent]")) {
+                config->client_groups_file = apr_pstrdup(pool, tokv[1]);
+                if(tokc < 3 || strcasecmp(tokv[2], "connection") == 0) config->client_groups_useragent = false;
+                else if(strcasecmp(tokv[2], "useragent") == 0) config->client_groups_useragent = true;
+                else sfwb_syntaxError(config, lineNo, "expected clients.http=<file>[ connection|useragent]");
+            }
+            else if(strcasecmp(tokv[0], "inflight.http") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 3, "inflight.http=<seconds>[ <samples/sec>]")) {
+                config->inflight_S = strtol(tokv[1], NULL, 0);
+                config->inflight_samples = (tokc > 2) ? strtol(tokv[2], NULL, 0) : SFWB_DEFAULT_INFLIGHT_SAMPLES;
+            }
+            else if(strcasecmp(tokv[0], "queue.http") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 2, "queue.http=on|off")) {
+                if(strcasecmp(tokv[1], "on") == 0) config->queue_wait = true;
+                else if(strcasecmp(tokv[1], "off") == 0) config->queue_wait = false;
+                else sfwb_syntaxError(config, lineNo, "expected queue.http=on|off");
+            }
+            else if(strcasecmp(tokv[0], "topk.http") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 2, "topk.http=on|off")) {
+                if(strcasecmp(tokv[1], "on") == 0) config->topk = true;
+                else if(strcasecmp(tokv[1], "off") == 0) config->topk = false;
+                else sfwb_syntaxError(config, lineNo, "expected topk.http=on|off");
+            }
+            else if(strcasecmp(tokv[0], "distinct.http") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 3, "distinct.http=on|off[ <session cookie>]")) {
+                if(strcasecmp(tokv[1], "on") == 0) config->distinct = true;
+                else if(strcasecmp(tokv[1], "off") == 0) config->distinct = false;
+                else sfwb_syntaxError(config, lineNo, "expected distinct.http=on|off[ <session cookie>]");
+                if(tokc > 2) {
+                    if(strlen(tokv[2]) < SFWB_MAX_SESSION_COOKIE_LEN) config->session_cookie = apr_pstrdup(pool, tokv[2]);
+                    else sfwb_syntaxError(config, lineNo, "cookie name too long");
+                }
+            }
+            else if((strcasecmp(tokv[0], "exclude.http.uri") == 0
+                     || strcasecmp(tokv[0], "exclude.http.useragent") == 0
+                     || strcasecmp(tokv[0], "exclude.http.client") == 0)
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 2, "exclude.http.uri|useragent|client=<prefix>")) {
+                apr_uint32_t type = SFWB_EXCLUDE_URI;
+                if(strcasecmp(tokv[0], "exclude.http.useragent") == 0) type = SFWB_EXCLUDE_USERAGENT;
+                else if(strcasecmp(tokv[0], "exclude.http.client") == 0) type = SFWB_EXCLUDE_CLIENT;
+                if(config->num_exclude_rules >= SFWB_MAX_EXCLUDE_RULES) {
+                    sfwb_syntaxError(config, lineNo, "exceeded max exclude rules");
+                }
+                else if(type == SFWB_EXCLUDE_USERAGENT
+                        && strlen(tokv[1]) >= SFWB_MAX_EXCLUDE_USERAGENT_LEN) {
+                    sfwb_syntaxError(config, lineNo, "User-Agent prefix too long");
+                }
+                else {
+                    SFWBExcludeRule *rule = &config->exclude_rules[config->num_exclude_rules++];
+                    rule->type = type;
+                    rule->value = apr_pstrdup(pool, tokv[1]);
+                }
+            }
             else if(strcasecmp(tokv[0], "polling") == 0 
                     && sfwb_syntaxOK(config, lineNo, tokc, 2, 2, "polling=<int>")) {
                 if(!config->got_polling_secs_http) {
@@ -780,6 +1967,7 @@ static SFWBConfig *sfwb_readConfig(SFWB *sm, server_rec *s)
                 if(config->num_collectors < SFWB_MAX_COLLECTORS) {
                     apr_uint32_t i = config->num_collectors++;
                     apr_uint32_t port = tokc >= 3 ? strtol(tokv[2], NULL, 0) : 6343;
+                    config->collectors[i].name = apr_pstrdup(pool, tokv[1]);
                     config->collectors[i].priority = tokc >= 4 ? strtol(tokv[3], NULL, 0) : 0;
                     if((rc = apr_sockaddr_info_get(&config->collectors[i].sa,
                                                    tokv[1],
@@ -794,6 +1982,31 @@ static SFWBConfig *sfwb_readConfig(SFWB *sm, server_rec *s)
                     sfwb_syntaxError(config, lineNo, "exceeded max collectors");
                 }
             }
+            else if(strcasecmp(tokv[0], "collector.datagram") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 3, 3, "collector.datagram=<IP address> <bytes>")) {
+                SFWBCollectorOpts *opts = sfwb_collectorOpts(config, tokv[1], true);
+                if(opts) opts->max_datagram = strtol(tokv[2], NULL, 0);
+                else sfwb_syntaxError(config, lineNo, "exceeded max collectors");
+            }
+            else if(strcasecmp(tokv[0], "collector.sampling") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 3, 3, "collector.sampling=<IP address> <int>")) {
+                SFWBCollectorOpts *opts = sfwb_collectorOpts(config, tokv[1], true);
+                if(opts) opts->sampling_n = strtol(tokv[2], NULL, 0);
+                else sfwb_syntaxError(config, lineNo, "exceeded max collectors");
+            }
+            else if(strcasecmp(tokv[0], "collector.failover") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 2, 2, "collector.failover=0|1")) {
+                config->collector_failover = (strtol(tokv[1], NULL, 0) != 0);
+            }
+            else if(strcasecmp(tokv[0], "collector.ratelimit") == 0
+                    && sfwb_syntaxOK(config, lineNo, tokc, 3, 4, "collector.ratelimit=<IP address> <bytes/sec>[ <datagrams/sec>]")) {
+                SFWBCollectorOpts *opts = sfwb_collectorOpts(config, tokv[1], true);
+                if(opts) {
+                    opts->bytes_per_s = strtol(tokv[2], NULL, 0);
+                    opts->pkts_per_s = tokc >= 4 ? strtol(tokv[3], NULL, 0) : 0;
+                }
+                else sfwb_syntaxError(config, lineNo, "exceeded max collectors");
+            }
             else if(strcasecmp(tokv[0], "ds_index") == 0
                     && sfwb_syntaxOK(config, lineNo, tokc, 2, 2, "ds_index=<int>")) {
                 config->parent_ds_index = strtol(tokv[1], NULL, 0);
@@ -815,6 +2028,29 @@ static SFWBConfig *sfwb_readConfig(SFWB *sm, server_rec *s)
     if(config->agentIP.type == SFLADDRESSTYPE_UNDEFINED) {
         sfwb_syntaxError(config, 0, "agentIP=<IP address>|<IPv6 address>");
     }
+
+    /* a zero threshold would put every request in the slow stratum */
+    if(config->slow_mS == 0) config->sampling_n_slow = 0;
+
+    /* resolve the per-collector settings */
+    {
+        apr_uint32_t c;
+        for(c = 0; c < config->num_collectors; c++) {
+            SFWBCollector *coll = &config->collectors[c];
+            SFWBCollectorOpts *opts = sfwb_collectorOpts(config, coll->name, false);
+            if(opts && opts->max_datagram) coll->max_datagram = opts->max_datagram;
+            else if(loopbackAddress(coll->sa)) coll->max_datagram = SFWB_LOOPBACK_DATAGRAM_SIZE;
+            else coll->max_datagram = SFL_DEFAULT_DATAGRAM_SIZE;
+            coll->sampling_n = (opts && opts->sampling_n) ? opts->sampling_n : config->sampling_n;
+            if(opts) {
+                coll->bytes_per_s = opts->bytes_per_s;
+                coll->pkts_per_s = opts->pkts_per_s;
+                /* start with a full bucket */
+                coll->bucket_bytes = coll->bytes_per_s;
+                coll->bucket_pkts = coll->pkts_per_s;
+            }
+        }
+    }
     
     if((rev_start == rev_end) && !config->error) {
         return config;
@@ -837,8 +2073,14 @@ static void sfwb_apply_config(SFWB *sm, SFWBConfig *config, server_rec *s)
     if(config) {
         /* apply the new one */
         sm->config = config;
+        sfwb_loadUriClasses(sm, s);
+        sfwb_loadClientGroups(sm, s);
         sflow_init(sm, s);
     }
+    else {
+        /* disabled - don't leave a pointer to the config we are about to free */
+        sm->config = NULL;
+    }
 
     if(oldConfig) {
         /* free the old one */
@@ -851,7 +2093,7 @@ static void sfwb_apply_config(SFWB *sm, SFWBConfig *config, server_rec *s)
   -----------------___________________________------------------
 */
         
-apr_time_t configModified(SFWB *sm, server_rec *s) {
+static apr_time_t sfwb_fileModTime(SFWB *sm, server_rec *s, const char *path) {
     apr_status_t rc;
     apr_finfo_t configFileInfo;
     apr_pool_t *p;
@@ -860,8 +2102,8 @@ apr_time_t configModified(SFWB *sm, server_rec *s) {
     if((rc = apr_pool_create(&p, sm->configPool)) != APR_SUCCESS) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, " apr_pool_create() failed");
     }
-    if((rc = apr_stat(&configFileInfo, sm->configFile, APR_FINFO_MTIME, p)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_stat(%s) failed", sm->configFile);
+    if((rc = apr_stat(&configFileInfo, path, APR_FINFO_MTIME, p)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_stat(%s) failed", path);
     }
     else {
         mtime = configFileInfo.mtime;
@@ -870,871 +2112,3095 @@ apr_time_t configModified(SFWB *sm, server_rec *s) {
     return mtime;
 }
 
-/*_________________---------------------------__________________
-  _________________      1 second tick        __________________
-  -----------------___________________________------------------
-*/
-        
-void sflow_tick(SFWB *sm, server_rec *s) {
-    if(--sm->configCountDown <= 0) {
-        apr_time_t modTime = configModified(sm, s);
-        sm->configCountDown = SFWB_CONFIG_CHECK_S;
-        
-#ifdef SFWB_DEBUG
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "checking for config file change <%s>", sm->configFile);
-#endif
-
-        if(modTime == 0) {
-            /* config file missing */
-            sfwb_apply_config(sm, NULL, s);
-        }
-        else if(modTime != sm->configFile_modTime) {
-            /* config file modified */
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "config file changed <%s> t=%u", sm->configFile, (apr_int32_t)modTime);
-            SFWBConfig *newConfig = sfwb_readConfig(sm, s);
-            if(newConfig) {
-                /* config OK - apply it */
-                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "config file OK <%s>", sm->configFile);
-                sfwb_apply_config(sm, newConfig, s);
-                sm->configFile_modTime = modTime;
-            }
-            else {
-                /* bad config - ignore it (may be in transition) */
-                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "config file parse failed <%s>", sm->configFile);
-            }
-        }
-    }
-    
-    if(sm->agent && sm->config) {
-        sfl_agent_tick(sm->agent, sm->currentTime);
-    }
+apr_time_t configModified(SFWB *sm, server_rec *s) {
+    return sfwb_fileModTime(sm, s, sm->configFile);
 }
 
 /*_________________---------------------------__________________
-  _________________ lowest active listen port __________________
+  _________________   URI class compiler      __________________
   -----------------___________________________------------------
+  The rules are first built into an ordinary linked trie from a
+  scratch pool,  and then laid out depth-first in the idle shared
+  trie.  Each node's edges end up side by side,  and a run of nodes
+  with only one child (most of a long URI) is contiguous too.
 */
 
-static apr_uint16_t lowestActiveListenPort(server_rec *s)
-{
-    ap_listen_rec *lr = ap_listeners;
-    apr_uint16_t port = 0, p;
-    apr_sockaddr_t *localsoc = NULL;
+typedef struct _SFWBUriTrieBuild {
+    struct _SFWBUriTrieBuild *child;   /* first child,  sorted by c */
+    struct _SFWBUriTrieBuild *sibling;
+    apr_uint16_t prefixClass;
+    apr_uint16_t exactClass;
+    apr_byte_t c;
+} SFWBUriTrieBuild;
 
-    for( ; lr ; lr=lr->next) {
-        if(lr->active && lr->sd) {
-            if(apr_socket_addr_get(&localsoc, APR_LOCAL, lr->sd) == APR_SUCCESS) {
-                p = localsoc->port;
-                if(p &&
-                   (port == 0 || port > p)) {
-                    port = p;
-                }
-            }
-        }
+/* find a URI class or client group by name,  or add it */
+static apr_int32_t sfwb_shardIndex(SFWBShardShared *shards, apr_uint32_t *p_num, apr_uint32_t max, const char *name)
+{
+    apr_uint32_t c;
+    for(c = 0; c < *p_num; c++) {
+        if(strcmp(shards[c].name, name) == 0) return c;
     }
+    if(*p_num >= max) return -1;
+    /* name first,  so a child never sees a new one without it */
+    apr_cpystrn(shards[c].name, name, SFWB_MAX_SHARD_NAME);
+    apr_atomic_inc32(p_num);
+    return c;
+}
 
-    if(port == 0) {
-        /* fallback - maybe the server_rec has a port number for us */
-        port = s->port;
+static bool_t sfwb_uriTrieInsert(SFWBUriTrieBuild *node, const char *prefix, apr_uint32_t *p_nodes, apr_pool_t *pool)
+{
+    const apr_byte_t *p;
+    for(p = (const apr_byte_t *)prefix; *p; p++) {
+        SFWBUriTrieBuild **link = &node->child;
+        while(*link && (*link)->c < *p) link = &(*link)->sibling;
+        if(*link == NULL || (*link)->c != *p) {
+            if(*p_nodes >= SFWB_URI_TRIE_MAX_NODES) return false;
+            (*p_nodes)++;
+            SFWBUriTrieBuild *nn = apr_pcalloc(pool, sizeof(SFWBUriTrieBuild));
+            nn->c = *p;
+            nn->sibling = *link;
+            *link = nn;
+        }
+        node = *link;
     }
+    return true;
+}
 
-    if(port == 0) {
-        /* ultimate fallback - the hard-coded default */
-        port = DEFAULT_HTTP_PORT;
+static SFWBUriTrieBuild *sfwb_uriTrieFind(SFWBUriTrieBuild *node, const char *prefix)
+{
+    const apr_byte_t *p;
+    for(p = (const apr_byte_t *)prefix; *p && node; p++) {
+        for(node = node->child; node && node->c != *p; node = node->sibling);
     }
-    return port;
+    return node;
 }
 
-/*_________________---------------------------__________________
-  _________________  master sflow agent init  __________________
-  -----------------___________________________------------------
-*/
+/* add one rule,  with a trailing '$' for an exact match.  The value
+   is the class + 1,  or SFWB_SHARD_EXCLUDED */
+static bool_t sfwb_uriTrieAdd(SFWBUriTrieBuild *root, char *prefix, apr_uint32_t value, apr_uint32_t *p_nodes, apr_pool_t *pool)
+{
+    apr_size_t len = strlen(prefix);
+    bool_t exact = (len > 1 && prefix[len - 1] == '$');
+    if(exact) prefix[len - 1] = '\0';
+    if(!sfwb_uriTrieInsert(root, prefix, p_nodes, pool)) return false;
+    /* (a later rule for the same prefix wins) */
+    SFWBUriTrieBuild *node = sfwb_uriTrieFind(root, prefix);
+    if(exact) node->exactClass = value;
+    else node->prefixClass = value;
+    return true;
+}
 
-static void sflow_init(SFWB *sm, server_rec *s)
+static void sfwb_loadUriClasses(SFWB *sm, server_rec *s)
 {
+    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+    apr_uint32_t next = (shared->uri_trie_active ^ 1) & 1;
+    SFWBUriTrie *trie = &shared->uri_trie[next];
+    const char *file = sm->config ? sm->config->uri_classes_file : NULL;
+    apr_uint32_t num_excludes = 0, i;
     apr_status_t rc;
-    apr_uint16_t servicePort;
+    apr_pool_t *pool;
 
-    if(sm->configFile == NULL) {
-        sm->configFile = SFWB_DEFAULT_CONFIGFILE;
+    if(sm->config) {
+        for(i = 0; i < sm->config->num_exclude_rules; i++) {
+            if(sm->config->exclude_rules[i].type == SFWB_EXCLUDE_URI) num_excludes++;
+        }
     }
 
-    if(sm->config == NULL) return;
-
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "in sflow_init: building sFlow agent");
-
-    {
-        /* create or re-create the agent */
-        if(sm->agent) {
-            sfl_agent_release(sm->agent);
-            apr_pool_clear(sm->masterPool);
-            sm->socket4 = NULL;
-            sm->socket6 = NULL;
+    trie->num_nodes = 0;
+    sm->uriClassesFile_modTime = 0;
+    if((file || num_excludes)
+       && (rc = apr_pool_create(&pool, sm->configPool)) == APR_SUCCESS) {
+        SFWBUriTrieBuild *root = apr_pcalloc(pool, sizeof(SFWBUriTrieBuild));
+        apr_uint32_t nodes = 1, rule_count = 0;
+        FILE *rules = NULL;
+        if(file == NULL) {
+            /* just the exclusions */
         }
-
-        sm->agent = (SFLAgent *)apr_pcalloc(sm->masterPool, sizeof(SFLAgent));
-
-        /* open the send sockets - one for v4 and another for v6 */
-        if(!sm->socket4) {
-            if((rc = apr_socket_create(&sm->socket4, APR_INET, SOCK_DGRAM, APR_PROTO_UDP, sm->masterPool)) != APR_SUCCESS)
-                ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "IPv4 send socket open failed");
+        else if((rules = fopen(file, "r")) == NULL) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "cannot open URI classes file %s : %s", file, strerror(errno));
         }
-        if(!sm->socket6) {
-            if((rc = apr_socket_create(&sm->socket6, APR_INET6, SOCK_DGRAM, APR_PROTO_UDP, sm->masterPool)) != APR_SUCCESS)
-                ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "IPv6 send socket open failed");
+        else {
+            apr_uint32_t lineNo = 0;
+            char line[SFWB_MAX_LINELEN+1];
+            sm->uriClassesFile_modTime = sfwb_fileModTime(sm, s, file);
+            while(fgets(line, SFWB_MAX_LINELEN, rules)) {
+                char *last = NULL;
+                lineNo++;
+                line[strcspn(line, "#")] = '\0';
+                char *name = apr_strtok(line, " \t\r\n", &last);
+                char *prefix = name ? apr_strtok(NULL, " \t\r\n", &last) : NULL;
+                if(name == NULL) continue;
+                if(prefix == NULL
+                   || apr_strtok(NULL, " \t\r\n", &last) != NULL
+                   || strlen(name) >= SFWB_MAX_SHARD_NAME) {
+                    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "URI classes file %s line %u: expected <class> <uri-prefix>", file, lineNo);
+                    continue;
+                }
+                apr_int32_t cls = sfwb_shardIndex(shared->uri_class, &shared->num_uri_classes, SFWB_MAX_URI_CLASSES, name);
+                if(cls < 0) {
+                    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "URI classes file %s line %u: exceeded max classes (%u)", file, lineNo, SFWB_MAX_URI_CLASSES);
+                    continue;
+                }
+                if(!sfwb_uriTrieAdd(root, prefix, cls + 1, &nodes, pool)) {
+                    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "URI classes file %s line %u: exceeded max trie nodes (%u)", file, lineNo, SFWB_URI_TRIE_MAX_NODES);
+                    break;
+                }
+                rule_count++;
+            }
+            fclose(rules);
         }
 
-        servicePort = lowestActiveListenPort(s);
-        
-        /* initialize the agent with it's address, bootime, callbacks etc. */
-        sfl_agent_init(sm->agent,
-                       &sm->config->agentIP,
-                       0, /* subAgentId */
-                       sm->currentTime,
-                       sm->currentTime,
-                       sm,
-                       sfwb_cb_alloc,
-                       sfwb_cb_free,
-                       sfwb_cb_error,
-                       sfwb_cb_sendPkt);
-        
-        /* add a receiver */
-        sm->receiver = sfl_agent_addReceiver(sm->agent);
-        sfl_receiver_set_sFlowRcvrOwner(sm->receiver, "httpd sFlow Probe");
-        sfl_receiver_set_sFlowRcvrTimeout(sm->receiver, 0xFFFFFFFF);
-        
-        /* no need to configure the receiver further, because we are */
-        /* using the sendPkt callback to handle the forwarding ourselves. */
-        
-        /* add a <logicalEntity> datasource to represent this application instance */
-        SFLDataSource_instance dsi;
-        /* ds_class = <logicalEntity>, ds_index = <listen port>, ds_instance = 0 */
-
-        SFL_DS_SET(dsi, SFL_DSCLASS_LOGICAL_ENTITY, servicePort, 0);
-          
-        /* add a poller for the counters */
-        sm->poller = sfl_agent_addPoller(sm->agent, &dsi, sm, sfwb_cb_counters);
-        sfl_poller_set_sFlowCpInterval(sm->poller, sm->config->polling_secs);
-        sfl_poller_set_sFlowCpReceiver(sm->poller, 1 /* receiver index == 1 */);
-        
-        /* add a sampler for the sampled operations */
-        sm->sampler = sfl_agent_addSampler(sm->agent, &dsi);
-        sfl_sampler_set_sFlowFsPacketSamplingRate(sm->sampler, sm->config->sampling_n);
-        sfl_sampler_set_sFlowFsReceiver(sm->sampler, 1 /* receiver index == 1 */);
-        
-        if(sm->config->sampling_n) {
-            /* IPC to the child processes */
-            SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
-            shared->sflow_skip = sm->config->sampling_n;
+        /* the exclusions go in last,  so they win over a class rule for the same prefix */
+        for(i = 0; i < sm->config->num_exclude_rules; i++) {
+            SFWBExcludeRule *rule = &sm->config->exclude_rules[i];
+            if(rule->type != SFWB_EXCLUDE_URI) continue;
+            if(!sfwb_uriTrieAdd(root, apr_pstrdup(pool, rule->value), SFWB_SHARD_EXCLUDED, &nodes, pool)) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "exclude.http.uri=%s: exceeded max trie nodes (%u)", rule->value, SFWB_URI_TRIE_MAX_NODES);
+                break;
+            }
         }
 
-#ifdef SFWB_DEBUG
-        /* test the agent error reporting mechanism to make sure it is working */
-        sfl_agent_error(sm->agent, "error-log-test", "agent init complete");
-#endif
-
+        /* the children of a node are numbered when its edges are laid out,
+           and the stack takes the last of them next */
+        SFWBUriTrieBuild **order = apr_palloc(pool, nodes * sizeof(SFWBUriTrieBuild *));
+        apr_uint32_t *stack = apr_palloc(pool, nodes * sizeof(apr_uint32_t));
+        apr_uint32_t tail = 0, sp = 0, edges = 0;
+        order[tail] = root;
+        stack[sp++] = tail++;
+        while(sp) {
+            apr_uint32_t idx = stack[--sp];
+            SFWBUriTrieBuild *bn = order[idx];
+            SFWBUriTrieNode *tn = &trie->node[idx];
+            tn->firstEdge = edges;
+            tn->numEdges = 0;
+            tn->prefixClass = bn->prefixClass;
+            tn->exactClass = bn->exactClass;
+            SFWBUriTrieBuild *ch;
+            for(ch = bn->child; ch; ch = ch->sibling) {
+                trie->edge[edges++] = ((apr_uint32_t)ch->c << 24) + tail;
+                tn->numEdges++;
+                order[tail] = ch;
+                stack[sp++] = tail++;
+            }
+        }
+        trie->num_nodes = tail;
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "URI classes file %s: %u rules,  %u classes,  %u exclusions,  %u trie nodes",
+                     file ? file : "(none)",
+                     rule_count,
+                     shared->num_uri_classes,
+                     num_excludes,
+                     tail);
+        apr_pool_destroy(pool);
     }
+
+    /* switch the children over.  A request thread could still be part way
+       down the other trie,  but that one won't be touched again until the
+       next reload,  and the lookup never strays outside the arrays anyway. */
+    apr_atomic_xchg32(&shared->uri_trie_active, next);
 }
 
+static bool_t sfwb_uriClassesModified(SFWB *sm, server_rec *s)
+{
+    const char *file = sm->config ? sm->config->uri_classes_file : NULL;
+    return (file && sfwb_fileModTime(sm, s, file) != sm->uriClassesFile_modTime);
+}
 
 /*_________________---------------------------__________________
-  _________________   sFlow master process    __________________
+  _________________   client group compiler   __________________
   -----------------___________________________------------------
+  A binary radix tree,  one bit per level,  built from a scratch
+  pool.  Then an in-order walk writes out a new range wherever the
+  longest-matching group changes,  straight into the idle table.
 */
 
-static void sflow_master_sigterm(int sig) {
-    /* just set the flag to cause the master thread to terminate gracefully */
-    sflow_master_running = false;
+typedef struct _SFWBClientBuild {
+    struct _SFWBClientBuild *child[2];
+    apr_uint16_t group; /* group + 1,  or 0 */
+} SFWBClientBuild;
+
+typedef struct _SFWBClientEmit {
+    SFWBClientTable *table;
+    bool_t v6;
+    apr_uint32_t lastGroup;
+} SFWBClientEmit;
+
+#define SFWB_ADDR_BIT(addr, b) (((addr)[(b) >> 3] >> (7 - ((b) & 7))) & 1)
+
+static apr_uint64_t sfwb_addr64(const apr_byte_t *addr)
+{
+    apr_uint64_t val = 0;
+    apr_uint32_t i;
+    for(i = 0; i < 8; i++) val = (val << 8) | addr[i];
+    return val;
 }
 
-static apr_status_t run_sflow_master(apr_pool_t *p, server_rec *s, SFWB *sm)
+static void sfwb_clientEmitRange(SFWBClientEmit *em, const apr_byte_t *addr, apr_uint32_t group)
 {
-    apr_status_t rc;
-    bool_t pipe_err = false;
+    SFWBClientTable *table = em->table;
+    apr_uint32_t n = em->v6 ? table->num_v6 : table->num_v4;
+    if(n && group == em->lastGroup) return;
+    if(n >= SFWB_MAX_CLIENT_RANGES) return; /* (can't happen) */
+    em->lastGroup = group;
+    if(em->v6) {
+        SFWBClientRange6 *rng = &table->v6[table->num_v6++];
+        rng->start_hi = sfwb_addr64(addr);
+        rng->start_lo = sfwb_addr64(addr + 8);
+        rng->group = group;
+    }
+    else {
+        SFWBClientRange4 *rng = &table->v4[table->num_v4++];
+        rng->start = ((apr_uint32_t)addr[0] << 24) | (addr[1] << 16) | (addr[2] << 8) | addr[3];
+        rng->group = group;
+    }
+}
 
-#ifdef SFWB_DEBUG
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "run_sflow_master - pid=%u", getpid());
-#endif
-    
-    /* read with timeout just under a second so that the sflow_tick can be issued every second.*/
-    if((rc = apr_file_pipe_timeout_set(sm->pipe_read, 900000 /* uS */)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_file_pipe_timeout_set() failed");
-        return rc;
+static void sfwb_clientEmit(SFWBClientEmit *em, SFWBClientBuild *node, apr_byte_t *addr, apr_uint32_t depth, apr_uint32_t group)
+{
+    if(node->group) group = node->group;
+    if(node->child[0] == NULL && node->child[1] == NULL) {
+        sfwb_clientEmitRange(em, addr, group);
+        return;
     }
-    
-    /* register the SIGTERM handler to provide a way of stopping this process gracefully
-     * although often it will exit before we get around to killing it, when read on the pipe fails.
-     */
-    apr_signal(SIGTERM, sflow_master_sigterm);
+    apr_uint32_t b;
+    for(b = 0; b < 2; b++) {
+        if(b) addr[depth >> 3] |= (0x80 >> (depth & 7));
+        if(node->child[b]) sfwb_clientEmit(em, node->child[b], addr, depth + 1, group);
+        else sfwb_clientEmitRange(em, addr, group);
+    }
+    addr[depth >> 3] &= ~(0x80 >> (depth & 7));
+}
 
-    sflow_master_running = true;
+/* "<address>[/<bits>]",  v4 or v6 */
+static bool_t sfwb_clientParsePrefix(char *prefix, apr_byte_t *addr, apr_uint32_t *p_bits, bool_t *p_v6)
+{
+    bool_t v6 = (strchr(prefix, ':') != NULL);
+    apr_uint32_t maxBits = v6 ? 128 : 32;
+    apr_uint32_t bits = maxBits;
+    char *slash = strchr(prefix, '/');
+    if(slash) {
+        *slash++ = '\0';
+        bits = strtol(slash, NULL, 0);
+    }
+    if(bits > maxBits
+       || inet_pton(v6 ? AF_INET6 : AF_INET, prefix, addr) != 1) return false;
+    *p_bits = bits;
+    *p_v6 = v6;
+    return true;
+}
 
-    /* now loop forever - unless we encounter some kind of error or signal */
-    while(sflow_master_running) {
+/* the value is the group + 1,  or SFWB_SHARD_EXCLUDED */
+static void sfwb_clientInsert(SFWBClientBuild *node, const apr_byte_t *addr, apr_uint32_t bits, apr_uint32_t value, apr_pool_t *pool)
+{
+    apr_uint32_t b;
+    for(b = 0; b < bits; b++) {
+        apr_uint32_t bit = SFWB_ADDR_BIT(addr, b);
+        if(node->child[bit] == NULL) node->child[bit] = apr_pcalloc(pool, sizeof(SFWBClientBuild));
+        node = node->child[bit];
+    }
+    /* (a later rule for the same prefix wins) */
+    node->group = value;
+}
 
-        /* send ticks */
-        /* segfaults here if mod_sflow.so is overwritten.  Need to remove it first,  then copy in the
-           new one!  apxs(1) will just overwrite the file,  so this is an important step to observe when
-           upgrading (see apache bug #47951 - apparently fixed in version 2.4.1).
-           rpm will remove the previous file before installing the new one,  so it's not an issue if you
-           use rpm. */
-        apr_time_t now = apr_time_sec(apr_time_now());
+static void sfwb_loadClientGroups(SFWB *sm, server_rec *s)
+{
+    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+    apr_uint32_t next = (shared->client_table_active ^ 1) & 1;
+    SFWBClientTable *table = &shared->client_table[next];
+    const char *file = sm->config ? sm->config->client_groups_file : NULL;
+    apr_uint32_t num_excludes = 0, i;
+    apr_status_t rc;
+    apr_pool_t *pool;
 
-        if(sm->currentTime != now) {
-            sflow_tick(sm, s);
-            sm->currentTime = now;
+    if(sm->config) {
+        for(i = 0; i < sm->config->num_exclude_rules; i++) {
+            if(sm->config->exclude_rules[i].type == SFWB_EXCLUDE_CLIENT) num_excludes++;
         }
+    }
 
-        /* read a message from the pipe (or time out) */
-        apr_uint32_t msg[PIPE_BUF / sizeof(apr_uint32_t)];
+    table->num_v4 = 0;
+    table->num_v6 = 0;
+    sm->clientGroupsFile_modTime = 0;
+    shared->client_groups_useragent = sm->config ? sm->config->client_groups_useragent : false;
+    if((file || num_excludes)
+       && (rc = apr_pool_create(&pool, sm->configPool)) == APR_SUCCESS) {
+        SFWBClientBuild *root4 = apr_pcalloc(pool, sizeof(SFWBClientBuild));
+        SFWBClientBuild *root6 = apr_pcalloc(pool, sizeof(SFWBClientBuild));
+        apr_uint32_t prefixes4 = 0, prefixes6 = 0;
+        apr_byte_t addr[16];
+        apr_uint32_t bits;
+        bool_t v6;
+        FILE *rules = NULL;
+        if(file == NULL) {
+            /* just the exclusions */
+        }
+        else if((rules = fopen(file, "r")) == NULL) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "cannot open client groups file %s : %s", file, strerror(errno));
+        }
+        else {
+            apr_uint32_t lineNo = 0;
+            char line[SFWB_MAX_LINELEN+1];
+            sm->clientGroupsFile_modTime = sfwb_fileModTime(sm, s, file);
+            while(fgets(line, SFWB_MAX_LINELEN, rules)) {
+                char *last = NULL;
+                lineNo++;
+                line[strcspn(line, "#")] = '\0';
+                char *name = apr_strtok(line, " \t\r\n", &last);
+                char *prefix = name ? apr_strtok(NULL, " \t\r\n", &last) : NULL;
+                if(name == NULL) continue;
+                if(prefix == NULL
+                   || apr_strtok(NULL, " \t\r\n", &last) != NULL
+                   || strlen(name) >= SFWB_MAX_SHARD_NAME) {
+                    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "client groups file %s line %u: expected <group> <address>/<bits>", file, lineNo);
+                    continue;
+                }
+                if(!sfwb_clientParsePrefix(prefix, addr, &bits, &v6)) {
+                    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "client groups file %s line %u: bad address/prefix", file, lineNo);
+                    continue;
+                }
+                if((v6 ? prefixes6 : prefixes4) >= SFWB_MAX_CLIENT_PREFIXES) {
+                    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "client groups file %s line %u: exceeded max prefixes (%u)", file, lineNo, SFWB_MAX_CLIENT_PREFIXES);
+                    continue;
+                }
+                apr_int32_t grp = sfwb_shardIndex(shared->client_group, &shared->num_client_groups, SFWB_MAX_CLIENT_GROUPS, name);
+                if(grp < 0) {
+                    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "client groups file %s line %u: exceeded max groups (%u)", file, lineNo, SFWB_MAX_CLIENT_GROUPS);
+                    continue;
+                }
+                sfwb_clientInsert(v6 ? root6 : root4, addr, bits, grp + 1, pool);
+                if(v6) prefixes6++;
+                else prefixes4++;
+            }
+            fclose(rules);
+        }
 
-        /* just read the length and type first */
-        apr_size_t hdrBytes = 12;
-        apr_size_t hdrBytesRead = 0;
-        rc = apr_file_read_full(sm->pipe_read, msg, hdrBytes, &hdrBytesRead);
-        if(rc != APR_SUCCESS && !(APR_STATUS_IS_TIMEUP(rc))) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "run_sflow_master - apr_file_read_full() failed");
-            pipe_err = true;
-            break;
+        /* the exclusions go in last,  so they win over a group rule for the same prefix
+           (they have room of their own in the table) */
+        for(i = 0; i < sm->config->num_exclude_rules; i++) {
+            SFWBExcludeRule *rule = &sm->config->exclude_rules[i];
+            if(rule->type != SFWB_EXCLUDE_CLIENT) continue;
+            if(!sfwb_clientParsePrefix(apr_pstrdup(pool, rule->value), addr, &bits, &v6)) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "exclude.http.client=%s: bad address/prefix", rule->value);
+                continue;
+            }
+            sfwb_clientInsert(v6 ? root6 : root4, addr, bits, SFWB_SHARD_EXCLUDED, pool);
+            if(v6) prefixes6++;
+            else prefixes4++;
         }
 
-        if(rc == APR_SUCCESS && hdrBytesRead != 0) {
+        /* every prefix adds at most two ranges:  where it starts,  and where
+           the enclosing group takes over again after it */
+        SFWBClientEmit em = { 0 };
+        memset(addr, 0, sizeof(addr));
+        em.table = table;
+        em.v6 = false;
+        if(prefixes4) sfwb_clientEmit(&em, root4, addr, 0, 0);
+        em.v6 = true;
+        if(prefixes6) sfwb_clientEmit(&em, root6, addr, 0, 0);
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "client groups file %s: %u prefixes,  %u groups,  %u exclusions,  %u+%u ranges",
+                     file ? file : "(none)",
+                     prefixes4 + prefixes6,
+                     shared->num_client_groups,
+                     num_excludes,
+                     table->num_v4,
+                     table->num_v6);
+        apr_pool_destroy(pool);
+    }
 
-            if(hdrBytesRead != hdrBytes) break;
+    /* switch the children over (see sfwb_loadUriClasses) */
+    apr_atomic_xchg32(&shared->client_table_active, next);
+}
 
-            /* now read the rest */
-            apr_size_t msgBytes = msg[0];
-            apr_uint32_t msgType = msg[1];
-            apr_uint32_t msgId = msg[2];
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "run_sflow_master - msgType/id = %u/%u msgBytes=%u",
-                         msgType,
-                         (apr_uint32_t)msgId,
-                         (apr_uint32_t)msgBytes);
+static bool_t sfwb_clientGroupsModified(SFWB *sm, server_rec *s)
+{
+    const char *file = sm->config ? sm->config->client_groups_file : NULL;
+    return (file && sfwb_fileModTime(sm, s, file) != sm->clientGroupsFile_modTime);
+}
 
-            if(msgType != SFLCOUNTERS_SAMPLE && msgType != SFLFLOW_SAMPLE) break;
+/*_________________---------------------------__________________
+  _________________   space-saving sketch     __________________
+  -----------------___________________________------------------
+  (Metwally et al.)  Each entry counts one key.  A key that isn't
+  there takes over the entry with the smallest count,  and carries
+  that count on as its error,  so the counts add up to the total
+  and a key with more than 1/<size> of it is always in there.
+  Adding an entry from another sketch works the same way,  so a
+  merge is just a series of adds.  Used by the request threads,  the
+  child tick and the master alike.
+*/
 
-            if(msgBytes > PIPE_BUF) break;
+static void sfwb_topkInit(SFWBTopK *tk, apr_uint32_t size, apr_pool_t *pool)
+{
+    tk->size = size;
+    tk->num = 0;
+    tk->total = 0;
+    tk->hash = apr_pcalloc(pool, size * sizeof(apr_uint32_t));
+    tk->entry = apr_pcalloc(pool, size * sizeof(SFWBTopKEntry));
+}
 
-            apr_size_t bodyBytes = msgBytes - hdrBytes;
-            apr_size_t bodyBytesRead = 0;
-            if((rc = apr_file_read_full(sm->pipe_read, msg, bodyBytes, &bodyBytesRead)) != APR_SUCCESS) {
-                ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "run_sflow_master: apr_file_read_full() failed");
-                pipe_err = true;
-                break;
-            }
+/* FNV-1a again,  over as much of the name as is kept */
+static apr_uint32_t sfwb_topkHash(const char *name)
+{
+    apr_uint32_t hash = 2166136261U;
+    apr_size_t len = SFWB_TOPK_NAME - 1;
+    for(; len && *name; name++, len--) {
+        hash ^= (apr_byte_t)*name;
+        hash *= 16777619U;
+    }
+    return hash;
+}
 
-            if(bodyBytesRead != bodyBytes) break;
+static void sfwb_topkAdd(SFWBTopK *tk, apr_uint32_t hash, const char *name, apr_uint32_t count, apr_uint32_t error)
+{
+    apr_uint32_t i, num = tk->num;
+    tk->total += count;
+    for(i = 0; i < num; i++) {
+        if(tk->hash[i] == hash) {
+            tk->entry[i].count += count;
+            tk->entry[i].error += error;
+            return;
+        }
+    }
+    if(num < tk->size) {
+        i = num;
+        tk->num = num + 1;
+        tk->entry[i].count = count;
+        tk->entry[i].error = error;
+    }
+    else {
+        apr_uint32_t j;
+        for(i = 0, j = 1; j < num; j++) {
+            if(tk->entry[j].count < tk->entry[i].count) i = j;
+        }
+        tk->entry[i].error = tk->entry[i].count + error;
+        tk->entry[i].count += count;
+    }
+    tk->hash[i] = hash;
+    apr_cpystrn(tk->entry[i].name, name, SFWB_TOPK_NAME);
+}
 
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "run_sflow_master - bodyBytes read=%u", (apr_uint32_t)bodyBytesRead);
+static void sfwb_topkClear(SFWBTopK *tk)
+{
+    tk->num = 0;
+    tk->total = 0;
+}
 
-            /* we may not have initialized the agent yet,  so the first few samples may end up being ignored */
-            if(sm->sampler) {
-                apr_uint32_t *datap = msg;
-                if(msgType == SFLCOUNTERS_SAMPLE && msgId == SFLCOUNTERS_HTTP) {
-                    /* counter block */
-                    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
-                    SFLHTTP_counters c;
-                    memcpy(&c, datap, sizeof(c));
-                    /* accumulate into my total */
-                    shared->http_counters.counterBlock.http.method_option_count += c.method_option_count;
-                    shared->http_counters.counterBlock.http.method_get_count += c.method_get_count;
-                    shared->http_counters.counterBlock.http.method_head_count += c.method_head_count;
-                    shared->http_counters.counterBlock.http.method_post_count += c.method_post_count;
-                    shared->http_counters.counterBlock.http.method_put_count += c.method_put_count;
-                    shared->http_counters.counterBlock.http.method_delete_count += c.method_delete_count;
-                    shared->http_counters.counterBlock.http.method_trace_count += c.method_trace_count;
-                    shared->http_counters.counterBlock.http.method_connect_count += c.method_connect_count;
-                    shared->http_counters.counterBlock.http.method_other_count += c.method_other_count;
-                    shared->http_counters.counterBlock.http.status_1XX_count += c.status_1XX_count;
-                    shared->http_counters.counterBlock.http.status_2XX_count += c.status_2XX_count;
-                    shared->http_counters.counterBlock.http.status_3XX_count += c.status_3XX_count;
-                    shared->http_counters.counterBlock.http.status_4XX_count += c.status_4XX_count;
-                    shared->http_counters.counterBlock.http.status_5XX_count += c.status_5XX_count;
-                    shared->http_counters.counterBlock.http.status_other_count += c.status_other_count;
-                }
-                else if(msgType == SFLFLOW_SAMPLE && msgId == SFLFLOW_HTTP) {
-                    sm->sampler->samplePool += *datap++;
-                    sm->sampler->dropEvents += *datap++;
-                    /* next we have a flow sample that we can encode straight into the output,  but we have to put it */
-                    /* through our sampler object so that we get the right sequence numbers, pools and data-source ids. */
-                    apr_uint32_t sampleBytes = (msg + (bodyBytesRead>>2) - datap) << 2;
-                    sfl_sampler_writeEncodedFlowSample(sm->sampler, (char *)datap, sampleBytes);
-                }
-            }
+/* end of the window:  copy the biggest few into the shared mem,  and start again */
+static void sfwb_topkPublish(SFWBTopK *tk, SFWBTopKShared *pub, apr_uint32_t window_S)
+{
+    apr_byte_t taken[SFWB_TOPK_MASTER];
+    apr_uint32_t i, n, num = (tk->num < SFWB_TOPK_MASTER) ? tk->num : SFWB_TOPK_MASTER;
+    memset(taken, 0, sizeof(taken));
+    /* (the handler may be reading it,  so the count goes last) */
+    pub->num = 0;
+    for(n = 0; n < SFWB_TOPK_EXPORT && n < num; n++) {
+        apr_int32_t best = -1;
+        for(i = 0; i < num; i++) {
+            if(!taken[i] && (best < 0 || tk->entry[i].count > tk->entry[best].count)) best = i;
         }
+        taken[best] = 1;
+        pub->entry[n] = tk->entry[best];
     }
+    pub->window_S = window_S;
+    pub->total = tk->total;
+    pub->num = n;
+    sfwb_topkClear(tk);
+}
 
-#ifdef SFWB_DEBUG
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "run_sflow_master (pid=%u) loop exit: sflow_master_running=%s, pipe_err=%d",
-                 getpid(),
-                 sflow_master_running ? "true" : "false",
-                 pipe_err);
-#endif
-    
-    /* The pipe errors are what we actually expect to see if apache is restarted with SIGHUP or graceful(SIGUSR1), so only
-       log an error if we see something else */
-    if(!pipe_err && sflow_master_running) {
-        /* We should only get here if there was an unexpected message error that caused us to break out of the loop above */    
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "run_sflow_master - unexpected message error");
+/* the length of a heavy hitter or distinct client window */
+static apr_uint32_t sfwb_windowSecs(SFWB *sm)
+{
+    return (sm->config && sm->config->polling_secs) ? sm->config->polling_secs : SFWB_DEFAULT_WINDOW_S;
+}
+
+/*_________________---------------------------__________________
+  _________________   HyperLogLog estimate    __________________
+  -----------------___________________________------------------
+  The usual estimate,  with linear counting while there are still
+  empty registers and it's below 2.5m.  A 64-bit hash means there is
+  no large-range correction to do.  (apxs doesn't link libm,  so the
+  one log() needed is worked out here.)
+*/
+
+static double sfwb_ln(double x)
+{
+    /* x = y * 2^k with y in [1,2),  then ln(y) = 2 atanh((y - 1) / (y + 1)) */
+    apr_int32_t k = 0, i;
+    while(x >= 2.0) { x /= 2.0; k++; }
+    while(x < 1.0) { x *= 2.0; k--; }
+    double z = (x - 1.0) / (x + 1.0), z2 = z * z, term = z, sum = 0.0;
+    for(i = 1; i < 40; i += 2) {
+        sum += term / i;
+        term *= z2;
     }
-    
-    return APR_CHILD_DONE;
+    return (2.0 * sum) + (k * 0.69314718055994530942);
+}
+
+static apr_uint32_t sfwb_hllEstimate(apr_uint32_t *reg)
+{
+    double m = SFWB_HLL_REGISTERS;
+    double sum = 0.0;
+    apr_uint32_t i, zeros = 0;
+    for(i = 0; i < SFWB_HLL_REGISTERS; i++) {
+        apr_uint32_t rank = reg[i];
+        if(rank == 0) zeros++;
+        if(rank > 63) rank = 63;
+        sum += 1.0 / (double)((apr_uint64_t)1 << rank);
+    }
+    double est = (0.7213 / (1.0 + (1.079 / m))) * m * m / sum;
+    if(est <= (2.5 * m) && zeros) est = m * sfwb_ln(m / zeros);
+    return (apr_uint32_t)(est + 0.5);
+}
+
+/* end of the window:  switch the children to the other set and read this one.  A
+   request thread can still be adding to this set for a moment after the switch,  so
+   it is not cleared until the next window ends,  just before switching back to it. */
+static void sfwb_distinctWindow(SFWB *sm, apr_uint32_t window_S)
+{
+    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+    apr_uint32_t set = shared->hll_active & 1;
+    memset(shared->hll[set ^ 1], 0, sizeof(shared->hll[set ^ 1]));
+    apr_atomic_xchg32(&shared->hll_active, set ^ 1);
+    shared->distinct.window_S = window_S;
+    shared->distinct.clients = sfwb_hllEstimate(shared->hll[set][SFWB_HLL_CLIENTS]);
+    shared->distinct.sessions = sfwb_hllEstimate(shared->hll[set][SFWB_HLL_SESSIONS]);
 }
 
+#ifdef SFWB_APP_WORKERS
 
 /*_________________---------------------------__________________
-  _________________   start master process    __________________
+  _________________  scoreboard counters      __________________
   -----------------___________________________------------------
+  With counters.http=scoreboard the request threads do no counting at
+  all,  and the request and byte totals are worked out here instead by
+  diffing the per-slot access_count and bytes_served that httpd keeps
+  anyway (with ExtendedStatus On).  These are per worker slot and carry
+  on across child processes,  so a slot going backwards means the
+  scoreboard was reset.  The first pass (and the first after the
+  arrays are reallocated) only records where each slot is,  or the
+  whole lifetime of the server would show up as one interval's traffic.
+  Slots with no process are read too,  so that a child starting up in
+  one later on only adds what it does itself.
 */
 
-static int start_sflow_master(apr_pool_t *p, server_rec *s, SFWB *sm) {
-    apr_status_t rc;
+static void sfwb_scoreboardCounters(SFWB *sm)
+{
+    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+    apr_uint64_t requests = 0, bytes = 0;
+    apr_int32_t i, j;
+    bool_t baseline = false;
 
-#ifdef SFWB_DEBUG
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "start_sflow_master - pid=%u", getpid());
-#endif
+    if(!ap_exists_scoreboard_image()) return;
 
-    /* create the pipe that the child processes will use to send samples to the master */
-    /* wanted to use apr_file_pipe_create_ex(...APR_FULL_NONBLOCK..) but it seems to be a new addition */
-    if((rc = apr_file_pipe_create(&sm->pipe_read, &sm->pipe_write, p)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_file_pipe_create() failed");
-        return HTTP_INTERNAL_SERVER_ERROR;
+    if(sm->sb_access_count == NULL) {
+        apr_size_t slots = sm->mpm_server_limit * sm->mpm_thread_limit;
+        sm->sb_access_count = apr_pcalloc(sm->configPool, slots * sizeof(apr_uint32_t));
+        sm->sb_bytes_served = apr_pcalloc(sm->configPool, slots * sizeof(apr_uint64_t));
+        baseline = true;
     }
-   
-    /* The write-end of the pipe must be non-blocking to ensure that worker-threads are never stalled. */
-    apr_file_pipe_timeout_set(sm->pipe_write, 0);
 
-    /* create anonymous shared memory for counters and for pushing config to the workers */
-    sm->shared_bytes_total = sizeof(SFWBShared);
-    if((rc = apr_shm_create(&sm->shared_mem, sm->shared_bytes_total, NULL, p)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_shm_create() failed");
-        /* may return ENOTIMPL if anon shared mem not supported,  in which case we */
-        /* TODO: should try again with a filename. */
-        return HTTP_INTERNAL_SERVER_ERROR;
+    for(i = 0; i < sm->mpm_server_limit; i++) {
+        for(j = 0; j < sm->mpm_thread_limit; j++) {
+#if ((AP_SERVER_MAJORVERSION_NUMBER < 3) && (AP_SERVER_MINORVERSION_NUMBER < 3))
+            worker_score *ws_record = ap_get_scoreboard_worker(i, j);
+#else
+            worker_score *ws_record = ap_get_scoreboard_worker_from_indexes(i, j);
+#endif
+            if(ws_record == NULL) continue;
+            apr_size_t slot = (i * sm->mpm_thread_limit) + j;
+            apr_uint32_t acc = (apr_uint32_t)ws_record->access_count;
+            apr_uint64_t served = (apr_uint64_t)ws_record->bytes_served;
+            requests += (acc >= sm->sb_access_count[slot]) ? (acc - sm->sb_access_count[slot]) : acc;
+            bytes += (served >= sm->sb_bytes_served[slot]) ? (served - sm->sb_bytes_served[slot]) : served;
+            sm->sb_access_count[slot] = acc;
+            sm->sb_bytes_served[slot] = served;
+        }
     }
 
-    /* Remember the base address of this shared memory.  Each child must call again */
-    sm->shared_mem_base = apr_shm_baseaddr_get(sm->shared_mem);
+    if(baseline) return;
+    shared->http_totals.counterBlock.http_totals.requests += requests;
+    shared->http_totals.counterBlock.http_totals.bytes_out += bytes;
+}
 
-    /* initialze the counter block */
-    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
-    shared->http_counters.tag = SFLCOUNTERS_HTTP;
+/*_________________---------------------------__________________
+  _________________   in-flight samples       __________________
+  -----------------___________________________------------------
+  The scoreboard has the first line of the request,  the vhost and
+  the client address as text (with ExtendedStatus On),  and a start
+  time that is later than the stop time while the request is still
+  running.  The strings are copied first,  since the worker can be
+  writing them as we read.
+*/
 
-    apr_proc_t *prev_sflow_master = NULL;
-    if(apr_pool_userdata_get((void **)&prev_sflow_master, MOD_SFLOW_USERDATA_KEY_SFLOWMASTER, s->process->pool) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_userdata_get(): failed to read previous sflow master pid");
+static void sfwb_inflightSample(SFWB *sm, worker_score *ws_record, apr_uint64_t duration_uS, bool_t drop)
+{
+    char request[sizeof(ws_record->request)];
+    char vhost[sizeof(ws_record->vhost)];
+    char client[sizeof(ws_record->client)];
+    apr_cpystrn(request, ws_record->request, sizeof(request));
+    apr_cpystrn(vhost, ws_record->vhost, sizeof(vhost));
+    apr_cpystrn(client, ws_record->client, sizeof(client));
+
+    /* "<method> <uri> <protocol>" */
+    char *tok = NULL;
+    char *method = apr_strtok(request, " ", &tok);
+    char *uri = apr_strtok(NULL, " ", &tok);
+    char *protocol = apr_strtok(NULL, " ", &tok);
+    SFLHTTP_method mth = SFHTTP_OTHER;
+    if(method) {
+        mth = (strcmp(method, "HEAD") == 0) ? SFHTTP_HEAD : methodNumberLookup(ap_method_number_of(method));
     }
-    else if(prev_sflow_master == NULL) {
-#ifdef SFWB_DEBUG
-        /* this is expected the first time through, so only log it when we are debugging */
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s, "apr_userdata_get(): previous sflow master NULL");
-#endif
+    apr_uint32_t proto_num = 0;
+    if(protocol && strncmp(protocol, "HTTP/", 5) == 0) {
+        char *dot = strchr(protocol + 5, '.');
+        proto_num = HTTP_VERSION(atoi(protocol + 5), dot ? atoi(dot + 1) : 0);
     }
-    else if((int)prev_sflow_master->pid < 0) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_userdata_get(): previous sflow master PID = %d", (int)prev_sflow_master->pid);
+
+    /* only the client end of the socket is known */
+    SFLFlow_sample_element socElem = { 0 };
+    if(inet_pton(AF_INET, client, &socElem.flowType.socket4.remote_ip.addr) == 1) {
+        socElem.tag = SFLFLOW_EX_SOCKET4;
+        socElem.flowType.socket4.protocol = 6; /* TCP */
     }
-    else {
-#ifdef SFWB_DEBUG
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "start_sflow_master() - killing previous master (PID=%d)", (int)prev_sflow_master->pid);
-#endif
-        /* This is where we signal the master using SIGTERM or SIGKILL */
-        if(apr_proc_kill(prev_sflow_master, SFWB_KILL_MASTER_SIGNAL) != APR_SUCCESS) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_proc_kill(): failed to kill previous sflow master (may have exited already)");
+    else if(inet_pton(AF_INET6, client, socElem.flowType.socket6.remote_ip.addr) == 1) {
+        socElem.tag = SFLFLOW_EX_SOCKET6;
+        socElem.flowType.socket6.protocol = 6; /* TCP */
+    }
+
+    apr_uint32_t c;
+    for(c = 0; c < sm->config->num_collectors; c++) {
+        SFWBCollector *coll = &sm->config->collectors[c];
+        SFLSampler *sampler = coll->inflightSampler;
+        if(sampler == NULL) continue;
+        sampler->samplePool++;
+        if(!coll->active) continue;
+        if(drop || sfwb_overBudget(coll, SFWB_INFLIGHT_SAMPLE_BYTES)) {
+            sampler->dropEvents++;
+            continue;
         }
+        sflow_sample_http(sampler,
+                          NULL,
+                          mth,
+                          proto_num,
+                          uri,
+                          vhost,
+                          NULL,
+                          NULL,
+                          NULL,
+                          NULL,
+                          NULL,
+                          0,
+                          0,
+                          (duration_uS > 0xFFFFFFFF) ? 0xFFFFFFFF : (apr_uint32_t)duration_uS,
+                          0,
+                          socElem.tag ? &socElem : NULL);
     }
+}
 
-    /* make sure we use the more persitant pool to allocate and store this */
-    sm->sFlowProc = apr_palloc(s->process->pool, sizeof(apr_proc_t));
+static void sfwb_inflightSamples(SFWB *sm)
+{
+    apr_time_t now = apr_time_now();
+    apr_uint64_t threshold_uS = (apr_uint64_t)sm->config->inflight_S * APR_USEC_PER_SEC;
+    apr_uint32_t budget = sm->config->inflight_samples;
+    apr_int32_t i, j;
 
-    /* cache in pool for master process so we can make sure it is cleaned up even on graceful restart */
-    if(apr_pool_userdata_set((void*) sm->sFlowProc, MOD_SFLOW_USERDATA_KEY_SFLOWMASTER, apr_pool_cleanup_null, s->process->pool) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_userdata_set(): failed to store sflow master pid");
+    if(!ap_exists_scoreboard_image()) return;
+
+    if(sm->inflight_start == NULL) {
+        apr_size_t slots = sm->mpm_server_limit * sm->mpm_thread_limit;
+        sm->inflight_start = apr_pcalloc(sm->configPool, slots * sizeof(apr_time_t));
+        sm->inflight_next_uS = apr_pcalloc(sm->configPool, slots * sizeof(apr_uint64_t));
     }
 
-#ifdef SFWB_DEBUG
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "start_sflow_master() - pid=%u,tid=%u,scoreboard=%s", getpid(),MYGETTID,ap_exists_scoreboard_image() ? "YES":"NO");
+    for(i = 0; i < sm->mpm_server_limit; i++) {
+        process_score *ps_record = ap_get_scoreboard_process(i);
+        if(ps_record == NULL
+           || ps_record->pid == 0) continue;
+        for(j = 0; j < sm->mpm_thread_limit; j++) {
+#if ((AP_SERVER_MAJORVERSION_NUMBER < 3) && (AP_SERVER_MINORVERSION_NUMBER < 3))
+            worker_score *ws_record = ap_get_scoreboard_worker(i, j);
+#else
+            worker_score *ws_record = ap_get_scoreboard_worker_from_indexes(i, j);
 #endif
-
-    switch(rc = apr_proc_fork(sm->sFlowProc, p)) {
-    case APR_INCHILD:
-        /* close the write-end of the inherited pipe */
-        apr_file_close(sm->pipe_write);
-        /* and run the master */
-        run_sflow_master(p, s, sm);
-        /* if anything goes wrong, or there is a restart we'll get here.
-         * Just exit to terminate the process.  This is likely to result
-         * in pipe write errors in any child that is still running.
-         */
-        exit(0);
-        break;
-    case APR_INPARENT:
-        /* close the read end of the pipe */
-        apr_file_close(sm->pipe_read);
-        /* make sure apache knows to kill this process too if it is cleaning up.
-           We had APR_KILL_AFTER_TIMEOUT here before,  but really there's no need
-           to send SIGTERM and then hang around politely. We can shoot first and
-           ask questions later. */
-        apr_pool_note_subprocess(p, sm->sFlowProc, /* APR_KILL_AFTER_TIMEOUT */ APR_KILL_ALWAYS);
-        break;
-    default:
-        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_proc_fork() failed");
-        return HTTP_INTERNAL_SERVER_ERROR;
-        break;
+            if(ws_record == NULL
+               || ws_record->status != SERVER_BUSY_WRITE) continue;
+            apr_time_t start = ws_record->start_time;
+            if(start == 0
+               || start <= ws_record->stop_time
+               || start >= now) continue;
+            apr_uint64_t duration_uS = now - start;
+            if(duration_uS < threshold_uS) continue;
+            apr_size_t slot = (i * sm->mpm_thread_limit) + j;
+            if(start != sm->inflight_start[slot]) {
+                /* a new one for this slot */
+                sm->inflight_start[slot] = start;
+                sm->inflight_next_uS[slot] = threshold_uS;
+            }
+            if(duration_uS < sm->inflight_next_uS[slot]) continue;
+            while(sm->inflight_next_uS[slot] <= duration_uS) sm->inflight_next_uS[slot] *= 2;
+            sfwb_inflightSample(sm, ws_record, duration_uS, (budget == 0));
+            if(budget) budget--;
+        }
     }
-
-    return OK;
 }
 
+#endif /* SFWB_APP_WORKERS */
+
 /*_________________---------------------------__________________
-  _________________   create_sflow_config     __________________
+  _________________    adaptive sampling      __________________
   -----------------___________________________------------------
+  If a target samples-per-second is configured,  then every
+  SFWB_ADAPT_INTERVAL_S seconds we use the request count from the
+  http counters to work out what sampling rate would hit it.  The
+  rate is only changed if the expected samples/sec is outside the
+  hysteresis band,  it never goes below the configured sampling_n,
+  and it only comes down by half each time.  The new rate goes into
+  shared memory for the children to pick up on their next tick.
 */
 
-static void *create_sflow_config(apr_pool_t *p, server_rec *s)
+static apr_uint32_t sfwb_totalRequests(SFWBShared *shared)
 {
-    apr_status_t rc;
-    SFWB *sm = apr_pcalloc(p, sizeof(SFWB));
-#ifdef SFWB_DEBUG
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "create_sflow_config - pid=%u,tid=%u", getpid(), MYGETTID);
-#endif
-    sm->configFile = SFWB_DEFAULT_CONFIGFILE;
+    /* (filled in from the method counters,  or from the scoreboard) */
+    return (apr_uint32_t)shared->http_totals.counterBlock.http_totals.requests;
+}
 
-    /* a pool to use for the agent so we can recycle the memory easily on a config change */
-    if((rc = apr_pool_create(&sm->masterPool, p)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "create_sflow_config: error creating master agent sub-pool");
+static void sfwb_adaptSampling(SFWB *sm)
+{
+    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+    if(sm->config->sampling_target == 0
+       || sm->sampling_n_base == 0) return;
+    if(--sm->adaptCountDown > 0) return;
+    sm->adaptCountDown = SFWB_ADAPT_INTERVAL_S;
+
+    apr_uint32_t requests = sfwb_totalRequests(shared);
+    /* unsigned arithmetic takes care of wrap */
+    apr_uint32_t reqs_per_s = (requests - sm->adapt_lastRequests) / SFWB_ADAPT_INTERVAL_S;
+    sm->adapt_lastRequests = requests;
+
+    apr_uint32_t n = sm->sampling_n_adapted;
+    apr_uint32_t target = sm->config->sampling_target;
+    apr_uint64_t expected_x100 = ((apr_uint64_t)reqs_per_s * 100) / n;
+    apr_uint32_t ideal_n = (reqs_per_s + target - 1) / target;
+    if(ideal_n < sm->sampling_n_base) ideal_n = sm->sampling_n_base;
+
+    if(expected_x100 > ((apr_uint64_t)target * (100 + SFWB_ADAPT_HYSTERESIS_PC))) {
+        /* too many samples - back off */
+        n = ideal_n;
     }
-    /* a pool to use for the config so we can allocate apr_sockaddr_t objects */
-    if((rc = apr_pool_create(&sm->configPool, p)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "create_sflow_config: error creating config sub-pool");
+    else if(expected_x100 < ((apr_uint64_t)target * (100 - SFWB_ADAPT_HYSTERESIS_PC))
+            && n > sm->sampling_n_base) {
+        /* room for more samples - recover gradually */
+        n = (ideal_n > (n / 2)) ? ideal_n : (n / 2);
+        if(n < sm->sampling_n_base) n = sm->sampling_n_base;
     }
-    return sm;
-}
+
+    if(n != sm->sampling_n_adapted) {
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, sm->server_rec, "adaptive sampling: %u requests/sec, sampling_n %u -> %u",
+                     reqs_per_s,
+                     sm->sampling_n_adapted,
+                     n);
+        sm->sampling_n_adapted = n;
+        /* IPC to the child processes */
+        shared->sflow_skip = n;
+    }
+}
 
 /*_________________---------------------------__________________
-  _________________   sflow_post_config       __________________
+  _________________      1 second tick        __________________
   -----------------___________________________------------------
 */
+        
+void sflow_tick(SFWB *sm, server_rec *s) {
+    if(--sm->configCountDown <= 0) {
+        apr_time_t modTime = configModified(sm, s);
+        sm->configCountDown = SFWB_CONFIG_CHECK_S;
+        
+#ifdef SFWB_DEBUG
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "checking for config file change <%s>", sm->configFile);
+#endif
 
-static int sflow_post_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
-{
-#ifndef SFWB_APP_WORKERS
-    void *post_config_flag = NULL;
+        if(modTime == 0) {
+            /* config file missing */
+            sfwb_apply_config(sm, NULL, s);
+        }
+        else if(modTime != sm->configFile_modTime) {
+            /* config file modified */
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "config file changed <%s> t=%u", sm->configFile, (apr_int32_t)modTime);
+            SFWBConfig *newConfig = sfwb_readConfig(sm, s);
+            if(newConfig) {
+                /* config OK - apply it */
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "config file OK <%s>", sm->configFile);
+                sfwb_apply_config(sm, newConfig, s);
+                sm->configFile_modTime = modTime;
+            }
+            else {
+                /* bad config - ignore it (may be in transition) */
+                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "config file parse failed <%s>", sm->configFile);
+            }
+        }
+        else if(sfwb_uriClassesModified(sm, s)
+                || sfwb_clientGroupsModified(sm, s)) {
+            /* just the URI class or client group rules.  A new class or group
+               needs a data source of its own,  which means a new agent */
+            SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+            apr_uint32_t shards = shared->num_uri_classes + shared->num_client_groups;
+            sfwb_loadUriClasses(sm, s);
+            sfwb_loadClientGroups(sm, s);
+            if((shared->num_uri_classes + shared->num_client_groups) != shards) sflow_init(sm, s);
+        }
+    }
+    
+    if(sm->agents && sm->config) {
+        /* fail back to a preferred collector when its retry time is up */
+        sfwb_selectCollectors(sm);
+        sfwb_refillBuckets(sm);
+#ifdef SFWB_APP_WORKERS
+        /* (every second rather than at poll time,  so the adaptive sampling sees it too) */
+        if(sm->config->scoreboard_counters) sfwb_scoreboardCounters(sm);
+        if(sm->config->inflight_S && ap_extended_status) sfwb_inflightSamples(sm);
 #endif
-    void *pre_mpm_flag = NULL;
+        sfwb_adaptSampling(sm);
+        if(sm->topk && --sm->topkCountDown <= 0) {
+            SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+            apr_uint32_t k, window_S = sfwb_windowSecs(sm);
+            for(k = 0; k < SFWB_TOPK_KINDS; k++) sfwb_topkPublish(&sm->topk[k], &shared->topk[k], window_S);
+            sm->topkCountDown = window_S;
+        }
+        SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+        if(shared->distinct_enabled && --sm->distinctCountDown <= 0) {
+            apr_uint32_t window_S = sfwb_windowSecs(sm);
+            sfwb_distinctWindow(sm, window_S);
+            sm->distinctCountDown = window_S;
+        }
+        apr_uint32_t a;
+        for(a = 0; a < sm->num_agents; a++) sfl_agent_tick(&sm->agents[a], sm->currentTime);
+    }
+}
 
-    /* be careful in case we are not initialized yet - e.g. maybe this module was installed
-       without a subsequent restart,  and there was a graceful restart on logrotate.
-       http://wiki.apache.org/httpd/ModuleLife */
+/*_________________---------------------------__________________
+  _________________ lowest active listen port __________________
+  -----------------___________________________------------------
+*/
 
-    if(s == NULL
-       || s->module_config == NULL) {
-        return OK;
+static apr_uint16_t lowestActiveListenPort(server_rec *s)
+{
+    ap_listen_rec *lr = ap_listeners;
+    apr_uint16_t port = 0, p;
+    apr_sockaddr_t *localsoc = NULL;
+
+    for( ; lr ; lr=lr->next) {
+        if(lr->active && lr->sd) {
+            if(apr_socket_addr_get(&localsoc, APR_LOCAL, lr->sd) == APR_SUCCESS) {
+                p = localsoc->port;
+                if(p &&
+                   (port == 0 || port > p)) {
+                    port = p;
+                }
+            }
+        }
     }
 
-    SFWB *sm = GET_CONFIG_DATA(s);
-    if(sm == NULL) {
-        return OK;
+    if(port == 0) {
+        /* fallback - maybe the server_rec has a port number for us */
+        port = s->port;
     }
 
+    if(port == 0) {
+        /* ultimate fallback - the hard-coded default */
+        port = DEFAULT_HTTP_PORT;
+    }
+    return port;
+}
+
+/*_________________---------------------------__________________
+  _________________   shard pollers           __________________
+  -----------------___________________________------------------
+  one data source per URI class or client group,  numbered up from
+  dsIndex0 (see SFWB_URI_CLASS_DS_INDEX).
+*/
+
+static void sfwb_addShardPollers(SFWB *sm, server_rec *s, const char *kind, SFWBShardShared *shards, apr_uint32_t num, apr_uint32_t dsIndex0)
+{
+    apr_uint32_t i, c;
+    for(i = 0; i < num; i++) {
+        apr_uint32_t dsIndex = dsIndex0 + i;
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "%s %s is sFlow data source %u", kind, shards[i].name, dsIndex);
+        for(c = 0; c < sm->config->num_collectors; c++) {
+            SFWBCollector *coll = &sm->config->collectors[c];
+            if(coll->sa == NULL) continue;
+            SFLDataSource_instance dsi;
+            SFL_DS_SET(dsi, SFL_DSCLASS_LOGICAL_ENTITY, dsIndex, 0);
+            SFLPoller *poller = sfl_agent_addPoller(coll->agent, &dsi, sm, sfwb_cb_shard_counters);
+            poller->userData = coll;
+            sfl_poller_set_sFlowCpInterval(poller, sm->config->polling_secs);
+            sfl_poller_set_sFlowCpReceiver(poller, 1 /* receiver index == 1 */);
+        }
+    }
+}
+
+/*_________________---------------------------__________________
+  _________________  master sflow agent init  __________________
+  -----------------___________________________------------------
+*/
+
+static void sflow_init(SFWB *sm, server_rec *s)
+{
     apr_status_t rc;
-    
-#ifdef SFWB_DEBUG
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "sflow_post_config - pid=%u,tid=%u", getpid(),MYGETTID);
+    apr_uint16_t servicePort;
+
+    if(sm->configFile == NULL) {
+        sm->configFile = SFWB_DEFAULT_CONFIGFILE;
+    }
+
+    if(sm->config == NULL) return;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "in sflow_init: building sFlow agent");
+
+    {
+        /* create or re-create the agents */
+        if(sm->agents) {
+            apr_uint32_t a;
+            for(a = 0; a < sm->num_agents; a++) sfl_agent_release(&sm->agents[a]);
+            apr_pool_clear(sm->masterPool);
+            sm->socket4 = NULL;
+            sm->socket6 = NULL;
+        }
+
+        sm->agents = (SFLAgent *)apr_pcalloc(sm->masterPool, SFWB_MAX_COLLECTORS * sizeof(SFLAgent));
+        sm->num_agents = 0;
+
+        /* open the send sockets - one for v4 and another for v6 */
+        if(!sm->socket4) {
+            if((rc = apr_socket_create(&sm->socket4, APR_INET, SOCK_DGRAM, APR_PROTO_UDP, sm->masterPool)) != APR_SUCCESS)
+                ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "IPv4 send socket open failed");
+        }
+        if(!sm->socket6) {
+            if((rc = apr_socket_create(&sm->socket6, APR_INET6, SOCK_DGRAM, APR_PROTO_UDP, sm->masterPool)) != APR_SUCCESS)
+                ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "IPv6 send socket open failed");
+        }
+
+        servicePort = lowestActiveListenPort(s);
+        sm->servicePort = servicePort;
+        
+        /* an agent for each collector,  so that each one can have its own
+           max datagram size,  sequence numbers and poller phases,  while every
+           data source keeps ds_instance 0 and looks the same at every collector */
+        apr_uint32_t c;
+        for(c = 0; c < sm->config->num_collectors; c++) {
+            SFWBCollector *coll = &sm->config->collectors[c];
+            coll->agent = NULL;
+            if(coll->sa == NULL) continue;
+
+            /* initialize the agent with its address, bootime, callbacks etc. */
+            coll->agent = &sm->agents[sm->num_agents++];
+            sfl_agent_init(coll->agent,
+                           &sm->config->agentIP,
+                           0, /* subAgentId */
+                           sm->currentTime,
+                           sm->currentTime,
+                           sm,
+                           sfwb_cb_alloc,
+                           sfwb_cb_free,
+                           sfwb_cb_error,
+                           sfwb_cb_sendPkt);
+
+            coll->receiver = sfl_agent_addReceiver(coll->agent);
+            sfl_receiver_set_sFlowRcvrOwner(coll->receiver, "httpd sFlow Probe");
+            sfl_receiver_set_sFlowRcvrTimeout(coll->receiver, 0xFFFFFFFF);
+            sfl_receiver_set_sFlowRcvrMaximumDatagramSize(coll->receiver, coll->max_datagram);
+            /* no need to configure the receiver address, because we are */
+            /* using the sendPkt callback to handle the forwarding ourselves. */
+            coll->receiver->userData = coll;
+
+            if(sm->config->collector_failover) {
+                /* a connected socket will report ICMP port-unreachable etc. on the next send */
+                if((rc = apr_socket_create(&coll->socket, coll->sa->family, SOCK_DGRAM, APR_PROTO_UDP, sm->masterPool)) != APR_SUCCESS
+                   || (rc = apr_socket_connect(coll->socket, coll->sa)) != APR_SUCCESS) {
+                    ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "collector %s: connected socket failed", coll->name);
+                    coll->socket = NULL;
+                }
+            }
+        
+            /* add a <logicalEntity> datasource to represent this application instance */
+            SFLDataSource_instance dsi;
+            /* ds_class = <logicalEntity>, ds_index = <listen port>, ds_instance = 0 */
+
+            SFL_DS_SET(dsi, SFL_DSCLASS_LOGICAL_ENTITY, servicePort, 0);
+          
+            /* add a poller for the counters */
+            coll->poller = sfl_agent_addPoller(coll->agent, &dsi, sm, sfwb_cb_counters);
+            coll->poller->userData = coll;
+            sfl_poller_set_sFlowCpInterval(coll->poller, sm->config->polling_secs);
+            sfl_poller_set_sFlowCpReceiver(coll->poller, 1 /* receiver index == 1 */);
+        
+            /* add a sampler for the sampled operations */
+            coll->sampler[SFWB_STRATUM_ALL] = sfl_agent_addSampler(coll->agent, &dsi);
+            sfl_sampler_set_sFlowFsPacketSamplingRate(coll->sampler[SFWB_STRATUM_ALL], coll->sampling_n);
+            sfl_sampler_set_sFlowFsReceiver(coll->sampler[SFWB_STRATUM_ALL], 1 /* receiver index == 1 */);
+
+            /* and one for each stratum that has its own sampling rate */
+            if(sm->config->sampling_n_5xx) {
+                SFL_DS_SET(dsi, SFL_DSCLASS_LOGICAL_ENTITY, SFWB_STRATUM_DS_INDEX(SFWB_STRATUM_5XX, servicePort), 0);
+                coll->sampler[SFWB_STRATUM_5XX] = sfl_agent_addSampler(coll->agent, &dsi);
+                sfl_sampler_set_sFlowFsPacketSamplingRate(coll->sampler[SFWB_STRATUM_5XX], sm->config->sampling_n_5xx);
+                sfl_sampler_set_sFlowFsReceiver(coll->sampler[SFWB_STRATUM_5XX], 1 /* receiver index == 1 */);
+            }
+            if(sm->config->sampling_n_slow) {
+                SFL_DS_SET(dsi, SFL_DSCLASS_LOGICAL_ENTITY, SFWB_STRATUM_DS_INDEX(SFWB_STRATUM_SLOW, servicePort), 0);
+                coll->sampler[SFWB_STRATUM_SLOW] = sfl_agent_addSampler(coll->agent, &dsi);
+                sfl_sampler_set_sFlowFsPacketSamplingRate(coll->sampler[SFWB_STRATUM_SLOW], sm->config->sampling_n_slow);
+                sfl_sampler_set_sFlowFsReceiver(coll->sampler[SFWB_STRATUM_SLOW], 1 /* receiver index == 1 */);
+            }
+        }
+
+        if(sm->config->vhost_datasources) {
+            /* a sampler and poller for every vhost and collector.  The agents keep
+               their lists sorted with the highest data source first,  so adding them
+               in ascending vhost order puts each one straight in at the head of
+               its collector's list.  After this they are only ever reached through
+               the per-collector arrays,  never by searching the lists. */
+            for(c = 0; c < sm->config->num_collectors; c++) {
+                SFWBCollector *coll = &sm->config->collectors[c];
+                if(coll->sa == NULL) continue;
+                coll->vhostSampler = apr_pcalloc(sm->masterPool, sm->num_vhosts * sizeof(SFLSampler *));
+                coll->vhostPoller = apr_pcalloc(sm->masterPool, sm->num_vhosts * sizeof(SFLPoller *));
+            }
+            apr_uint32_t v;
+            for(v = 0; v < sm->num_vhosts; v++) {
+                server_rec *vs = sm->vhostServers[v];
+                ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "vhost %s:%u is sFlow data source %u",
+                             vs->server_hostname ? vs->server_hostname : "-",
+                             (apr_uint32_t)vs->port,
+                             SFWB_VHOST_DS_INDEX(v));
+                for(c = 0; c < sm->config->num_collectors; c++) {
+                    SFWBCollector *coll = &sm->config->collectors[c];
+                    if(coll->sa == NULL) continue;
+                    SFLDataSource_instance dsi;
+                    SFL_DS_SET(dsi, SFL_DSCLASS_LOGICAL_ENTITY, SFWB_VHOST_DS_INDEX(v), 0);
+                    SFLPoller *poller = sfl_agent_addPoller(coll->agent, &dsi, sm, sfwb_cb_vhost_counters);
+                    poller->userData = coll;
+                    sfl_poller_set_sFlowCpInterval(poller, sm->config->polling_secs);
+                    sfl_poller_set_sFlowCpReceiver(poller, 1 /* receiver index == 1 */);
+                    coll->vhostPoller[v] = poller;
+                    SFLSampler *sampler = sfl_agent_addSampler(coll->agent, &dsi);
+                    sfl_sampler_set_sFlowFsPacketSamplingRate(sampler, coll->sampling_n);
+                    sfl_sampler_set_sFlowFsReceiver(sampler, 1 /* receiver index == 1 */);
+                    coll->vhostSampler[v] = sampler;
+                }
+            }
+        }
+        /* a poller for every URI class and client group,  and every collector,
+           in ascending order too */
+        SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+        sfwb_addShardPollers(sm, s, "URI class", shared->uri_class, shared->num_uri_classes, SFWB_URI_CLASS_DS_INDEX(0));
+        sfwb_addShardPollers(sm, s, "client group", shared->client_group, shared->num_client_groups, SFWB_CLIENT_GROUP_DS_INDEX(0));
+        /* and one for the heavy hitters,  after all of them */
+        if(sm->config->topk) {
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "heavy hitters are sFlow data source %u", SFWB_TOPK_DS_INDEX);
+            for(c = 0; c < sm->config->num_collectors; c++) {
+                SFWBCollector *coll = &sm->config->collectors[c];
+                if(coll->sa == NULL) continue;
+                SFLDataSource_instance dsi;
+                SFL_DS_SET(dsi, SFL_DSCLASS_LOGICAL_ENTITY, SFWB_TOPK_DS_INDEX, 0);
+                SFLPoller *poller = sfl_agent_addPoller(coll->agent, &dsi, sm, sfwb_cb_topk_counters);
+                poller->userData = coll;
+                sfl_poller_set_sFlowCpInterval(poller, sm->config->polling_secs);
+                sfl_poller_set_sFlowCpReceiver(poller, 1 /* receiver index == 1 */);
+            }
+        }
+#ifdef SFWB_APP_WORKERS
+        /* and a sampler for the in-flight requests,  last of all */
+        if(sm->config->inflight_S) {
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "in-flight requests are sFlow data source %u", SFWB_INFLIGHT_DS_INDEX);
+            for(c = 0; c < sm->config->num_collectors; c++) {
+                SFWBCollector *coll = &sm->config->collectors[c];
+                if(coll->sa == NULL) continue;
+                SFLDataSource_instance dsi;
+                SFL_DS_SET(dsi, SFL_DSCLASS_LOGICAL_ENTITY, SFWB_INFLIGHT_DS_INDEX, 0);
+                coll->inflightSampler = sfl_agent_addSampler(coll->agent, &dsi);
+                sfl_sampler_set_sFlowFsPacketSamplingRate(coll->inflightSampler, 1);
+                sfl_sampler_set_sFlowFsReceiver(coll->inflightSampler, 1 /* receiver index == 1 */);
+            }
+        }
 #endif
-    
+        sfwb_selectCollectors(sm);
+        
+        /* IPC to the child processes */
+        /* (threshold first, so a child never sees a new rate with a stale threshold) */
+        shared->slow_mS = sm->config->slow_mS;
+        shared->sflow_skip_5xx = sm->config->sampling_n_5xx;
+        shared->sflow_skip_slow = sm->config->sampling_n_slow;
+        shared->scoreboard_counters = sm->config->scoreboard_counters;
+        shared->vhost_datasources = sm->config->vhost_datasources;
+        shared->topk_enabled = sm->config->topk;
+        shared->queue_wait = sm->config->queue_wait;
+        /* (cookie first,  as with the hash header) */
+        const char *session_cookie = sm->config->session_cookie ? sm->config->session_cookie : "";
+        if(strcmp(shared->session_cookie, session_cookie) != 0) {
+            apr_cpystrn(shared->session_cookie, session_cookie, SFWB_MAX_SESSION_COOKIE_LEN);
+        }
+        shared->distinct_enabled = sm->config->distinct;
 #ifdef SFWB_APP_WORKERS
-    /* don't need to wait for second post_config call because we are not going to call start_sflow_master() until later.
-       Just allow the code below to run twice.  The advantage is that now mod-sflow can be loaded into a running
-       apache with just one SIGHUP instead of requring two. See http://wiki.apache.org/httpd/ModuleLife */
+        if(sm->config->scoreboard_counters && !ap_extended_status) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "counters.http=scoreboard needs \"ExtendedStatus On\" for the request and byte counts");
+        }
+        if(sm->config->inflight_S && !ap_extended_status) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "inflight.http needs \"ExtendedStatus On\"");
+        }
 #else
-    /* All post_config hooks are called twice on a full restart, we're only interested in the second call. */
-    apr_pool_userdata_get(&post_config_flag, MOD_SFLOW_USERDATA_KEY_POSTCONFIG, s->process->pool);
-    if (!post_config_flag) {
-        apr_pool_userdata_set((void*) 1, MOD_SFLOW_USERDATA_KEY_POSTCONFIG, apr_pool_cleanup_null, s->process->pool);
-        return OK;
-    }
-    /* get here on the second call... */
+        shared->scoreboard_counters = false;
 #endif
-            
-            
-    /* try to retrieve the optional fn pointer from mod_logio that allows us to report both bytes_in and bytes_out */
-    if(!pfn_ap_logio_get_last_bytes) {
-        pfn_ap_logio_get_last_bytes = APR_RETRIEVE_OPTIONAL_FN(ap_logio_get_last_bytes);
-        if(!pfn_ap_logio_get_last_bytes) {
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "unable to retrieve optional fn ap_logio_get_last_bytes() -- perhaps mod logio not loaded?");
+        /* the children only copy this when it changes,  so leave it alone if it hasn't */
+        const char *hash_header = sm->config->hash_header ? sm->config->hash_header : "";
+        if(strcmp(shared->hash_header, hash_header) != 0) {
+            apr_cpystrn(shared->hash_header, hash_header, SFWB_MAX_HASH_HEADER_LEN);
         }
-    }
-            
+
+        /* exclusions.  The count is cleared while the User-Agent prefixes
+           are rewritten,  and set again afterwards */
+        apr_uint32_t i, num_useragents = 0;
+        bool_t exclude_lookups = false;
+        shared->num_exclude_useragents = 0;
+        for(i = 0; i < sm->config->num_exclude_rules; i++) {
+            SFWBExcludeRule *rule = &sm->config->exclude_rules[i];
+            if(rule->type != SFWB_EXCLUDE_USERAGENT) exclude_lookups = true;
+            else if(num_useragents < SFWB_MAX_EXCLUDE_USERAGENTS) {
+                apr_cpystrn(shared->exclude_useragent[num_useragents], rule->value, SFWB_MAX_EXCLUDE_USERAGENT_LEN);
+                shared->exclude_useragent_len[num_useragents] = strlen(shared->exclude_useragent[num_useragents]);
+                num_useragents++;
+            }
+            else {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "exclude.http.useragent=%s: exceeded max User-Agent exclusions (%u)", rule->value, SFWB_MAX_EXCLUDE_USERAGENTS);
+            }
+        }
+        shared->exclude_lookups = exclude_lookups;
+        shared->num_exclude_useragents = num_useragents;
+
+        apr_uint32_t child_sampling_n = sfwb_childSamplingRate(sm->config);
+        if(child_sampling_n) {
+            if(child_sampling_n != sm->sampling_n_base
+               || sm->config->sampling_target == 0) {
+                /* (re)start the adaptive sampling from here */
+                sm->sampling_n_base = child_sampling_n;
+                sm->sampling_n_adapted = child_sampling_n;
+                sm->adaptCountDown = SFWB_ADAPT_INTERVAL_S;
+                sm->adapt_lastRequests = sfwb_totalRequests(shared);
+            }
+            /* otherwise carry on from the rate it had adapted to,  so that an
+               unrelated config change doesn't flood the collector */
+            shared->sflow_skip = sm->sampling_n_adapted;
+        }
+
 #ifdef SFWB_DEBUG
-    if((rc = ap_mpm_query(AP_MPMQ_IS_THREADED, &sm->mpm_threaded)) == APR_SUCCESS) {
-        /* We could use this information to decided whether to create the mutex in each child */
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "sflow_post_config - threaded=%u", sm->mpm_threaded);
-    }
-    else {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s, "sflow_post_config - ap_mpm_query(AP_MPMQ_IS_THREADED) failed");
-    }
+        /* test the agent error reporting mechanism to make sure it is working */
+        if(sm->num_agents) sfl_agent_error(&sm->agents[0], "error-log-test", "agent init complete");
 #endif
-            
-#ifdef SFWB_APP_WORKERS
-    /* read the numbers we need for the scoreboard - might as well do it here in case the child processes ever
-       need to know it too,  but it's likely that only the sflow "master" will care */
-    if((rc = ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS, &sm->mpm_thread_limit)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s,
-                     "sflow_post_config - ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS) failed");
+
     }
-            
-    if((rc = ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &sm->mpm_server_limit)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s,
-                     "sflow_post_config - ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS) failed");
+}
+
+
+/*_________________---------------------------__________________
+  _________________   accumulate counters     __________________
+  -----------------___________________________------------------
+  returns the number of requests,  since every request is counted
+  once by method.
+*/
+
+static apr_uint64_t sfwb_addHttpCounters(SFLHTTP_counters *acc, SFLHTTP_counters *c)
+{
+    acc->method_option_count += c->method_option_count;
+    acc->method_get_count += c->method_get_count;
+    acc->method_head_count += c->method_head_count;
+    acc->method_post_count += c->method_post_count;
+    acc->method_put_count += c->method_put_count;
+    acc->method_delete_count += c->method_delete_count;
+    acc->method_trace_count += c->method_trace_count;
+    acc->method_connect_count += c->method_connect_count;
+    acc->method_other_count += c->method_other_count;
+    acc->status_1XX_count += c->status_1XX_count;
+    acc->status_2XX_count += c->status_2XX_count;
+    acc->status_3XX_count += c->status_3XX_count;
+    acc->status_4XX_count += c->status_4XX_count;
+    acc->status_5XX_count += c->status_5XX_count;
+    acc->status_other_count += c->status_other_count;
+    return ((apr_uint64_t)c->method_option_count
+            + c->method_get_count
+            + c->method_head_count
+            + c->method_post_count
+            + c->method_put_count
+            + c->method_delete_count
+            + c->method_trace_count
+            + c->method_connect_count
+            + c->method_other_count);
+}
+
+/*_________________---------------------------__________________
+  _________________   sFlow master process    __________________
+  -----------------___________________________------------------
+*/
+
+static void sflow_master_sigterm(int sig) {
+    /* just set the flag to cause the master thread to terminate gracefully */
+    sflow_master_running = false;
+}
+
+static apr_status_t run_sflow_master(apr_pool_t *p, server_rec *s, SFWB *sm)
+{
+    apr_status_t rc;
+    bool_t pipe_err = false;
+
+#ifdef SFWB_DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "run_sflow_master - pid=%u", getpid());
+#endif
+    
+    /* read with timeout just under a second so that the sflow_tick can be issued every second.*/
+    if((rc = apr_file_pipe_timeout_set(sm->pipe_read, 900000 /* uS */)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_file_pipe_timeout_set() failed");
+        return rc;
     }
-            
-    /* if((rc = ap_mpm_query(AP_MPMQ_MAX_THREADS, &sm->mpm_threads_per_child)) != APR_SUCCESS) { */
-    /*     ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s, */
-    /*                  "sflow_post_config - ap_mpm_query(AP_MPMQ_MAX_THREADS) failed"); */
-    /* } */
-    /* /\* work around buggy MPMs - copied this check from mod_status *\/ */
-    /* if (sm->mpm_threads_per_child == 0) { */
-    /*     sm->mpm_threads_per_child = 1; */
-    /* } */
-            
-    /* if((rc = ap_mpm_query(AP_MPMQ_MAX_DAEMONS, &sm->mpm_max_servers)) != APR_SUCCESS) { */
-    /*     ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s, */
-    /*                  "sflow_post_config - ap_mpm_query(AP_MPMQ_MAX_DAEMONS) failed"); */
-    /* } */
-            
-    /* if((rc = ap_mpm_query(AP_MPMQ_IS_ASYNC, &sm->mpm_is_async)) != APR_SUCCESS) { */
-    /*     ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s, */
+    
+    /* register the SIGTERM handler to provide a way of stopping this process gracefully
+     * although often it will exit before we get around to killing it, when read on the pipe fails.
+     */
+    apr_signal(SIGTERM, sflow_master_sigterm);
+
+    sflow_master_running = true;
+
+    /* now loop forever - unless we encounter some kind of error or signal */
+    while(sflow_master_running) {
+
+        /* send ticks */
+        /* segfaults here if mod_sflow.so is overwritten.  Need to remove it first,  then copy in the
+           new one!  apxs(1) will just overwrite the file,  so this is an important step to observe when
+           upgrading (see apache bug #47951 - apparently fixed in version 2.4.1).
+           rpm will remove the previous file before installing the new one,  so it's not an issue if you
+           use rpm. */
+        apr_time_t now = apr_time_sec(apr_time_now());
+
+        if(sm->currentTime != now) {
+            /* (set the time first,  so that an agent built in this tick starts at
+               the right second.  The poll phase is worked out from it) */
+            sm->currentTime = now;
+            sflow_tick(sm, s);
+        }
+
+        /* read a message from the pipe (or time out) */
+        apr_uint32_t msg[PIPE_BUF / sizeof(apr_uint32_t)];
+
+        /* just read the length and type first */
+        apr_size_t hdrBytes = 12;
+        apr_size_t hdrBytesRead = 0;
+        rc = apr_file_read_full(sm->pipe_read, msg, hdrBytes, &hdrBytesRead);
+        if(rc != APR_SUCCESS && !(APR_STATUS_IS_TIMEUP(rc))) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "run_sflow_master - apr_file_read_full() failed");
+            pipe_err = true;
+            break;
+        }
+
+        if(rc == APR_SUCCESS && hdrBytesRead != 0) {
+
+            if(hdrBytesRead != hdrBytes) break;
+
+            /* now read the rest */
+            apr_size_t msgBytes = msg[0];
+            apr_uint32_t msgType = msg[1];
+            apr_uint32_t msgId = msg[2];
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "run_sflow_master - msgType/id = %u/%u msgBytes=%u",
+                         msgType,
+                         (apr_uint32_t)msgId,
+                         (apr_uint32_t)msgBytes);
+
+            if(msgType != SFLCOUNTERS_SAMPLE && msgType != SFLFLOW_SAMPLE) break;
+
+            if(msgBytes > PIPE_BUF) break;
+
+            apr_size_t bodyBytes = msgBytes - hdrBytes;
+            apr_size_t bodyBytesRead = 0;
+            if((rc = apr_file_read_full(sm->pipe_read, msg, bodyBytes, &bodyBytesRead)) != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "run_sflow_master: apr_file_read_full() failed");
+                pipe_err = true;
+                break;
+            }
+
+            if(bodyBytesRead != bodyBytes) break;
+
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "run_sflow_master - bodyBytes read=%u", (apr_uint32_t)bodyBytesRead);
+
+            /* we may not have initialized the agent yet,  so the first few samples may end up being ignored */
+            if(sm->agents && sm->config) {
+                apr_uint32_t *datap = msg;
+                if(msgType == SFLCOUNTERS_SAMPLE && msgId == SFLCOUNTERS_HTTP) {
+                    /* counter block,  for one vhost or for the whole server */
+                    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+                    apr_uint32_t vhostIdx = *datap++;
+                    SFLHTTP_counters c;
+                    memcpy(&c, datap, sizeof(c));
+                    if(vhostIdx < sm->num_vhosts) {
+                        sfwb_addHttpCounters(&SFWB_SHARED_VHOSTS(shared)[vhostIdx].http_counters.counterBlock.http, &c);
+                    }
+                    /* the server-wide total includes every vhost */
+                    /* accumulate into my total */
+                    shared->http_totals.counterBlock.http_totals.requests += sfwb_addHttpCounters(&shared->http_counters.counterBlock.http, &c);
+                }
+                else if(msgType == SFLCOUNTERS_SAMPLE
+                        && (msgId == SFWB_MSG_URI_CLASS_COUNTERS || msgId == SFWB_MSG_CLIENT_GROUP_COUNTERS)) {
+                    /* counters and totals for one URI class or client group */
+                    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+                    apr_uint32_t idx = *datap++;
+                    SFLHTTP_counters c;
+                    SFLHTTP_totals t;
+                    memcpy(&c, datap, sizeof(c));
+                    memcpy(&t, (char *)datap + sizeof(c), sizeof(t));
+                    SFWBShardShared *shard = NULL;
+                    if(msgId == SFWB_MSG_URI_CLASS_COUNTERS) {
+                        if(idx < shared->num_uri_classes) shard = &shared->uri_class[idx];
+                    }
+                    else if(idx < shared->num_client_groups) shard = &shared->client_group[idx];
+                    if(shard) {
+                        shard->totals.requests += sfwb_addHttpCounters(&shard->http, &c);
+                        shard->totals.bytes_in += t.bytes_in;
+                        shard->totals.bytes_out += t.bytes_out;
+                        shard->totals.duration_uS += t.duration_uS;
+                    }
+                }
+                else if(msgType == SFLCOUNTERS_SAMPLE && msgId == SFWB_MSG_TOPK) {
+                    /* heavy hitters from one child (maybe one of several batches) */
+                    apr_uint32_t kind = *datap++;
+                    apr_uint32_t num = *datap++;
+                    SFWBTopKEntry *ent = (SFWBTopKEntry *)datap;
+                    if(sm->topk == NULL) {
+                        apr_uint32_t k;
+                        sm->topk = apr_pcalloc(sm->configPool, SFWB_TOPK_KINDS * sizeof(SFWBTopK));
+                        for(k = 0; k < SFWB_TOPK_KINDS; k++) sfwb_topkInit(&sm->topk[k], SFWB_TOPK_MASTER, sm->configPool);
+                        sm->topkCountDown = sfwb_windowSecs(sm);
+                    }
+                    if(kind < SFWB_TOPK_KINDS
+                       && (8 + (num * sizeof(SFWBTopKEntry))) <= bodyBytes) {
+                        apr_uint32_t i;
+                        for(i = 0; i < num; i++) {
+                            ent[i].name[SFWB_TOPK_NAME - 1] = '\0';
+                            sfwb_topkAdd(&sm->topk[kind], sfwb_topkHash(ent[i].name), ent[i].name, ent[i].count, ent[i].error);
+                        }
+                    }
+                }
+                else if(msgType == SFLCOUNTERS_SAMPLE && msgId == SFLCOUNTERS_HTTP_HISTOGRAM) {
+                    /* duration histogram - accumulate into my total too */
+                    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+                    apr_uint32_t b;
+                    for(b = 0; b < SFLHTTP_HISTOGRAM_BUCKETS; b++) {
+                        shared->http_histogram.counterBlock.http_histogram.bucket[b] += datap[b];
+                    }
+                }
+                else if(msgType == SFLCOUNTERS_SAMPLE && msgId == SFLCOUNTERS_APP_OPERATIONS) {
+                    /* app_operations counters (without the application name) */
+                    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+                    SFLAPPOperations *ops = &shared->app_operations.counterBlock.app_operations;
+                    ops->status_OK += datap[0];
+                    ops->errors_OTHER += datap[1];
+                    ops->errors_TIMEOUT += datap[2];
+                    ops->errors_INTERNAL_ERROR += datap[3];
+                    ops->errors_BAD_REQUEST += datap[4];
+                    ops->errors_FORBIDDEN += datap[5];
+                    ops->errors_TOO_LARGE += datap[6];
+                    ops->errors_NOT_IMPLEMENTED += datap[7];
+                    ops->errors_NOT_FOUND += datap[8];
+                    ops->errors_UNAVAILABLE += datap[9];
+                    ops->errors_UNAUTHORIZED += datap[10];
+                }
+                else if(msgType == SFLCOUNTERS_SAMPLE && msgId == SFLCOUNTERS_HTTP_TOTALS) {
+                    /* transaction totals */
+                    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+                    SFLHTTP_totals t;
+                    memcpy(&t, datap, sizeof(t));
+                    shared->http_totals.counterBlock.http_totals.bytes_in += t.bytes_in;
+                    shared->http_totals.counterBlock.http_totals.bytes_out += t.bytes_out;
+                    shared->http_totals.counterBlock.http_totals.duration_uS += t.duration_uS;
+                }
+                else if(msgType == SFLCOUNTERS_SAMPLE && msgId == SFLCOUNTERS_HTTP_QUEUE) {
+                    /* time spent waiting for a worker */
+                    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+                    SFLHTTP_queue q;
+                    memcpy(&q, datap, sizeof(q));
+                    shared->http_queue.counterBlock.http_queue.wait_uS += q.wait_uS;
+                    shared->http_queue.counterBlock.http_queue.requests += q.requests;
+                }
+                else if(msgType == SFLCOUNTERS_SAMPLE && msgId == SFLCOUNTERS_HTTP_EXCLUDED) {
+                    /* requests left out by exclusions */
+                    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+                    shared->http_excluded.counterBlock.http_excluded.requests += *datap;
+                }
+                else if(msgType == SFLFLOW_SAMPLE && msgId == SFLFLOW_HTTP) {
+                    apr_uint32_t samplePool = *datap++;
+                    apr_uint32_t dropEvents = *datap++;
+                    apr_uint32_t stratum = *datap++;
+                    apr_uint32_t vhostIdx = *datap++;
+                    bool_t hashed = (*datap++ != 0);
+                    apr_uint32_t hash = *datap++;
+                    if(stratum >= SFWB_NUM_STRATA) continue;
+                    /* next we have a flow sample that we can encode straight into the output,  but we have to put it */
+                    /* through our sampler objects so that we get the right sequence numbers, pools and data-source ids. */
+                    apr_uint32_t sampleBytes = (msg + (bodyBytesRead>>2) - datap) << 2;
+                    /* pick out the sampling rate that the child used */
+#ifdef SFL_USE_32BIT_INDEX
+                    apr_uint32_t child_sampling_n = ntohl(datap[5]);
+#else
+                    apr_uint32_t child_sampling_n = ntohl(datap[4]);
+#endif
+                    if(child_sampling_n == 0) child_sampling_n = 1;
+                    /* during a burst every collector gets everything */
+                    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+                    bool_t burst = (shared->burst_until_S > (apr_uint32_t)sm->currentTime);
+                    apr_uint32_t c;
+                    for(c = 0; c < sm->config->num_collectors; c++) {
+                        SFWBCollector *coll = &sm->config->collectors[c];
+                        SFLSampler *sampler = coll->sampler[stratum];
+                        if(stratum == SFWB_STRATUM_ALL
+                           && vhostIdx < sm->num_vhosts
+                           && coll->vhostSampler) {
+                            /* sampled by the child at the vhost's sampler */
+                            sampler = coll->vhostSampler[vhostIdx];
+                        }
+                        /* (NULL if the stratum was dropped from the config since this sample was taken) */
+                        if(sampler == NULL) continue;
+                        sampler->samplePool += samplePool;
+                        sampler->dropEvents += dropEvents;
+                        if(!coll->active) {
+                            /* standby collector */
+                            continue;
+                        }
+                        /* only the main stratum is subsampled per-collector */
+                        apr_uint32_t ratio = (stratum == SFWB_STRATUM_ALL && !burst) ? (coll->sampling_n / child_sampling_n) : 1;
+                        if(ratio == 0) ratio = 1;
+                        if(!sfwb_subsample(coll, ratio, hashed, hash, child_sampling_n)) {
+                            continue;
+                        }
+                        /* the effective sampling rate for this collector */
+                        sampler->sFlowFsPacketSamplingRate = child_sampling_n * ratio;
+                        if(sfwb_overBudget(coll, sampleBytes)) {
+                            /* over the rate limit for this collector. Report it as a drop so
+                               the collector can still scale up correctly from the samples it gets. */
+                            sampler->dropEvents++;
+                            continue;
+                        }
+                        sfl_sampler_writeEncodedFlowSample(sampler, (char *)datap, sampleBytes);
+                    }
+                }
+            }
+        }
+    }
+
+#ifdef SFWB_DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "run_sflow_master (pid=%u) loop exit: sflow_master_running=%s, pipe_err=%d",
+                 getpid(),
+                 sflow_master_running ? "true" : "false",
+                 pipe_err);
+#endif
+    
+    /* The pipe errors are what we actually expect to see if apache is restarted with SIGHUP or graceful(SIGUSR1), so only
+       log an error if we see something else */
+    if(!pipe_err && sflow_master_running) {
+        /* We should only get here if there was an unexpected message error that caused us to break out of the loop above */    
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "run_sflow_master - unexpected message error");
+    }
+    
+    return APR_CHILD_DONE;
+}
+
+
+/*_________________---------------------------__________________
+  _________________   start master process    __________________
+  -----------------___________________________------------------
+*/
+
+static int start_sflow_master(apr_pool_t *p, server_rec *s, SFWB *sm) {
+    apr_status_t rc;
+
+#ifdef SFWB_DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "start_sflow_master - pid=%u", getpid());
+#endif
+
+    /* create the pipe that the child processes will use to send samples to the master */
+    /* wanted to use apr_file_pipe_create_ex(...APR_FULL_NONBLOCK..) but it seems to be a new addition */
+    if((rc = apr_file_pipe_create(&sm->pipe_read, &sm->pipe_write, p)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_file_pipe_create() failed");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+   
+    /* The write-end of the pipe must be non-blocking to ensure that worker-threads are never stalled. */
+    apr_file_pipe_timeout_set(sm->pipe_write, 0);
+
+    /* create anonymous shared memory for counters and for pushing config to the workers */
+    sm->shared_bytes_total = sizeof(SFWBShared) + (sm->num_vhosts * sizeof(SFWBVhostShared));
+    if((rc = apr_shm_create(&sm->shared_mem, sm->shared_bytes_total, NULL, p)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_shm_create() failed");
+        /* may return ENOTIMPL if anon shared mem not supported,  in which case we */
+        /* TODO: should try again with a filename. */
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Remember the base address of this shared memory.  Each child must call again */
+    sm->shared_mem_base = apr_shm_baseaddr_get(sm->shared_mem);
+
+    /* initialze the counter block */
+    SFWBShared *shared = (SFWBShared *)sm->shared_mem_base;
+    shared->http_counters.tag = SFLCOUNTERS_HTTP;
+    shared->http_histogram.tag = SFLCOUNTERS_HTTP_HISTOGRAM;
+    shared->http_totals.tag = SFLCOUNTERS_HTTP_TOTALS;
+    shared->http_excluded.tag = SFLCOUNTERS_HTTP_EXCLUDED;
+    shared->http_queue.tag = SFLCOUNTERS_HTTP_QUEUE;
+    shared->app_operations.tag = SFLCOUNTERS_APP_OPERATIONS;
+    apr_uint32_t v;
+    for(v = 0; v < sm->num_vhosts; v++) {
+        SFWB_SHARED_VHOSTS(shared)[v].http_counters.tag = SFLCOUNTERS_HTTP;
+    }
+
+    apr_proc_t *prev_sflow_master = NULL;
+    if(apr_pool_userdata_get((void **)&prev_sflow_master, MOD_SFLOW_USERDATA_KEY_SFLOWMASTER, s->process->pool) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_userdata_get(): failed to read previous sflow master pid");
+    }
+    else if(prev_sflow_master == NULL) {
+#ifdef SFWB_DEBUG
+        /* this is expected the first time through, so only log it when we are debugging */
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s, "apr_userdata_get(): previous sflow master NULL");
+#endif
+    }
+    else if((int)prev_sflow_master->pid < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_userdata_get(): previous sflow master PID = %d", (int)prev_sflow_master->pid);
+    }
+    else {
+#ifdef SFWB_DEBUG
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "start_sflow_master() - killing previous master (PID=%d)", (int)prev_sflow_master->pid);
+#endif
+        /* This is where we signal the master using SIGTERM or SIGKILL */
+        if(apr_proc_kill(prev_sflow_master, SFWB_KILL_MASTER_SIGNAL) != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_proc_kill(): failed to kill previous sflow master (may have exited already)");
+        }
+    }
+
+    /* make sure we use the more persitant pool to allocate and store this */
+    sm->sFlowProc = apr_palloc(s->process->pool, sizeof(apr_proc_t));
+
+    /* cache in pool for master process so we can make sure it is cleaned up even on graceful restart */
+    if(apr_pool_userdata_set((void*) sm->sFlowProc, MOD_SFLOW_USERDATA_KEY_SFLOWMASTER, apr_pool_cleanup_null, s->process->pool) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_userdata_set(): failed to store sflow master pid");
+    }
+
+#ifdef SFWB_DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "start_sflow_master() - pid=%u,tid=%u,scoreboard=%s", getpid(),MYGETTID,ap_exists_scoreboard_image() ? "YES":"NO");
+#endif
+
+    switch(rc = apr_proc_fork(sm->sFlowProc, p)) {
+    case APR_INCHILD:
+        /* close the write-end of the inherited pipe */
+        apr_file_close(sm->pipe_write);
+        /* and run the master */
+        run_sflow_master(p, s, sm);
+        /* if anything goes wrong, or there is a restart we'll get here.
+         * Just exit to terminate the process.  This is likely to result
+         * in pipe write errors in any child that is still running.
+         */
+        exit(0);
+        break;
+    case APR_INPARENT:
+        /* close the read end of the pipe */
+        apr_file_close(sm->pipe_read);
+        /* make sure apache knows to kill this process too if it is cleaning up.
+           We had APR_KILL_AFTER_TIMEOUT here before,  but really there's no need
+           to send SIGTERM and then hang around politely. We can shoot first and
+           ask questions later. */
+        apr_pool_note_subprocess(p, sm->sFlowProc, /* APR_KILL_AFTER_TIMEOUT */ APR_KILL_ALWAYS);
+        break;
+    default:
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "apr_proc_fork() failed");
+        return HTTP_INTERNAL_SERVER_ERROR;
+        break;
+    }
+
+    return OK;
+}
+
+/*_________________---------------------------__________________
+  _________________   create_sflow_config     __________________
+  -----------------___________________________------------------
+*/
+
+static void *create_sflow_config(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t rc;
+    SFWB *sm = apr_pcalloc(p, sizeof(SFWB));
+#ifdef SFWB_DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "create_sflow_config - pid=%u,tid=%u", getpid(), MYGETTID);
+#endif
+    sm->configFile = SFWB_DEFAULT_CONFIGFILE;
+
+    /* a pool to use for the agent so we can recycle the memory easily on a config change */
+    if((rc = apr_pool_create(&sm->masterPool, p)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "create_sflow_config: error creating master agent sub-pool");
+    }
+    /* a pool to use for the config so we can allocate apr_sockaddr_t objects */
+    if((rc = apr_pool_create(&sm->configPool, p)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "create_sflow_config: error creating config sub-pool");
+    }
+    return sm;
+}
+
+/*_________________---------------------------__________________
+  _________________   sflow_post_config       __________________
+  -----------------___________________________------------------
+*/
+
+static int sflow_post_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
+{
+#ifndef SFWB_APP_WORKERS
+    void *post_config_flag = NULL;
+#endif
+    void *pre_mpm_flag = NULL;
+
+    /* be careful in case we are not initialized yet - e.g. maybe this module was installed
+       without a subsequent restart,  and there was a graceful restart on logrotate.
+       http://wiki.apache.org/httpd/ModuleLife */
+
+    if(s == NULL
+       || s->module_config == NULL) {
+        return OK;
+    }
+
+    SFWB *sm = GET_CONFIG_DATA(s);
+    if(sm == NULL) {
+        return OK;
+    }
+
+    apr_status_t rc;
+    
+#ifdef SFWB_DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "sflow_post_config - pid=%u,tid=%u", getpid(),MYGETTID);
+#endif
+    
+#ifdef SFWB_APP_WORKERS
+    /* don't need to wait for second post_config call because we are not going to call start_sflow_master() until later.
+       Just allow the code below to run twice.  The advantage is that now mod-sflow can be loaded into a running
+       apache with just one SIGHUP instead of requring two. See http://wiki.apache.org/httpd/ModuleLife */
+#else
+    /* All post_config hooks are called twice on a full restart, we're only interested in the second call. */
+    apr_pool_userdata_get(&post_config_flag, MOD_SFLOW_USERDATA_KEY_POSTCONFIG, s->process->pool);
+    if (!post_config_flag) {
+        apr_pool_userdata_set((void*) 1, MOD_SFLOW_USERDATA_KEY_POSTCONFIG, apr_pool_cleanup_null, s->process->pool);
+        return OK;
+    }
+    /* get here on the second call... */
+#endif
+            
+            
+    /* number the virtual hosts,  and point each one back to this (the main
+       server's) state.  Without a directive of our own in a <VirtualHost>
+       httpd may just hand the vhost the same config as the main server,
+       so give it one of its own if so.  Any beyond SFWB_MAX_VHOSTS are
+       just counted as part of the main server. */
+    server_rec *vs;
+    apr_uint32_t servers = 1, folded = 0;
+    for(vs = s->next; vs && servers < SFWB_MAX_VHOSTS; vs = vs->next) servers++;
+    sm->main = NULL;
+    sm->vhostIdx = 0;
+    sm->num_vhosts = 1;
+    sm->vhostServers = apr_pcalloc(p, servers * sizeof(server_rec *));
+    sm->vhostServers[0] = s;
+    for(vs = s->next; vs; vs = vs->next) {
+        SFWB *vsm = GET_CONFIG_DATA(vs);
+        if(vsm == NULL || vsm == sm) {
+            vsm = apr_pcalloc(p, sizeof(SFWB));
+            ap_set_module_config(vs->module_config, &sflow_module, vsm);
+        }
+        vsm->main = sm;
+        vsm->vhostIdx = 0;
+        if(sm->num_vhosts < SFWB_MAX_VHOSTS) {
+            vsm->vhostIdx = sm->num_vhosts++;
+            sm->vhostServers[vsm->vhostIdx] = vs;
+        }
+        else folded++;
+    }
+    if(folded) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "%u virtual hosts after the first %u are counted as part of the main server",
+                     folded,
+                     SFWB_MAX_VHOSTS - 1);
+    }
+
+    /* try to retrieve the optional fn pointer from mod_logio that allows us to report both bytes_in and bytes_out */
+    if(!pfn_ap_logio_get_last_bytes) {
+        pfn_ap_logio_get_last_bytes = APR_RETRIEVE_OPTIONAL_FN(ap_logio_get_last_bytes);
+        if(!pfn_ap_logio_get_last_bytes) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "unable to retrieve optional fn ap_logio_get_last_bytes() -- perhaps mod logio not loaded?");
+        }
+    }
+            
+#ifdef SFWB_DEBUG
+    if((rc = ap_mpm_query(AP_MPMQ_IS_THREADED, &sm->mpm_threaded)) == APR_SUCCESS) {
+        /* We could use this information to decided whether to create the mutex in each child */
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "sflow_post_config - threaded=%u", sm->mpm_threaded);
+    }
+    else {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s, "sflow_post_config - ap_mpm_query(AP_MPMQ_IS_THREADED) failed");
+    }
+#endif
+            
+#ifdef SFWB_APP_WORKERS
+    /* read the numbers we need for the scoreboard - might as well do it here in case the child processes ever
+       need to know it too,  but it's likely that only the sflow "master" will care */
+    if((rc = ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS, &sm->mpm_thread_limit)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s,
+                     "sflow_post_config - ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS) failed");
+    }
+            
+    if((rc = ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &sm->mpm_server_limit)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s,
+                     "sflow_post_config - ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS) failed");
+    }
+            
+    /* if((rc = ap_mpm_query(AP_MPMQ_MAX_THREADS, &sm->mpm_threads_per_child)) != APR_SUCCESS) { */
+    /*     ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s, */
+    /*                  "sflow_post_config - ap_mpm_query(AP_MPMQ_MAX_THREADS) failed"); */
+    /* } */
+    /* /\* work around buggy MPMs - copied this check from mod_status *\/ */
+    /* if (sm->mpm_threads_per_child == 0) { */
+    /*     sm->mpm_threads_per_child = 1; */
+    /* } */
+            
+    /* if((rc = ap_mpm_query(AP_MPMQ_MAX_DAEMONS, &sm->mpm_max_servers)) != APR_SUCCESS) { */
+    /*     ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s, */
+    /*                  "sflow_post_config - ap_mpm_query(AP_MPMQ_MAX_DAEMONS) failed"); */
+    /* } */
+            
+    /* if((rc = ap_mpm_query(AP_MPMQ_IS_ASYNC, &sm->mpm_is_async)) != APR_SUCCESS) { */
+    /*     ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s, */
     /*                  "sflow_post_config - ap_mpm_query(AP_MPMQ_IS_ASYNC) failed"); */
     /* } */
 
-    /* cache the server_rec pointer so it can be used for logging from the sflow_master process */
-    sm->server_rec = s;
+    /* cache the server_rec pointer so it can be used for logging from the sflow_master process */
+    sm->server_rec = s;
+
+    /* also cache the server_rec pointer as pool user-data so it can be available to the pre_mpm hook that follows */
+    apr_pool_userdata_set((void*) s, MOD_SFLOW_USERDATA_KEY_POSTCONFIG_SERVERREC, apr_pool_cleanup_null, s->process->pool);
+
+    /* See if the pre_mpm hook was called before (i.e. see if this is a graceful restart) */
+    apr_pool_userdata_get(&pre_mpm_flag, MOD_SFLOW_USERDATA_KEY_PREMPM, s->process->pool);
+    if(sm->sFlowProc == NULL
+       && pre_mpm_flag) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "mod_sflow detected graceful restart");
+        start_sflow_master(p, s, sm);
+    }
+#else
+    /* see if we need to fork the master */
+    if(sm->sFlowProc == NULL) {
+        start_sflow_master(p, s, sm);
+    }
+#endif /* SFWB_APP_WORKERS */
+
+    /* record the fact that we were initialized in the expected way */
+    sm->initOK = true;
+    return OK;
+}
+
+#ifdef SFWB_APP_WORKERS
+/*_________________---------------------------__________________
+  _________________     sflow_pre_mpm         __________________
+  -----------------___________________________------------------
+*/
+
+static int sflow_pre_mpm(apr_pool_t *pool, ap_scoreboard_e sbtype)
+{
+    /* pick up the server_rec pointer that we stashed in the post_config hook. Note that
+       we are assuming that the pool we were given here is the s->process->pool */
+    server_rec *s = NULL;
+    apr_pool_userdata_get((void **)&s, MOD_SFLOW_USERDATA_KEY_POSTCONFIG_SERVERREC, pool);
+    
+    if(s == NULL
+       || s->module_config == NULL) {
+        return OK;
+    }
+    
+    SFWB *sm = GET_CONFIG_DATA(s);
+    if(sm == NULL
+       || sm->initOK == false) {
+        return OK;
+    }
+
+    /* what should we do if sbtype == SB_NOT_SHARED? */
+    
+#ifdef SFWB_DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "sflow_pre_mpm - pid=%u,tid=%u,scoreboard=%s,server_rec_OK=%s",
+                 getpid(),
+                 MYGETTID,
+                 ap_exists_scoreboard_image() ? "YES":"NO",
+                 (s == sm->server_rec) ? "YES":"NO");
+#endif
+    
+    /* see if we need to fork the master */
+    /* By delaying this to here, we ensure that the scoreboard has
+       already been created.  That means the sflow_master process
+       will inherit it (i.e. inherit the shared-memory handle) and
+       will then be able to walk it to read out the worker stats. */
+    if(sm->sFlowProc == NULL) {
+        start_sflow_master(pool, s, sm);
+    }
+
+    /* remember that we got here - so we know the difference
+       between a full restart and a graceful restart */
+    apr_pool_userdata_set((void*) 1, MOD_SFLOW_USERDATA_KEY_PREMPM, apr_pool_cleanup_null, pool);
+
+    return OK;
+}
+#endif /* SFWB_APP_WORKERS */
+
+/*_________________---------------------------__________________
+  _________________  child agent callbacks    __________________
+  -----------------___________________________------------------
+*/
+
+static void *sfwb_childcb_alloc(void *magic, SFLAgent *agent, apr_size_t bytes)
+{
+    SFWB *sm = (SFWB *)magic;
+    return apr_pcalloc(sm->child->childPool, bytes);
+}
+
+static int sfwb_childcb_free(void *magic, SFLAgent *agent, void *obj)
+{
+    /* do nothing - we'll free the whole sub-pool when we are ready */
+    return 0;
+}
+
+static void sfwb_childcb_error(void *magic, SFLAgent *agent, char *msg)
+{
+    ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL, "sFlow child agent error: %s", msg);
+}
+
+/*_________________---------------------------__________________
+  _________________  child agent init         __________________
+  -----------------___________________________------------------
+*/
+
+static void sflow_init_child(apr_pool_t *p, server_rec *s)
+{
+    /* be careful in case we are not initialized yet - e.g. maybe this module was installed
+       without a subsequent restart,  and there was a graceful restart on logrotate */
+    if(s == NULL
+       || s->module_config == NULL) {
+        return;
+    }
+
+    SFWB *sm = GET_CONFIG_DATA(s);
+
+    if(sm == NULL
+       || sm->shared_mem == NULL
+       || sm->initOK == false) {
+        return;
+    }
+    
+    apr_status_t rc;
+
+#ifdef SFWB_DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "sflow_init_child - pid=%u,tid=%u,scoreboard=%s", getpid(),MYGETTID,ap_exists_scoreboard_image() ? "YES":"NO");
+#endif
+
+    /* create my own private state, and hang it off the shared state */
+    SFWBChild *child = (SFWBChild *)apr_pcalloc(p, sizeof(SFWBChild));
+    sm->child = child;
+    /* remember the config pool so the allocation callback can use it (no
+       need for a sub-pool here because we don't need to recycle) */
+    child->childPool = p;
+    /* shared_mem base address - may be different for each child, so put in private state */
+    child->shared_mem_base = apr_shm_baseaddr_get(sm->shared_mem);
+
+    if(child->mutex == NULL) {
+        /* Create a mutex to allow worker threads in the same child process to share state */
+
+        /* this mutex may not be necessary if (sm->mpm_threaded==false), but the overhead is
+           low and we want the mutex code to be excercised and tested so just create one every time
+           whether it is needed or not. */
+
+        if((rc = apr_thread_mutex_create(&child->mutex, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s, "sflow_init_child - apr_thread_mutex_create() failed");
+        }
+    }
+
+    /* one set of histogram+totals per thread,  aligned to a cache-line */
+    int threads = 1;
+    if(ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads) != APR_SUCCESS || threads < 1) {
+        threads = 1;
+    }
+    child->num_threadSlots = threads;
+    char *slotmem = apr_pcalloc(p, ((threads + 1) * sizeof(SFWBThreadSlot)));
+    child->threadSlots = (SFWBThreadSlot *)(((apr_uintptr_t)slotmem + SFWB_CACHE_LINE - 1) & ~((apr_uintptr_t)SFWB_CACHE_LINE - 1));
+
+    /* create my own sFlow agent+sampler+receiver just so I can use it to encode XDR messages */
+    /* before sending them on the pipe */
+    child->agent = (SFLAgent *)apr_pcalloc(p, sizeof(SFLAgent));
+    SFLAddress myIP = { 0 }; /* blank address */
+    sfl_agent_init(child->agent,
+                   &myIP,
+                   1, /* subAgentId */
+                   sm->currentTime,
+                   sm->currentTime,
+                   sm,
+                   sfwb_childcb_alloc,
+                   sfwb_childcb_free,
+                   sfwb_childcb_error,
+                   NULL);
+
+    child->receiver = sfl_agent_addReceiver(child->agent);
+    sfl_receiver_set_sFlowRcvrOwner(child->receiver, "httpd sFlow Probe - child");
+    sfl_receiver_set_sFlowRcvrTimeout(child->receiver, 0xFFFFFFFF);
+    SFLDataSource_instance dsi;
+    /* the master ignores the dsi,  so just use the ds_instance to remember the stratum */
+    SFL_DS_SET(dsi, 0, 0, SFWB_STRATUM_ALL);
+    child->sampler = sfl_agent_addSampler(child->agent, &dsi);
+    sfl_sampler_set_sFlowFsReceiver(child->sampler, 1 /* receiver index*/);
+    SFL_DS_SET(dsi, 0, 0, SFWB_STRATUM_5XX);
+    child->sampler_5xx = sfl_agent_addSampler(child->agent, &dsi);
+    sfl_sampler_set_sFlowFsReceiver(child->sampler_5xx, 1 /* receiver index*/);
+    SFL_DS_SET(dsi, 0, 0, SFWB_STRATUM_SLOW);
+    child->sampler_slow = sfl_agent_addSampler(child->agent, &dsi);
+    sfl_sampler_set_sFlowFsReceiver(child->sampler_slow, 1 /* receiver index*/);
+    /* and one for every vhost,  in case datasource.http=vhost is (or becomes) set */
+    child->num_vhosts = sm->num_vhosts;
+    child->vhosts = (SFWBChildVhost *)apr_pcalloc(p, child->num_vhosts * sizeof(SFWBChildVhost));
+    apr_uint32_t v;
+    for(v = 0; v < child->num_vhosts; v++) {
+        SFL_DS_SET(dsi, 0, v + 1, SFWB_STRATUM_ALL);
+        child->vhosts[v].sampler = sfl_agent_addSampler(child->agent, &dsi);
+        sfl_sampler_set_sFlowFsReceiver(child->vhosts[v].sampler, 1 /* receiver index*/);
+        sfl_sampler_set_sFlowFsPacketSamplingRate(child->vhosts[v].sampler, 0);
+    }
+    /* and counters for every URI class there could be */
+    child->uriClasses = (SFWBChildShard *)apr_pcalloc(p, SFWB_MAX_URI_CLASSES * sizeof(SFWBChildShard));
+    /* and client group */
+    child->clientGroups = (SFWBChildShard *)apr_pcalloc(p, SFWB_MAX_CLIENT_GROUPS * sizeof(SFWBChildShard));
+    /* seed the random number generator */
+    sfl_random_init(apr_time_now() /*getpid()*/);
+    /* we'll pick up the sampling_rate later. Don't want to insist
+     * on it being present at startup - don't want to delay the
+     * startup if we can avoid it.  Just set it to 0 so we check for
+     * it. Otherwise it would have started out as the default (400) */
+    sfl_sampler_set_sFlowFsPacketSamplingRate(child->sampler, 0);
+    sfl_sampler_set_sFlowFsPacketSamplingRate(child->sampler_5xx, 0);
+    sfl_sampler_set_sFlowFsPacketSamplingRate(child->sampler_slow, 0);
+}
+
+/*_________________---------------------------__________________
+  _________________  read from shared mem     __________________
+  -----------------___________________________------------------
+*/
+
+static int read_shared_sampling_n(SFWBChild *child)
+{
+    SFWBShared *shared = (SFWBShared *)child->shared_mem_base;
+    /* it's a 32-bit aligned read, so we don't need a lock */
+    return shared->sflow_skip;
+}
+
+/*_________________---------------------------__________________
+  _________________   check sampling rate     __________________
+  -----------------___________________________------------------
+*/
+
+static void sflow_set_sampler_rate(SFLSampler *sampler, apr_uint32_t n)
+{
+    if(n != sfl_sampler_get_sFlowFsPacketSamplingRate(sampler)) {
+        /* it has changed */
+        sampler->samplePool = sfl_sampler_set_sFlowFsPacketSamplingRate(sampler, n);
+    }
+}
+
+static apr_uint32_t sflow_burst_rate(apr_uint32_t n, apr_uint32_t burst_n)
+{
+    /* a burst only ever samples more,  and leaves an unused stratum alone */
+    return (n && burst_n < n) ? burst_n : n;
+}
+
+static void sflow_set_random_skip(SFWBChild *child)
+{
+    SFWBShared *shared = (SFWBShared *)child->shared_mem_base;
+    int n = read_shared_sampling_n(child);
+    apr_uint32_t n_5xx = shared->sflow_skip_5xx;
+    apr_uint32_t n_slow = shared->sflow_skip_slow;
+    /* temporary override,  which just lapses when it expires */
+    if(shared->burst_until_S > apr_time_sec(apr_time_now())) {
+        apr_uint32_t burst_n = shared->burst_sampling_n;
+        if(burst_n) {
+            if(n > 0) n = sflow_burst_rate(n, burst_n);
+            n_5xx = sflow_burst_rate(n_5xx, burst_n);
+            n_slow = sflow_burst_rate(n_slow, burst_n);
+        }
+    }
+    if(n >= 0) {
+        /* got a valid setting */
+        sflow_set_sampler_rate(child->sampler, n);
+        apr_uint32_t v;
+        for(v = 0; v < child->num_vhosts; v++) {
+            sflow_set_sampler_rate(child->vhosts[v].sampler, n);
+        }
+    }
+    /* the strata. Clear the threshold before the rate goes to 0,  and
+       only set it again after the rate is in place,  because the
+       request threads test them without the mutex. */
+    if(n_slow == 0) child->slow_uS = 0;
+    sflow_set_sampler_rate(child->sampler_5xx, n_5xx);
+    sflow_set_sampler_rate(child->sampler_slow, n_slow);
+    if(n_slow) child->slow_uS = shared->slow_mS * 1000;
+
+    child->scoreboard_counters = shared->scoreboard_counters;
+    child->vhost_datasources = shared->vhost_datasources;
+    child->client_groups_useragent = shared->client_groups_useragent;
+    child->topk_enabled = shared->topk_enabled;
+    child->queue_wait = shared->queue_wait;
+
+    /* consistent sampling. The request threads read these without the
+       mutex too,  so the threshold is always cleared first and set last. */
+    const char *hash_header = child->hash_header ? child->hash_header : "";
+    if(strncmp(hash_header, shared->hash_header, SFWB_MAX_HASH_HEADER_LEN) != 0) {
+        child->hash_threshold = 0;
+        /* a fresh copy each time (rare),  so a thread still using the old one is safe */
+        char *hdr = apr_pstrndup(child->childPool, shared->hash_header, SFWB_MAX_HASH_HEADER_LEN - 1);
+        child->hash_traceparent = (strcasecmp(hdr, "traceparent") == 0);
+        child->hash_header = (*hdr) ? hdr : NULL;
+    }
+    child->hash_threshold = (child->hash_header && child->sampler->sFlowFsPacketSamplingRate)
+        ? (0xFFFFFFFF / child->sampler->sFlowFsPacketSamplingRate)
+        : 0;
+
+    /* distinct clients.  The session cookie is copied in the same way */
+    const char *session_cookie = child->session_cookie ? child->session_cookie : "";
+    if(strncmp(session_cookie, shared->session_cookie, SFWB_MAX_SESSION_COOKIE_LEN) != 0) {
+        char *cookie = apr_pstrndup(child->childPool, shared->session_cookie, SFWB_MAX_SESSION_COOKIE_LEN - 1);
+        child->session_cookie = (*cookie) ? cookie : NULL;
+    }
+    child->distinct_enabled = shared->distinct_enabled;
+}
+
+/*_________________---------------------------__________________
+  _________________   request-id hash         __________________
+  -----------------___________________________------------------
+  32-bit FNV-1a.  Cheap,  and easy to reproduce on other tiers.
+*/
+
+static apr_uint32_t sflow_request_id_hash(const char *id, bool_t traceparent)
+{
+    apr_uint32_t hash = 2166136261U;
+    apr_size_t len = SFWB_MAX_REQUEST_ID_LEN;
+    if(traceparent
+       && strlen(id) >= (SFWB_TRACEPARENT_TRACEID_OFFSET + SFWB_TRACEPARENT_TRACEID_LEN)
+       && id[SFWB_TRACEPARENT_TRACEID_OFFSET - 1] == '-') {
+        /* version "-" trace-id "-" parent-id "-" flags */
+        id += SFWB_TRACEPARENT_TRACEID_OFFSET;
+        len = SFWB_TRACEPARENT_TRACEID_LEN;
+    }
+    for(; len && *id; id++, len--) {
+        hash ^= (apr_byte_t)*id;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*_________________---------------------------__________________
+  _________________   URI classification      __________________
+  -----------------___________________________------------------
+  One pass down the shared trie (see sfwb_loadUriClasses),  looking
+  each character up in the node's sorted edges.  Returns the class,
+  SFWB_EXCLUDED,  or -1.
+*/
+
+static apr_int32_t sflow_uri_class(SFWBShared *shared, const char *uri)
+{
+    SFWBUriTrie *trie = &shared->uri_trie[shared->uri_trie_active & 1];
+    if(trie->num_nodes == 0
+       || uri == NULL) return -1;
+    SFWBUriTrieNode *node = &trie->node[0];
+    apr_uint32_t cls = node->prefixClass;
+    const apr_byte_t *p;
+    for(p = (const apr_byte_t *)uri; *p; p++) {
+        apr_uint32_t key = (apr_uint32_t)*p << 24;
+        apr_uint32_t lo = node->firstEdge;
+        apr_uint32_t hi = lo + node->numEdges;
+        if(hi > SFWB_URI_TRIE_MAX_NODES) return -1;
+        if(node->numEdges <= 8) {
+            /* (most nodes only have one or two) */
+            while(lo < hi && (trie->edge[lo] & 0xFF000000) < key) lo++;
+        }
+        else while(lo < hi) {
+            apr_uint32_t mid = (lo + hi) >> 1;
+            if((trie->edge[mid] & 0xFF000000) < key) lo = mid + 1;
+            else hi = mid;
+        }
+        if(lo == (node->firstEdge + node->numEdges)
+           || (trie->edge[lo] & 0xFF000000) != key) break;
+        apr_uint32_t next = trie->edge[lo] & 0x00FFFFFF;
+        if(next >= SFWB_URI_TRIE_MAX_NODES) return -1;
+        node = &trie->node[next];
+        if(node->prefixClass) cls = node->prefixClass;
+    }
+    if(*p == '\0' && node->exactClass) cls = node->exactClass;
+    if(cls == SFWB_SHARD_EXCLUDED) return SFWB_EXCLUDED;
+    return (cls && cls <= SFWB_MAX_URI_CLASSES) ? (apr_int32_t)(cls - 1) : -1;
+}
+
+/*_________________---------------------------__________________
+  _________________   client group lookup     __________________
+  -----------------___________________________------------------
+  Binary search for the last range starting at or below the address
+  (see sfwb_loadClientGroups).  Returns the group,  SFWB_EXCLUDED,
+  or -1.
+*/
+
+static apr_int32_t sflow_client_group(SFWBShared *shared, apr_sockaddr_t *sa)
+{
+    SFWBClientTable *table = &shared->client_table[shared->client_table_active & 1];
+    apr_uint32_t group = 0;
+    SFLIPv4 ip4;
+
+    if(sa == NULL
+       || (table->num_v4 + table->num_v6) == 0) return -1;
+
+    if(sa->family == APR_INET6
+       && sa->ipaddr_len == 16
+       && !ipv4MappedAddress((SFLIPv6 *)sa->ipaddr_ptr, &ip4)) {
+        apr_uint64_t hi = sfwb_addr64((apr_byte_t *)sa->ipaddr_ptr);
+        apr_uint64_t lo = sfwb_addr64((apr_byte_t *)sa->ipaddr_ptr + 8);
+        apr_uint32_t a = 0, b = table->num_v6;
+        if(b > SFWB_MAX_CLIENT_RANGES) return -1;
+        while(a < b) {
+            apr_uint32_t mid = (a + b) >> 1;
+            SFWBClientRange6 *rng = &table->v6[mid];
+            if(rng->start_hi < hi
+               || (rng->start_hi == hi && rng->start_lo <= lo)) a = mid + 1;
+            else b = mid;
+        }
+        if(a) group = table->v6[a - 1].group;
+    }
+    else {
+        apr_uint32_t addr;
+        if(sa->family == APR_INET && sa->ipaddr_len == 4) memcpy(&addr, sa->ipaddr_ptr, 4);
+        else if(sa->family == APR_INET6 && sa->ipaddr_len == 16) addr = ip4.addr;
+        else return -1;
+        addr = ntohl(addr);
+        apr_uint32_t a = 0, b = table->num_v4;
+        if(b > SFWB_MAX_CLIENT_RANGES) return -1;
+        while(a < b) {
+            apr_uint32_t mid = (a + b) >> 1;
+            if(table->v4[mid].start <= addr) a = mid + 1;
+            else b = mid;
+        }
+        if(a) group = table->v4[a - 1].group;
+    }
+    if(group == SFWB_SHARD_EXCLUDED) return SFWB_EXCLUDED;
+    return (group && group <= SFWB_MAX_CLIENT_GROUPS) ? (apr_int32_t)(group - 1) : -1;
+}
+
+/*_________________---------------------------__________________
+  _________________   User-Agent exclusions   __________________
+  -----------------___________________________------------------
+  Only reached if there are some (see sflow_init).
+*/
+
+static bool_t sflow_exclude_useragent(SFWBShared *shared, request_rec *r)
+{
+    const char *useragent = apr_table_get(r->headers_in, "User-Agent");
+    apr_uint32_t i, num = shared->num_exclude_useragents;
+    if(useragent == NULL) return false;
+    if(num > SFWB_MAX_EXCLUDE_USERAGENTS) num = SFWB_MAX_EXCLUDE_USERAGENTS;
+    for(i = 0; i < num; i++) {
+        apr_uint32_t len = shared->exclude_useragent_len[i];
+        if(len < SFWB_MAX_EXCLUDE_USERAGENT_LEN
+           && strncmp(useragent, shared->exclude_useragent[i], len) == 0) return true;
+    }
+    return false;
+}
+
+/*_________________---------------------------__________________
+  _________________   method numbers          __________________
+  -----------------___________________________------------------
+*/
+
+static SFLHTTP_method methodNumberLookup(int method)
+{
+    /* SFHTTP_HEAD is reported when request_req has the "header_only" flag
+       set, otherwise we map from method number to sFlow method number here. */
+    switch(method) {
+    case M_GET: return SFHTTP_GET;
+    case M_PUT: return SFHTTP_PUT;
+    case M_POST: return SFHTTP_POST;
+    case M_DELETE: return SFHTTP_DELETE;
+    case M_CONNECT: return SFHTTP_CONNECT;
+    case M_OPTIONS: return SFHTTP_OPTIONS;
+    case M_TRACE: return SFHTTP_TRACE;
+    case M_PATCH:
+    case M_PROPFIND:
+    case M_PROPPATCH:
+    case M_MKCOL:
+    case M_COPY:
+    case M_MOVE:
+    case M_LOCK:
+    case M_UNLOCK:
+    case M_VERSION_CONTROL:
+    case M_CHECKOUT:
+    case M_UNCHECKOUT:
+    case M_CHECKIN:
+    case M_UPDATE:
+    case M_LABEL:
+    case M_REPORT:
+    case M_MKWORKSPACE:
+    case M_MKACTIVITY:
+    case M_BASELINE_CONTROL:
+    case M_MERGE:
+    case M_INVALID:
+    default: return SFHTTP_OTHER;
+    }
+}
+
+
+/*_________________-----------------------------__________________
+  _________________      send_msg_to_master     __________________
+  -----------------_____________________________------------------
+*/
+
+static void send_msg_to_master(request_rec *r, SFWB *sm, SFLSampler *sampler, void *msg, apr_size_t msgBytes, char *msgDescr)
+{
+    apr_status_t rc;
+    apr_size_t msgBytesWritten;
+
+    if(msgBytes > PIPE_BUF) {
+        /* if msgBytes greater than PIPE_BUF the pipe write will not be atomic. Should never happen,
+           but can't risk it, since we are relying on this as the synchronization mechanism between processes */
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "msgBytes=%u exceeds %u-byte limit for atomic write on pipe (%s)",
+                      (apr_uint32_t)msgBytes,
+                      PIPE_BUF,
+                      msgDescr);
+        /* this counts as an sFlow drop-event */
+        sampler->dropEvents++;
+    }
+    else if((rc = apr_file_write_full(sm->pipe_write, msg, msgBytes, &msgBytesWritten)) != APR_SUCCESS) {
+        
+        /* this counts as an sFlow drop-event too */
+        sampler->dropEvents++;
+        
+        if(APR_STATUS_IS_EAGAIN(rc)) {
+            /* this can happen if the pipe is full - e.g. under high load conditions with
+               agressive sampling.  The pipe is non-blocking so we'll get EAGAIN or EWOULDBLOCK.
+               APR combines those two into APR_STATUS_IS_EAGAIN. */
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "got EAGAIN on pipe write - increment drop count (%s)",
+                          msgDescr);
+        }
+        else {
+            /* Some other error. Perhaps the pipe was closed at the other end.
+               This is a show-stopper. Just park. */
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, "error writing to pipe (%s)", msgDescr);
+            sm->child->sflow_disabled = true;
+        }
+    }
+}
+
+/*_________________-----------------------------__________________
+  _________________   send http counters        __________________
+  -----------------_____________________________------------------
+  Called from the child tick with the mutex held.  Unless "always" is
+  set,  a block with nothing in it is not sent at all,  which keeps
+  the pipe quiet when there are hundreds of idle vhosts.
+*/
+
+static void sflow_send_http_counters(request_rec *r, SFWB *sm, SFLHTTP_counters *ctrs, apr_uint32_t vhostIdx, bool_t always)
+{
+    SFWBChild *child = sm->child;
+    if(!always) {
+        apr_uint32_t *ctr = (apr_uint32_t *)ctrs;
+        apr_uint32_t i, nonzero = 0;
+        for(i = 0; i < (sizeof(*ctrs) / sizeof(apr_uint32_t)); i++) nonzero |= ctr[i];
+        if(nonzero == 0) return;
+    }
+
+    /* read and reset each counter using an atomic exchange
+       because other threads may still be incrementing these under our feet.
+       (In scoreboard counter mode they are all zero,  but any left over from
+       before a switch still get sent.) */
+    SFLHTTP_counters ctrs_snapshot;
+    ctrs_snapshot.method_option_count = apr_atomic_xchg32(&ctrs->method_option_count, 0);
+    ctrs_snapshot.method_get_count = apr_atomic_xchg32(&ctrs->method_get_count, 0);
+    ctrs_snapshot.method_head_count = apr_atomic_xchg32(&ctrs->method_head_count, 0);
+    ctrs_snapshot.method_post_count = apr_atomic_xchg32(&ctrs->method_post_count, 0);
+    ctrs_snapshot.method_put_count = apr_atomic_xchg32(&ctrs->method_put_count, 0);
+    ctrs_snapshot.method_delete_count = apr_atomic_xchg32(&ctrs->method_delete_count, 0);
+    ctrs_snapshot.method_trace_count = apr_atomic_xchg32(&ctrs->method_trace_count, 0);
+    ctrs_snapshot.method_connect_count = apr_atomic_xchg32(&ctrs->method_connect_count, 0);
+    ctrs_snapshot.method_other_count = apr_atomic_xchg32(&ctrs->method_other_count, 0);
+    ctrs_snapshot.status_1XX_count = apr_atomic_xchg32(&ctrs->status_1XX_count, 0);
+    ctrs_snapshot.status_2XX_count = apr_atomic_xchg32(&ctrs->status_2XX_count, 0);
+    ctrs_snapshot.status_3XX_count = apr_atomic_xchg32(&ctrs->status_3XX_count, 0);
+    ctrs_snapshot.status_4XX_count = apr_atomic_xchg32(&ctrs->status_4XX_count, 0);
+    ctrs_snapshot.status_5XX_count = apr_atomic_xchg32(&ctrs->status_5XX_count, 0);
+    ctrs_snapshot.status_other_count = apr_atomic_xchg32(&ctrs->status_other_count, 0);
+
+    /* point to the start of the datagram */
+    apr_uint32_t *msg = child->receiver->sampleCollector.datap;
+    /* msglen, msgType, msgId */
+    sfl_receiver_put32(child->receiver, 0); /* we'll come back and fill this in later */
+    sfl_receiver_put32(child->receiver, SFLCOUNTERS_SAMPLE);
+    sfl_receiver_put32(child->receiver, SFLCOUNTERS_HTTP);
+    sfl_receiver_put32(child->receiver, vhostIdx);
+    /* this assumes that sizeof(SFLHTTP_counters) == XDRSIZ_SFLHTTP_COUNTERS
+       should probably check that with an assertion, perhaps at compile-time? Or
+       we could use a compiler directive to make sure that the struct is packed */
+    sfl_receiver_putOpaque(child->receiver, (char *)&ctrs_snapshot, sizeof(ctrs_snapshot));
+    /* get the msg bytes */
+    apr_size_t msgBytes = (child->receiver->sampleCollector.datap - msg) << 2;
+    /* write this in as the first 32-bit word */
+    *msg = msgBytes;
+    /* send this counter update up to the master */
+    send_msg_to_master(r, sm, child->sampler, msg, msgBytes, "counter update");
+    /* reset the encoder for next time */
+    sfl_receiver_resetSampleCollector(child->receiver);
+}
+
+/*_________________----------------------------------_______________
+  _________________      sflow_add_random_skip       _______________
+  -----------------__________________________________---------------
+  return the result of atomic-adding the next random skip.  Also
+  accumulate the lastSkip so that we know what it was when we get to take
+  the next sample.
+*/
+
+static apr_int32_t sflow_add_random_skip(SFLSampler *sampler)
+{
+    apr_uint32_t next_skip = sfl_sampler_next_skip(sampler);
+    sampler->samplePool += next_skip;
+    apr_uint32_t test_skip = apr_atomic_add32(&sampler->skip, next_skip);
+    return (apr_int32_t)(test_skip + next_skip);
+}
+
 
-    /* also cache the server_rec pointer as pool user-data so it can be available to the pre_mpm hook that follows */
-    apr_pool_userdata_set((void*) s, MOD_SFLOW_USERDATA_KEY_POSTCONFIG_SERVERREC, apr_pool_cleanup_null, s->process->pool);
+/*_________________-----------------------------__________________
+  _________________   duration histogram        __________________
+  -----------------_____________________________------------------
+  see SFLHTTP_histogram in sflow.h for the bucket layout
+*/
 
-    /* See if the pre_mpm hook was called before (i.e. see if this is a graceful restart) */
-    apr_pool_userdata_get(&pre_mpm_flag, MOD_SFLOW_USERDATA_KEY_PREMPM, s->process->pool);
-    if(sm->sFlowProc == NULL
-       && pre_mpm_flag) {
-        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "mod_sflow detected graceful restart");
-        start_sflow_master(p, s, sm);
-    }
+#define SFWB_HISTOGRAM_SUB_MASK ((1 << SFLHTTP_HISTOGRAM_SUB_BITS) - 1)
+
+static apr_uint32_t sflow_duration_bucket(apr_uint32_t uS)
+{
+    apr_uint32_t e;
+    if(uS < (2 << SFLHTTP_HISTOGRAM_SUB_BITS)) return uS;
+    /* e = log2(uS) */
+#ifdef __GNUC__
+    e = 31 - __builtin_clz(uS);
 #else
-    /* see if we need to fork the master */
-    if(sm->sFlowProc == NULL) {
-        start_sflow_master(p, s, sm);
+    for(e = SFLHTTP_HISTOGRAM_SUB_BITS + 1; (uS >> (e + 1)) != 0; e++);
+#endif
+    return ((e - SFLHTTP_HISTOGRAM_SUB_BITS + 1) << SFLHTTP_HISTOGRAM_SUB_BITS)
+        + ((uS >> (e - SFLHTTP_HISTOGRAM_SUB_BITS)) & SFWB_HISTOGRAM_SUB_MASK);
+}
+
+static apr_uint64_t sflow_duration_bucket_limit(apr_uint32_t b)
+{
+    /* the first uS value beyond this bucket */
+    apr_uint32_t e, sub;
+    if(b < (2 << SFLHTTP_HISTOGRAM_SUB_BITS)) return b + 1;
+    e = (b >> SFLHTTP_HISTOGRAM_SUB_BITS) + SFLHTTP_HISTOGRAM_SUB_BITS - 1;
+    sub = b & SFWB_HISTOGRAM_SUB_MASK;
+    return ((apr_uint64_t)((1 << SFLHTTP_HISTOGRAM_SUB_BITS) + sub + 1)) << (e - SFLHTTP_HISTOGRAM_SUB_BITS);
+}
+
+static apr_uint64_t sflow_duration_percentile(SFLHTTP_histogram *h, apr_uint32_t per10000)
+{
+    /* report the upper limit of the bucket that the percentile falls in */
+    apr_uint64_t total = 0, sofar = 0;
+    apr_uint32_t b;
+    for(b = 0; b < SFLHTTP_HISTOGRAM_BUCKETS; b++) total += h->bucket[b];
+    if(total == 0) return 0;
+    for(b = 0; b < SFLHTTP_HISTOGRAM_BUCKETS; b++) {
+        sofar += h->bucket[b];
+        if((sofar * 10000) >= (total * per10000)) break;
     }
-#endif /* SFWB_APP_WORKERS */
+    if(b == SFLHTTP_HISTOGRAM_BUCKETS) b--;
+    return sflow_duration_bucket_limit(b) - 1;
+}
 
-    /* record the fact that we were initialized in the expected way */
-    sm->initOK = true;
-    return OK;
+/*_________________-----------------------------__________________
+  _________________   64-bit totals             __________________
+  -----------------_____________________________------------------
+  With only 32-bit atomic ops to work with,  a 64-bit total is kept as
+  a {lo,hi} pair and the carry is added to hi separately.  Reading them
+  back (and resetting) with two exchanges may catch a carry on the wrong
+  side,  but it is then just counted in the next interval,  so nothing
+  is lost from the running total.
+*/
+
+static void sflow_add64(apr_uint32_t *ctr, apr_uint64_t val)
+{
+    apr_uint32_t lo = (apr_uint32_t)val;
+    apr_uint32_t hi = (apr_uint32_t)(val >> 32);
+    if(lo && apr_atomic_add32(&ctr[0], lo) > (0xFFFFFFFF - lo)) hi++;
+    if(hi) apr_atomic_add32(&ctr[1], hi);
 }
 
-#ifdef SFWB_APP_WORKERS
-/*_________________---------------------------__________________
-  _________________     sflow_pre_mpm         __________________
-  -----------------___________________________------------------
+static apr_uint64_t sflow_xchg64(apr_uint32_t *ctr)
+{
+    apr_uint64_t lo = apr_atomic_xchg32(&ctr[0], 0);
+    apr_uint64_t hi = apr_atomic_xchg32(&ctr[1], 0);
+    return (hi << 32) + lo;
+}
+
+/*_________________-----------------------------__________________
+  _________________   counter shards            __________________
+  -----------------_____________________________------------------
+  The counters for a URI class or client group.  The layout of the
+  http counters is the same as the server-wide ones,  so the method
+  and status counters are found at the same offsets.  Sending is also
+  done from the child tick with the mutex held,  and also skipped
+  when there is nothing to report.
 */
 
-static int sflow_pre_mpm(apr_pool_t *pool, ap_scoreboard_e sbtype)
+static void sflow_count_shard(SFWBChildShard *shard, apr_size_t methodOff, apr_size_t statusOff, apr_uint64_t bytes_in, apr_uint64_t bytes_out, apr_uint32_t duration_uS)
 {
-    /* pick up the server_rec pointer that we stashed in the post_config hook. Note that
-       we are assuming that the pool we were given here is the s->process->pool */
-    server_rec *s = NULL;
-    apr_pool_userdata_get((void **)&s, MOD_SFLOW_USERDATA_KEY_POSTCONFIG_SERVERREC, pool);
-    
-    if(s == NULL
-       || s->module_config == NULL) {
-        return OK;
-    }
-    
-    SFWB *sm = GET_CONFIG_DATA(s);
-    if(sm == NULL
-       || sm->initOK == false) {
-        return OK;
+    apr_atomic_inc32((apr_uint32_t *)&shard->http + methodOff);
+    apr_atomic_inc32((apr_uint32_t *)&shard->http + statusOff);
+    sflow_add64(shard->bytes_in, bytes_in);
+    sflow_add64(shard->bytes_out, bytes_out);
+    sflow_add64(shard->duration_uS, duration_uS);
+}
+
+static void sflow_send_shard_counters(request_rec *r, SFWB *sm, SFWBChildShard *shard, apr_uint32_t msgId, apr_uint32_t idx, char *msgDescr)
+{
+    SFWBChild *child = sm->child;
+    apr_uint32_t *ctr = (apr_uint32_t *)shard;
+    apr_uint32_t i, nonzero = 0;
+    for(i = 0; i < (sizeof(*shard) / sizeof(apr_uint32_t)); i++) nonzero |= ctr[i];
+    if(nonzero == 0) return;
+
+    SFLHTTP_counters ctrs_snapshot;
+    SFLHTTP_totals totals_snapshot;
+    apr_uint32_t *snap = (apr_uint32_t *)&ctrs_snapshot;
+    for(i = 0; i < (sizeof(ctrs_snapshot) / sizeof(apr_uint32_t)); i++) {
+        snap[i] = apr_atomic_xchg32((apr_uint32_t *)&shard->http + i, 0);
     }
+    totals_snapshot.requests = 0; /* (the master counts them from the methods) */
+    totals_snapshot.bytes_in = sflow_xchg64(shard->bytes_in);
+    totals_snapshot.bytes_out = sflow_xchg64(shard->bytes_out);
+    totals_snapshot.duration_uS = sflow_xchg64(shard->duration_uS);
+
+    apr_uint32_t *msg = child->receiver->sampleCollector.datap;
+    sfl_receiver_put32(child->receiver, 0); /* we'll come back and fill this in later */
+    sfl_receiver_put32(child->receiver, SFLCOUNTERS_SAMPLE);
+    sfl_receiver_put32(child->receiver, msgId);
+    sfl_receiver_put32(child->receiver, idx);
+    sfl_receiver_putOpaque(child->receiver, (char *)&ctrs_snapshot, sizeof(ctrs_snapshot));
+    sfl_receiver_putOpaque(child->receiver, (char *)&totals_snapshot, sizeof(totals_snapshot));
+    apr_size_t msgBytes = (child->receiver->sampleCollector.datap - msg) << 2;
+    *msg = msgBytes;
+    send_msg_to_master(r, sm, child->sampler, msg, msgBytes, msgDescr);
+    sfl_receiver_resetSampleCollector(child->receiver);
+}
 
-    /* what should we do if sbtype == SB_NOT_SHARED? */
-    
-#ifdef SFWB_DEBUG
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
-                 "sflow_pre_mpm - pid=%u,tid=%u,scoreboard=%s,server_rec_OK=%s",
-                 getpid(),
-                 MYGETTID,
-                 ap_exists_scoreboard_image() ? "YES":"NO",
-                 (s == sm->server_rec) ? "YES":"NO");
+/*_________________-----------------------------__________________
+  _________________   heavy hitters (child)     __________________
+  -----------------_____________________________------------------
+  The request thread writes the active sketches in its own slot.
+  The connection id is no good for picking the slot here,  because a
+  keepalive connection can move to another worker (event MPM) and
+  mod_http2 runs one connection's streams on several at once,  so each
+  thread takes the next slot number the first time it gets here.  The
+  busy flag (on the URI sketch,  for both kinds) covers the rest:  a
+  thread that finds it taken just doesn't count that request.  The
+  child tick merges the idle ones and then swaps over,  in the same
+  way as the URI class tries,  and leaves any that are still busy for
+  next time.
+*/
+
+#ifdef __GNUC__
+/* this thread's slot + 1 (0 until its first request) */
+static __thread apr_uint32_t sflow_topk_thread_slot;
 #endif
-    
-    /* see if we need to fork the master */
-    /* By delaying this to here, we ensure that the scoreboard has
-       already been created.  That means the sflow_master process
-       will inherit it (i.e. inherit the shared-memory handle) and
-       will then be able to walk it to read out the worker stats. */
-    if(sm->sFlowProc == NULL) {
-        start_sflow_master(pool, s, sm);
+
+static apr_uint32_t sflow_topk_slot(SFWBChild *child, request_rec *r)
+{
+#ifdef __GNUC__
+    if(sflow_topk_thread_slot == 0) {
+        sflow_topk_thread_slot = apr_atomic_inc32(&child->topk_threads) + 1;
     }
+    return (sflow_topk_thread_slot - 1) % child->num_threadSlots;
+#else
+    return r->connection->id % child->num_threadSlots;
+#endif
+}
 
-    /* remember that we got here - so we know the difference
-       between a full restart and a graceful restart */
-    apr_pool_userdata_set((void*) 1, MOD_SFLOW_USERDATA_KEY_PREMPM, apr_pool_cleanup_null, pool);
+static void sflow_topk_count(SFWBChild *child, request_rec *r)
+{
+    apr_uint32_t slot = sflow_topk_slot(child, r);
+    SFWBTopK *tk = &child->topk[((slot * 2) + (child->topk_active & 1)) * SFWB_TOPK_KINDS];
+    if(apr_atomic_cas32(&tk[SFWB_TOPK_URI].busy, 1, 0) != 0) return;
+    if(r->uri) sfwb_topkAdd(&tk[SFWB_TOPK_URI], sfwb_topkHash(r->uri), r->uri, 1, 0);
+    if(r->hostname) sfwb_topkAdd(&tk[SFWB_TOPK_HOST], sfwb_topkHash(r->hostname), r->hostname, 1, 0);
+    apr_atomic_xchg32(&tk[SFWB_TOPK_URI].busy, 0);
+}
 
-    return OK;
+static void sflow_send_topk(request_rec *r, SFWB *sm)
+{
+    SFWBChild *child = sm->child;
+    apr_uint32_t idle = (child->topk_active ^ 1) & 1;
+    apr_uint32_t k, t, i;
+
+    for(t = 0; t < child->num_threadSlots; t++) {
+        SFWBTopK *tk = &child->topk[((t * 2) + idle) * SFWB_TOPK_KINDS];
+        /* (still being written by a thread that picked it before the last swap) */
+        if(apr_atomic_cas32(&tk[SFWB_TOPK_URI].busy, 1, 0) != 0) continue;
+        for(k = 0; k < SFWB_TOPK_KINDS; k++) {
+            for(i = 0; i < tk[k].num; i++) {
+                sfwb_topkAdd(&child->topkMerged[k], tk[k].hash[i], tk[k].entry[i].name, tk[k].entry[i].count, tk[k].entry[i].error);
+            }
+            sfwb_topkClear(&tk[k]);
+        }
+        apr_atomic_xchg32(&tk[SFWB_TOPK_URI].busy, 0);
+    }
+    /* the idle ones are empty now,  so start on those */
+    apr_atomic_xchg32(&child->topk_active, idle);
+
+    /* and send the merged ones,  in as many messages as it takes */
+    apr_uint32_t msg[PIPE_BUF / sizeof(apr_uint32_t)];
+    apr_uint32_t perMsg = (sizeof(msg) - (5 * sizeof(apr_uint32_t))) / sizeof(SFWBTopKEntry);
+    for(k = 0; k < SFWB_TOPK_KINDS; k++) {
+        SFWBTopK *merged = &child->topkMerged[k];
+        for(i = 0; i < merged->num; i += perMsg) {
+            apr_uint32_t n = merged->num - i;
+            if(n > perMsg) n = perMsg;
+            apr_size_t msgBytes = (5 * sizeof(apr_uint32_t)) + (n * sizeof(SFWBTopKEntry));
+            msg[0] = msgBytes;
+            msg[1] = SFLCOUNTERS_SAMPLE;
+            msg[2] = SFWB_MSG_TOPK;
+            msg[3] = k;
+            msg[4] = n;
+            memcpy(&msg[5], &merged->entry[i], n * sizeof(SFWBTopKEntry));
+            send_msg_to_master(r, sm, child->sampler, msg, msgBytes, "topk update");
+        }
+        sfwb_topkClear(merged);
+    }
 }
-#endif /* SFWB_APP_WORKERS */
 
-/*_________________---------------------------__________________
-  _________________  child agent callbacks    __________________
-  -----------------___________________________------------------
+/*_________________-----------------------------__________________
+  _________________   distinct clients (child)  __________________
+  -----------------_____________________________------------------
+  FNV-1a 64 is quick but leaves the high bits weak,  and those pick
+  the register,  so the murmur3 finalizer goes on the end.
 */
 
-static void *sfwb_childcb_alloc(void *magic, SFLAgent *agent, apr_size_t bytes)
+static apr_uint64_t sflow_fnv64(apr_uint64_t hash, const void *data, apr_size_t len)
 {
-    SFWB *sm = (SFWB *)magic;
-    return apr_pcalloc(sm->child->childPool, bytes);
+    const unsigned char *p = (const unsigned char *)data;
+    while(len--) {
+        hash ^= *p++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
 }
 
-static int sfwb_childcb_free(void *magic, SFLAgent *agent, void *obj)
+static apr_uint64_t sflow_fmix64(apr_uint64_t h)
 {
-    /* do nothing - we'll free the whole sub-pool when we are ready */
-    return 0;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
 }
 
-static void sfwb_childcb_error(void *magic, SFLAgent *agent, char *msg)
+static void sflow_hll_add(apr_uint32_t *reg, apr_uint64_t hash)
 {
-    ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL, "sFlow child agent error: %s", msg);
+    apr_uint32_t idx = (apr_uint32_t)(hash >> (64 - SFWB_HLL_BITS));
+    /* rank = position of the first 1 bit in what's left (the sentinel bit caps it) */
+    apr_uint64_t w = (hash << SFWB_HLL_BITS) | ((apr_uint64_t)1 << (SFWB_HLL_BITS - 1));
+    apr_uint32_t rank = 1;
+#ifdef __GNUC__
+    rank += __builtin_clzll(w);
+#else
+    while(!(w & 0x8000000000000000ULL)) { w <<= 1; rank++; }
+#endif
+    /* only ever goes up,  so once a window is under way this is mostly just the read */
+    apr_uint32_t old = reg[idx];
+    while(rank > old) {
+        apr_uint32_t seen = apr_atomic_cas32(&reg[idx], rank, old);
+        if(seen == old) break;
+        old = seen;
+    }
 }
 
-/*_________________---------------------------__________________
-  _________________  child agent init         __________________
-  -----------------___________________________------------------
+/* find the value of the named cookie in the Cookie header */
+static const char *sflow_cookie(request_rec *r, const char *name, apr_size_t *len)
+{
+    const char *cookies = apr_table_get(r->headers_in, "Cookie");
+    if(cookies == NULL) return NULL;
+    apr_size_t nameLen = strlen(name);
+    const char *p = cookies;
+    while(*p) {
+        while(*p == ' ' || *p == ';') p++;
+        const char *end = strchr(p, ';');
+        if(end == NULL) end = p + strlen(p);
+        if((apr_size_t)(end - p) > nameLen
+           && p[nameLen] == '='
+           && strncmp(p, name, nameLen) == 0) {
+            *len = (end - p) - (nameLen + 1);
+            return p + nameLen + 1;
+        }
+        p = end;
+    }
+    return NULL;
+}
+
+static void sflow_count_distinct(SFWBChild *child, SFWBShared *shared, request_rec *r)
+{
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+    apr_sockaddr_t *client = child->client_groups_useragent ? r->useragent_addr : r->connection->client_addr;
+#else
+    apr_sockaddr_t *client = r->connection->remote_addr;
+#endif
+    apr_uint32_t (*hll)[SFWB_HLL_REGISTERS] = shared->hll[shared->hll_active & 1];
+    apr_uint64_t addrHash = SFWB_FNV64_INIT;
+    if(client && client->ipaddr_ptr) {
+        addrHash = sflow_fnv64(addrHash, client->ipaddr_ptr, client->ipaddr_len);
+        sflow_hll_add(hll[SFWB_HLL_CLIENTS], sflow_fmix64(addrHash));
+    }
+    const char *session_cookie = child->session_cookie;
+    if(session_cookie) {
+        /* no cookie yet is no session yet */
+        apr_size_t len = 0;
+        const char *session = sflow_cookie(r, session_cookie, &len);
+        if(session && len) {
+            sflow_hll_add(hll[SFWB_HLL_SESSIONS], sflow_fmix64(sflow_fnv64(SFWB_FNV64_INIT, session, len)));
+        }
+    }
+    else {
+        const char *useragent = apr_table_get(r->headers_in, "User-Agent");
+        if(useragent) addrHash = sflow_fnv64(addrHash, useragent, strlen(useragent));
+        sflow_hll_add(hll[SFWB_HLL_SESSIONS], sflow_fmix64(addrHash));
+    }
+}
+
+/*_________________-----------------------------__________________
+  _________________     get_bytes_in            __________________
+  -----------------_____________________________------------------
 */
 
-static void sflow_init_child(apr_pool_t *p, server_rec *s)
+static apr_off_t get_bytes_in(request_rec *r)
 {
-    /* be careful in case we are not initialized yet - e.g. maybe this module was installed
-       without a subsequent restart,  and there was a graceful restart on logrotate */
-    if(s == NULL
-       || s->module_config == NULL) {
-        return;
+    apr_uint64_t ans = 0;
+    if(pfn_ap_logio_get_last_bytes) {
+        /* mod_logio has supplied us with an option fn, but it only
+           exposes the total bytes this way (the in/out bytes calls
+           into mod_logio are shared only with the logger module).
+           Happily we already know bytes_sent so we can just subtract it
+           to get bytes_in.  I imagine that this will sometimes
+           be wrong,  but probably not by much. */
+        apr_uint64_t total_bytes = pfn_ap_logio_get_last_bytes(r->connection);
+        apr_uint64_t bytes_out = r->bytes_sent;
+        if(total_bytes >= bytes_out) ans = total_bytes - bytes_out;
     }
+    return ans;
+}
 
-    SFWB *sm = GET_CONFIG_DATA(s);
+/*_________________-----------------------------__________________
+  _________________   app_operations status     __________________
+  -----------------_____________________________------------------
+*/
 
-    if(sm == NULL
-       || sm->shared_mem == NULL
-       || sm->initOK == false) {
-        return;
+static apr_uint32_t *sflow_app_operations_counter(SFLAPPOperations *ops, int status)
+{
+    switch(status) {
+    case HTTP_REQUEST_TIME_OUT:
+    case HTTP_GATEWAY_TIME_OUT: return &ops->errors_TIMEOUT;
+    case HTTP_INTERNAL_SERVER_ERROR: return &ops->errors_INTERNAL_ERROR;
+    case HTTP_BAD_REQUEST: return &ops->errors_BAD_REQUEST;
+    case HTTP_FORBIDDEN: return &ops->errors_FORBIDDEN;
+    case HTTP_REQUEST_ENTITY_TOO_LARGE:
+    case HTTP_REQUEST_URI_TOO_LARGE: return &ops->errors_TOO_LARGE;
+    case HTTP_NOT_IMPLEMENTED: return &ops->errors_NOT_IMPLEMENTED;
+    case HTTP_NOT_FOUND:
+    case HTTP_GONE: return &ops->errors_NOT_FOUND;
+    case HTTP_SERVICE_UNAVAILABLE: return &ops->errors_UNAVAILABLE;
+    case HTTP_UNAUTHORIZED: return &ops->errors_UNAUTHORIZED;
+    default: break;
     }
-    
-    apr_status_t rc;
+    if(status >= 100 && status < 400) return &ops->status_OK;
+    return &ops->errors_OTHER;
+}
 
-#ifdef SFWB_DEBUG
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "sflow_init_child - pid=%u,tid=%u,scoreboard=%s", getpid(),MYGETTID,ap_exists_scoreboard_image() ? "YES":"NO");
-#endif
+/*_________________---------------------------__________________
+  _________________      child tick           __________________
+  -----------------___________________________------------------
+  Every SFWB_CHILD_TICK_US or so,  one request thread sends the
+  counters up to the master and picks up any new settings.
+*/
 
-    /* create my own private state, and hang it off the shared state */
-    SFWBChild *child = (SFWBChild *)apr_pcalloc(p, sizeof(SFWBChild));
-    sm->child = child;
-    /* remember the config pool so the allocation callback can use it (no
-       need for a sub-pool here because we don't need to recycle) */
-    child->childPool = p;
-    /* shared_mem base address - may be different for each child, so put in private state */
-    child->shared_mem_base = apr_shm_baseaddr_get(sm->shared_mem);
+static void sflow_child_tick(request_rec *r, SFWB *sm, apr_time_t now_uS)
+{
+    SFWBChild *child = sm->child;
+    if((now_uS - child->lastTickTime) > SFWB_CHILD_TICK_US) {
+        bool_t ctrl = false;
+        bool_t lockingOK = false;
+        SEMLOCK_DO(child->mutex, ctrl, lockingOK) {
+            child->lastTickTime = now_uS;
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "child tick - sending counters");
 
-    if(child->mutex == NULL) {
-        /* Create a mutex to allow worker threads in the same child process to share state */
+            /* the server-wide http counters,  and then any vhost that has something to report */
+            sflow_send_http_counters(r, sm, &child->http_counters.counterBlock.http, SFWB_NO_VHOST, true);
+            apr_uint32_t v;
+            for(v = 0; v < child->num_vhosts; v++) {
+                sflow_send_http_counters(r, sm, &child->vhosts[v].http, v, false);
+            }
+            /* and any URI class or client group that has seen a request */
+            SFWBShared *shared = (SFWBShared *)child->shared_mem_base;
+            apr_uint32_t i, num_uri_classes = shared->num_uri_classes, num_client_groups = shared->num_client_groups;
+            if(num_uri_classes > SFWB_MAX_URI_CLASSES) num_uri_classes = SFWB_MAX_URI_CLASSES;
+            if(num_client_groups > SFWB_MAX_CLIENT_GROUPS) num_client_groups = SFWB_MAX_CLIENT_GROUPS;
+            for(i = 0; i < num_uri_classes; i++) {
+                sflow_send_shard_counters(r, sm, &child->uriClasses[i], SFWB_MSG_URI_CLASS_COUNTERS, i, "URI class update");
+            }
+            for(i = 0; i < num_client_groups; i++) {
+                sflow_send_shard_counters(r, sm, &child->clientGroups[i], SFWB_MSG_CLIENT_GROUP_COUNTERS, i, "client group update");
+            }
+            /* the heavy hitters.  The sketches are only allocated once topk.http=on is seen */
+            if(child->topk_enabled && child->topk == NULL) {
+                apr_uint32_t n = child->num_threadSlots * 2 * SFWB_TOPK_KINDS;
+                SFWBTopK *topk = apr_pcalloc(child->childPool, n * sizeof(SFWBTopK));
+                for(i = 0; i < n; i++) sfwb_topkInit(&topk[i], SFWB_TOPK_THREAD, child->childPool);
+                child->topkMerged = apr_pcalloc(child->childPool, SFWB_TOPK_KINDS * sizeof(SFWBTopK));
+                for(i = 0; i < SFWB_TOPK_KINDS; i++) sfwb_topkInit(&child->topkMerged[i], SFWB_TOPK_CHILD, child->childPool);
+                child->topk = topk;
+            }
+            if(child->topk) sflow_send_topk(r, sm);
+            apr_uint32_t *msg;
+            apr_size_t msgBytes;
+
+            /* app_operations. Just the counters - the master fills in the application name */
+            SFLAPPOperations *ops = &child->app_operations.counterBlock.app_operations;
+            apr_uint32_t ops_snapshot[SFLAPP_NUM_OPERATIONS_COUNTERS];
+            ops_snapshot[0] = apr_atomic_xchg32(&ops->status_OK, 0);
+            ops_snapshot[1] = apr_atomic_xchg32(&ops->errors_OTHER, 0);
+            ops_snapshot[2] = apr_atomic_xchg32(&ops->errors_TIMEOUT, 0);
+            ops_snapshot[3] = apr_atomic_xchg32(&ops->errors_INTERNAL_ERROR, 0);
+            ops_snapshot[4] = apr_atomic_xchg32(&ops->errors_BAD_REQUEST, 0);
+            ops_snapshot[5] = apr_atomic_xchg32(&ops->errors_FORBIDDEN, 0);
+            ops_snapshot[6] = apr_atomic_xchg32(&ops->errors_TOO_LARGE, 0);
+            ops_snapshot[7] = apr_atomic_xchg32(&ops->errors_NOT_IMPLEMENTED, 0);
+            ops_snapshot[8] = apr_atomic_xchg32(&ops->errors_NOT_FOUND, 0);
+            ops_snapshot[9] = apr_atomic_xchg32(&ops->errors_UNAVAILABLE, 0);
+            ops_snapshot[10] = apr_atomic_xchg32(&ops->errors_UNAUTHORIZED, 0);
+            msg = child->receiver->sampleCollector.datap;
+            sfl_receiver_put32(child->receiver, 0); /* we'll come back and fill this in later */
+            sfl_receiver_put32(child->receiver, SFLCOUNTERS_SAMPLE);
+            sfl_receiver_put32(child->receiver, SFLCOUNTERS_APP_OPERATIONS);
+            sfl_receiver_putOpaque(child->receiver, (char *)ops_snapshot, sizeof(ops_snapshot));
+            msgBytes = (child->receiver->sampleCollector.datap - msg) << 2;
+            *msg = msgBytes;
+            send_msg_to_master(r, sm, child->sampler, msg, msgBytes, "app_operations update");
+            sfl_receiver_resetSampleCollector(child->receiver);
 
-        /* this mutex may not be necessary if (sm->mpm_threaded==false), but the overhead is
-           low and we want the mutex code to be excercised and tested so just create one every time
-           whether it is needed or not. */
+            /* now the duration histogram - summing the per-thread copies */
+            SFLHTTP_histogram hist_snapshot;
+            apr_uint32_t b, t;
+            bool_t hist_nonzero = false;
+            memset(&hist_snapshot, 0, sizeof(hist_snapshot));
+            for(t = 0; t < child->num_threadSlots; t++) {
+                for(b = 0; b < SFLHTTP_HISTOGRAM_BUCKETS; b++) {
+                    apr_uint32_t *bucket = &child->threadSlots[t].c.histogram.bucket[b];
+                    if(*bucket) {
+                        hist_snapshot.bucket[b] += apr_atomic_xchg32(bucket, 0);
+                        hist_nonzero = true;
+                    }
+                }
+            }
+            if(hist_nonzero) {
+                msg = child->receiver->sampleCollector.datap;
+                sfl_receiver_put32(child->receiver, 0); /* we'll come back and fill this in later */
+                sfl_receiver_put32(child->receiver, SFLCOUNTERS_SAMPLE);
+                sfl_receiver_put32(child->receiver, SFLCOUNTERS_HTTP_HISTOGRAM);
+                sfl_receiver_putOpaque(child->receiver, (char *)&hist_snapshot, sizeof(hist_snapshot));
+                msgBytes = (child->receiver->sampleCollector.datap - msg) << 2;
+                *msg = msgBytes;
+                send_msg_to_master(r, sm, child->sampler, msg, msgBytes, "histogram update");
+                sfl_receiver_resetSampleCollector(child->receiver);
+            }
 
-        if((rc = apr_thread_mutex_create(&child->mutex, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS) {
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, rc, s, "sflow_init_child - apr_thread_mutex_create() failed");
-        }
-    }
+            /* and the totals */
+            SFLHTTP_totals totals_snapshot;
+            memset(&totals_snapshot, 0, sizeof(totals_snapshot));
+            for(t = 0; t < child->num_threadSlots; t++) {
+                SFWBThreadCounters *tc = &child->threadSlots[t].c;
+                totals_snapshot.bytes_in += sflow_xchg64(tc->bytes_in);
+                totals_snapshot.bytes_out += sflow_xchg64(tc->bytes_out);
+                totals_snapshot.duration_uS += sflow_xchg64(tc->duration_uS);
+            }
+            if(totals_snapshot.bytes_in
+               || totals_snapshot.bytes_out
+               || totals_snapshot.duration_uS) {
+                msg = child->receiver->sampleCollector.datap;
+                sfl_receiver_put32(child->receiver, 0); /* we'll come back and fill this in later */
+                sfl_receiver_put32(child->receiver, SFLCOUNTERS_SAMPLE);
+                sfl_receiver_put32(child->receiver, SFLCOUNTERS_HTTP_TOTALS);
+                sfl_receiver_putOpaque(child->receiver, (char *)&totals_snapshot, sizeof(totals_snapshot));
+                msgBytes = (child->receiver->sampleCollector.datap - msg) << 2;
+                *msg = msgBytes;
+                send_msg_to_master(r, sm, child->sampler, msg, msgBytes, "totals update");
+                sfl_receiver_resetSampleCollector(child->receiver);
+            }
 
-    /* create my own sFlow agent+sampler+receiver just so I can use it to encode XDR messages */
-    /* before sending them on the pipe */
-    child->agent = (SFLAgent *)apr_pcalloc(p, sizeof(SFLAgent));
-    SFLAddress myIP = { 0 }; /* blank address */
-    sfl_agent_init(child->agent,
-                   &myIP,
-                   1, /* subAgentId */
-                   sm->currentTime,
-                   sm->currentTime,
-                   sm,
-                   sfwb_childcb_alloc,
-                   sfwb_childcb_free,
-                   sfwb_childcb_error,
-                   NULL);
+            /* and the excluded requests,  which go in a block of their own */
+            apr_uint32_t excluded = 0;
+            for(t = 0; t < child->num_threadSlots; t++) {
+                apr_uint32_t *ex = &child->threadSlots[t].c.excluded;
+                if(*ex) excluded += apr_atomic_xchg32(ex, 0);
+            }
+            if(excluded) {
+                msg = child->receiver->sampleCollector.datap;
+                sfl_receiver_put32(child->receiver, 0); /* we'll come back and fill this in later */
+                sfl_receiver_put32(child->receiver, SFLCOUNTERS_SAMPLE);
+                sfl_receiver_put32(child->receiver, SFLCOUNTERS_HTTP_EXCLUDED);
+                sfl_receiver_put32(child->receiver, excluded);
+                msgBytes = (child->receiver->sampleCollector.datap - msg) << 2;
+                *msg = msgBytes;
+                send_msg_to_master(r, sm, child->sampler, msg, msgBytes, "excluded update");
+                sfl_receiver_resetSampleCollector(child->receiver);
+            }
 
-    child->receiver = sfl_agent_addReceiver(child->agent);
-    sfl_receiver_set_sFlowRcvrOwner(child->receiver, "httpd sFlow Probe - child");
-    sfl_receiver_set_sFlowRcvrTimeout(child->receiver, 0xFFFFFFFF);
-    SFLDataSource_instance dsi;
-    memset(&dsi, 0, sizeof(dsi)); /* will be ignored anyway */
-    child->sampler = sfl_agent_addSampler(child->agent, &dsi);
-    sfl_sampler_set_sFlowFsReceiver(child->sampler, 1 /* receiver index*/);
-    /* seed the random number generator */
-    sfl_random_init(apr_time_now() /*getpid()*/);
-    /* we'll pick up the sampling_rate later. Don't want to insist
-     * on it being present at startup - don't want to delay the
-     * startup if we can avoid it.  Just set it to 0 so we check for
-     * it. Otherwise it would have started out as the default (400) */
-    sfl_sampler_set_sFlowFsPacketSamplingRate(child->sampler, 0);
-}
+            /* and the queue wait (queue.http) */
+            SFLHTTP_queue queue_snapshot;
+            memset(&queue_snapshot, 0, sizeof(queue_snapshot));
+            for(t = 0; t < child->num_threadSlots; t++) {
+                SFWBThreadCounters *tc = &child->threadSlots[t].c;
+                queue_snapshot.wait_uS += sflow_xchg64(tc->queue_wait_uS);
+                if(tc->queue_waits) queue_snapshot.requests += apr_atomic_xchg32(&tc->queue_waits, 0);
+            }
+            if(queue_snapshot.requests) {
+                msg = child->receiver->sampleCollector.datap;
+                sfl_receiver_put32(child->receiver, 0); /* we'll come back and fill this in later */
+                sfl_receiver_put32(child->receiver, SFLCOUNTERS_SAMPLE);
+                sfl_receiver_put32(child->receiver, SFLCOUNTERS_HTTP_QUEUE);
+                sfl_receiver_putOpaque(child->receiver, (char *)&queue_snapshot, sizeof(queue_snapshot));
+                msgBytes = (child->receiver->sampleCollector.datap - msg) << 2;
+                *msg = msgBytes;
+                send_msg_to_master(r, sm, child->sampler, msg, msgBytes, "queue wait update");
+                sfl_receiver_resetSampleCollector(child->receiver);
+            }
 
-/*_________________---------------------------__________________
-  _________________  read from shared mem     __________________
-  -----------------___________________________------------------
-*/
+            /* This is a convenient time time to check in case the sampling-rate setting has changed. */
+            sflow_set_random_skip(child);
 
-static int read_shared_sampling_n(SFWBChild *child)
-{
-    SFWBShared *shared = (SFWBShared *)child->shared_mem_base;
-    /* it's a 32-bit aligned read, so we don't need a lock */
-    return shared->sflow_skip;
+        } /* SEMLOCK_DO */
+        
+        if(!lockingOK) {
+            /* something went wrong with acquiring or releasing the mutex lock.
+               That's a show-stopper. Bow out gracefully. */
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "sFlow mutex locking error - parking module");
+            child->sflow_disabled = true;
+        }
+    }
 }
 
 /*_________________---------------------------__________________
-  _________________   check sampling rate     __________________
+  _________________   thread CPU time         __________________
   -----------------___________________________------------------
+  Only comparable while the request stays on the same thread.  The
+  log hook can run on another worker (event MPM write completion,
+  mod_http2),  so the thread is remembered with the clock.
 */
 
-static void sflow_set_random_skip(SFWBChild *child)
+static apr_uint64_t sflow_thread_cpu_nS(void)
 {
-    int n = read_shared_sampling_n(child);
-    if(n >= 0) {
-        /* got a valid setting */
-        if(n != sfl_sampler_get_sFlowFsPacketSamplingRate(child->sampler)) {
-            /* it has changed */
-            child->sampler->samplePool = sfl_sampler_set_sFlowFsPacketSamplingRate(child->sampler, n);
-        }
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        return ((apr_uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
     }
+#endif
+    return 0;
 }
 
 /*_________________---------------------------__________________
-  _________________   method numbers          __________________
+  _________________   queue wait              __________________
   -----------------___________________________------------------
+  queue.http=on measures how long each request had been sitting in
+  the socket before a worker read it:  from the arrival of its last
+  segment (tcpi_last_data_recv,  in mS,  read at post_read_request)
+  to r->request_time.  That covers the accept queue,  the MPM's own
+  queues and a keepalive connection waiting for a worker,  none of
+  which is in the duration.  It goes into a counter block of its own
+  for every request,  and into the sample for the sampled ones.
+  Linux only.
 */
 
-static SFLHTTP_method methodNumberLookup(int method)
+static bool_t sflow_queue_wait_uS(request_rec *r, apr_uint32_t *wait_uS)
 {
-    /* SFHTTP_HEAD is reported when request_req has the "header_only" flag
-       set, otherwise we map from method number to sFlow method number here. */
-    switch(method) {
-    case M_GET: return SFHTTP_GET;
-    case M_PUT: return SFHTTP_PUT;
-    case M_POST: return SFHTTP_POST;
-    case M_DELETE: return SFHTTP_DELETE;
-    case M_CONNECT: return SFHTTP_CONNECT;
-    case M_OPTIONS: return SFHTTP_OPTIONS;
-    case M_TRACE: return SFHTTP_TRACE;
-    case M_PATCH:
-    case M_PROPFIND:
-    case M_PROPPATCH:
-    case M_MKCOL:
-    case M_COPY:
-    case M_MOVE:
-    case M_LOCK:
-    case M_UNLOCK:
-    case M_VERSION_CONTROL:
-    case M_CHECKOUT:
-    case M_UNCHECKOUT:
-    case M_CHECKIN:
-    case M_UPDATE:
-    case M_LABEL:
-    case M_REPORT:
-    case M_MKWORKSPACE:
-    case M_MKACTIVITY:
-    case M_BASELINE_CONTROL:
-    case M_MERGE:
-    case M_INVALID:
-    default: return SFHTTP_OTHER;
-    }
+#if defined(TCP_INFO) && defined(__linux__) && AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+    apr_socket_t *sock = ap_get_conn_socket(r->connection);
+    apr_os_sock_t fd;
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if(sock == NULL
+       || apr_os_sock_get(&fd, sock) != APR_SUCCESS) return false;
+    memset(&ti, 0, sizeof(ti));
+    if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0) return false;
+    apr_time_t arrived = apr_time_now() - ((apr_time_t)ti.tcpi_last_data_recv * 1000);
+    apr_time_t waited = r->request_time - arrived;
+    /* (a request in several segments can look like it arrived after it was read) */
+    *wait_uS = (waited <= 0) ? 0 : (waited > 0xFFFFFFFF) ? 0xFFFFFFFF : (apr_uint32_t)waited;
+    return true;
+#else
+    return false;
+#endif
 }
 
-
 /*_________________-----------------------------__________________
-  _________________      send_msg_to_master     __________________
+  _________________ sflow_post_read_request     __________________
   -----------------_____________________________------------------
+  The main stratum's sampling decision (see phase timing above).  The
+  vhost is known by now,  so this is the same sampler that the log
+  transaction hook would have used.  If there is no sampling rate yet
+  nothing is noted,  and the decision is left to the log hook.
 */
 
-static void send_msg_to_master(request_rec *r, SFWB *sm, void *msg, apr_size_t msgBytes, char *msgDescr)
+static int sflow_post_read_request(request_rec *r)
 {
-    apr_status_t rc;
-    apr_size_t msgBytesWritten;
+    if(r->main
+       || r->prev
+       || r->server == NULL
+       || r->server->module_config == NULL) {
+        return DECLINED;
+    }
+    apr_uint32_t vhostIdx;
+    SFWB *sm = sfwb_lookup(r->server, &vhostIdx);
+    if(sm == NULL
+       || sm->initOK == false) {
+        return DECLINED;
+    }
+    SFWBChild *child = sm->child;
+    if(child == NULL
+       || child->sflow_disabled
+       || child->sampler == NULL) {
+        return DECLINED;
+    }
 
-    if(msgBytes > PIPE_BUF) {
-        /* if msgBytes greater than PIPE_BUF the pipe write will not be atomic. Should never happen,
-           but can't risk it, since we are relying on this as the synchronization mechanism between processes */
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "msgBytes=%u exceeds %u-byte limit for atomic write on pipe (%s)",
-                      (apr_uint32_t)msgBytes,
-                      PIPE_BUF,
-                      msgDescr);
-        /* this counts as an sFlow drop-event */
-        sm->child->sampler->dropEvents++;
+    /* queue wait (queue.http) - counted for every request,  in this thread's slot */
+    apr_uint32_t queue_wait_uS = 0;
+    bool_t queued = false;
+    if(child->queue_wait
+       && (queued = sflow_queue_wait_uS(r, &queue_wait_uS))) {
+        SFWBThreadCounters *tctrs = &child->threadSlots[r->connection->id % child->num_threadSlots].c;
+        sflow_add64(tctrs->queue_wait_uS, queue_wait_uS);
+        apr_atomic_inc32(&tctrs->queue_waits);
     }
-    else if((rc = apr_file_write_full(sm->pipe_write, msg, msgBytes, &msgBytesWritten)) != APR_SUCCESS) {
-        
-        /* this counts as an sFlow drop-event too */
-        sm->child->sampler->dropEvents++;
-        
-        if(APR_STATUS_IS_EAGAIN(rc)) {
-            /* this can happen if the pipe is full - e.g. under high load conditions with
-               agressive sampling.  The pipe is non-blocking so we'll get EAGAIN or EWOULDBLOCK.
-               APR combines those two into APR_STATUS_IS_EAGAIN. */
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "got EAGAIN on pipe write - increment drop count (%s)",
-                          msgDescr);
-        }
-        else {
-            /* Some other error. Perhaps the pipe was closed at the other end.
-               This is a show-stopper. Just park. */
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, "error writing to pipe (%s)", msgDescr);
-            sm->child->sflow_disabled = true;
-        }
+
+    SFWBChildVhost *vhost = (child->vhost_datasources && vhostIdx < child->num_vhosts) ? &child->vhosts[vhostIdx] : NULL;
+    SFLSampler *sampler = vhost ? vhost->sampler : child->sampler;
+    if(unlikely(sfl_sampler_get_sFlowFsPacketSamplingRate(sampler) == 0)) {
+        return DECLINED;
     }
+
+    /* same as step 4 in the log hook */
+    const char *hash_header = child->hash_header;
+    apr_uint32_t hash_threshold = child->hash_threshold;
+    const char *request_id = NULL;
+    apr_uint32_t hash = 0;
+    bool_t takeSample;
+    if(hash_threshold
+       && hash_header
+       && (request_id = apr_table_get(r->headers_in, hash_header)) != NULL) {
+        apr_atomic_inc32(vhost ? &vhost->hash_pool : &child->hash_pool);
+        hash = sflow_request_id_hash(request_id, child->hash_traceparent);
+        takeSample = (hash <= hash_threshold);
+    }
+    else {
+        takeSample = (apr_atomic_dec32(&sampler->skip) == 0);
+    }
+
+    SFWBRequest *req = &sflow_unsampled;
+    if(unlikely(takeSample)) {
+        req = apr_pcalloc(r->pool, sizeof(SFWBRequest));
+        req->sampled = true;
+        req->hashed = (request_id != NULL);
+        req->hash = hash;
+        req->cpu_nS = sflow_thread_cpu_nS();
+        req->thread = apr_os_thread_current();
+        req->headers = apr_time_now();
+    }
+    else if(queued) {
+        /* the 5xx or slow stratum may still sample it */
+        req = apr_pcalloc(r->pool, sizeof(SFWBRequest));
+    }
+    if(queued) {
+        req->queued = true;
+        req->queue_wait_uS = queue_wait_uS;
+    }
+    ap_set_module_config(r->request_config, &sflow_module, req);
+    return DECLINED;
 }
 
-/*_________________----------------------------------_______________
-  _________________      sflow_add_random_skip       _______________
-  -----------------__________________________________---------------
-  return the result of atomic-adding the next random skip.  Also
-  accumulate the lastSkip so that we know what it was when we get to take
-  the next sample.
-*/
+/* the request that post_read_request saw,  even after an internal redirect */
+static SFWBRequest *sflow_sampled_request(request_rec *r)
+{
+    if(r->main) return NULL;
+    while(r->prev) r = r->prev;
+    SFWBRequest *req = ap_get_module_config(r->request_config, &sflow_module);
+    return (req && req->sampled) ? req : NULL;
+}
 
-static apr_int32_t sflow_add_random_skip(SFLSampler *sampler)
+/* insert_filter runs just before the handler */
+static void sflow_insert_filter(request_rec *r)
 {
-    apr_uint32_t next_skip = sfl_sampler_next_skip(sampler);
-    sampler->samplePool += next_skip;
-    apr_uint32_t test_skip = apr_atomic_add32(&sampler->skip, next_skip);
-    return (apr_int32_t)(test_skip + next_skip);
+    SFWBRequest *req = sflow_sampled_request(r);
+    if(req == NULL) return;
+    if(req->handler == 0) req->handler = apr_time_now();
+    ap_add_output_filter_handle(sflow_phases_filter_handle, req, r, r->connection);
 }
 
+static apr_status_t sflow_phases_filter(ap_filter_t *f, apr_bucket_brigade *bb)
+{
+    SFWBRequest *req = (SFWBRequest *)f->ctx;
+    apr_bucket *b;
+    for(b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb); b = APR_BUCKET_NEXT(b)) {
+        if(APR_BUCKET_IS_EOS(b)) {
+            req->handler_end = apr_time_now();
+            ap_remove_output_filter(f);
+            break;
+        }
+        if(req->first_byte == 0
+           && !APR_BUCKET_IS_METADATA(b)) {
+            req->first_byte = apr_time_now();
+        }
+    }
+    return ap_pass_brigade(f->next, bb);
+}
 
-/*_________________-----------------------------__________________
-  _________________     get_bytes_in            __________________
-  -----------------_____________________________------------------
-*/
+/* uS from the start of the request,  or 0 if it never got there */
+static apr_uint32_t sflow_phase_uS(request_rec *r, apr_time_t t)
+{
+    if(t <= r->request_time) return 0;
+    apr_time_t uS = t - r->request_time;
+    return (uS > 0xFFFFFFFF) ? 0xFFFFFFFF : (apr_uint32_t)uS;
+}
 
-static apr_off_t get_bytes_in(request_rec *r)
+/* a request that was counted into the main stratum early,  but isn't in it */
+static void sflow_early_divert(request_rec *r, SFWBChild *child, SFWBRequest *req, SFLSampler *sampler, apr_uint32_t *hash_pool)
 {
-    apr_uint64_t ans = 0;
-    if(pfn_ap_logio_get_last_bytes) {
-        /* mod_logio has supplied us with an option fn, but it only
-           exposes the total bytes this way (the in/out bytes calls
-           into mod_logio are shared only with the logger module).
-           Happily we already know bytes_sent so we can just subtract it
-           to get bytes_in.  I imagine that this will sometimes
-           be wrong,  but probably not by much. */
-        apr_uint64_t total_bytes = pfn_ap_logio_get_last_bytes(r->connection);
-        apr_uint64_t bytes_out = r->bytes_sent;
-        if(total_bytes >= bytes_out) ans = total_bytes - bytes_out;
+    /* (hash_pool is added to the sample_pool when the next sample is taken) */
+    apr_atomic_dec32(hash_pool);
+    if(req->sampled
+       && !req->hashed) {
+        /* it was the one that took the skip to zero,  so start the next one */
+        bool_t ctrl = false;
+        bool_t lockingOK = false;
+        SEMLOCK_DO(child->mutex, ctrl, lockingOK) {
+            while(sflow_add_random_skip(sampler) <= 0) {
+                sampler->dropEvents++;
+            }
+        }
+        if(!lockingOK) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "sFlow mutex locking error - parking module");
+            child->sflow_disabled = true;
+        }
     }
-    return ans;
 }
 
 /*_________________-----------------------------__________________
@@ -1750,7 +5216,8 @@ static int sflow_multi_log_transaction(request_rec *r)
         return OK;
     }
 
-    SFWB *sm = GET_CONFIG_DATA(r->server);
+    apr_uint32_t vhostIdx;
+    SFWB *sm = sfwb_lookup(r->server, &vhostIdx);
 
     if(sm == NULL
        || sm->initOK == false) {
@@ -1770,6 +5237,49 @@ static int sflow_multi_log_transaction(request_rec *r)
 
     apr_time_t now_uS = apr_time_now();
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "sflow_multi_log_transaction (sampler->skip=%u)", child->sampler->skip);
+    bool_t counting = !child->scoreboard_counters;
+
+    /* the main stratum is counted and sampled per vhost (datasource.http=vhost),  or server-wide */
+    SFWBChildVhost *vhost = (child->vhost_datasources && vhostIdx < child->num_vhosts) ? &child->vhosts[vhostIdx] : NULL;
+    SFLSampler *mainSampler = vhost ? vhost->sampler : child->sampler;
+    apr_uint32_t *hash_pool = vhost ? &vhost->hash_pool : &child->hash_pool;
+    /* the main stratum's decision,  if post_read_request made it (see phase timing) */
+    SFWBRequest *early = ap_get_module_config(r->request_config, &sflow_module);
+
+    /* 0. exclusions first (exclude.http.*).  The URI class and client group
+       come from the same lookups,  so they are only done once,  and only
+       if something needs them.  An excluded request is just counted as
+       such,  in this thread's own slot. */
+    SFWBShared *shared = (SFWBShared *)child->shared_mem_base;
+    apr_int32_t uriClass = -1;
+    apr_int32_t clientGroup = -1;
+    if(counting || shared->exclude_lookups) {
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+        apr_sockaddr_t *client = child->client_groups_useragent ? r->useragent_addr : r->connection->client_addr;
+#else
+        apr_sockaddr_t *client = r->connection->remote_addr;
+#endif
+        uriClass = sflow_uri_class(shared, r->uri);
+        clientGroup = sflow_client_group(shared, client);
+    }
+    if(uriClass == SFWB_EXCLUDED
+       || clientGroup == SFWB_EXCLUDED
+       || (shared->num_exclude_useragents && sflow_exclude_useragent(shared, r))) {
+        apr_atomic_inc32(&child->threadSlots[r->connection->id % child->num_threadSlots].c.excluded);
+        if(early) sflow_early_divert(r, child, early, mainSampler, hash_pool);
+        sflow_child_tick(r, sm, now_uS);
+        return OK;
+    }
+
+    /* heavy hitters (topk.http),  in this thread's own sketch */
+    if(child->topk_enabled && child->topk) {
+        sflow_topk_count(child, r);
+    }
+
+    /* distinct clients and sessions (distinct.http) */
+    if(child->distinct_enabled) {
+        sflow_count_distinct(child, shared, r);
+    }
 
     /* The simplest thing here would be just to mutex-lock this whole step.
        Most times through here we do very little anyway.  However the alternative
@@ -1779,45 +5289,128 @@ static int sflow_multi_log_transaction(request_rec *r)
        numbers of CPU-cores and threads the preference is for atomic operations.
        It's better to burn a few more cycles each time than to risk having the
        threads stall completely as they squabble over a mutex.  It looks like
-       we only need three atomic ops anyway:
+       we only need a handful of atomic ops anyway:
        1. increment method_xxx counter
-       2. increment status_xxx counter
-       3. decrement sampler skip
+       2. increment status_xxx counter (and the app_operations one)
+       3. increment duration histogram bucket and add to the bytes/duration
+          totals (in this thread's own copy),  and the same for the URI class
+          and client group
+       4. decrement sampler skip (for the stratum this request falls into)
+       With counters.http=scoreboard the master works the totals out from the
+       scoreboard instead, and steps 1-3 are skipped altogether.
     */
 
-    /* 1. increment method_xxx counter */
     apr_uint32_t method = r->header_only ? SFHTTP_HEAD : methodNumberLookup(r->method_number);
-    SFLHTTP_counters *ctrs = &child->http_counters.counterBlock.http;
-    apr_uint32_t *ctrptr;
-    switch(method) {
-    case SFHTTP_HEAD: ctrptr = &ctrs->method_head_count; break;
-    case SFHTTP_GET: ctrptr = &ctrs->method_get_count; break;
-    case SFHTTP_PUT: ctrptr = &ctrs->method_put_count; break;
-    case SFHTTP_POST: ctrptr = &ctrs->method_post_count; break;
-    case SFHTTP_DELETE: ctrptr = &ctrs->method_delete_count; break;
-    case SFHTTP_CONNECT: ctrptr = &ctrs->method_connect_count; break;
-    case SFHTTP_OPTIONS: ctrptr = &ctrs->method_option_count; break;
-    case SFHTTP_TRACE: ctrptr = &ctrs->method_trace_count; break;
-    default: ctrptr = &ctrs->method_other_count; break;
-    }
-    apr_atomic_inc32(ctrptr);
-    
-    /* 2. increment status_xxx counter */
-    if(r->status < 100) ctrptr = &ctrs->status_other_count;
-    else if(r->status < 200) ctrptr = &ctrs->status_1XX_count;
-    else if(r->status < 300) ctrptr = &ctrs->status_2XX_count;
-    else if(r->status < 400) ctrptr = &ctrs->status_3XX_count;
-    else if(r->status < 500) ctrptr = &ctrs->status_4XX_count;
-    else if(r->status < 600) ctrptr = &ctrs->status_5XX_count;    
-    else ctrptr = &ctrs->status_other_count;
-    apr_atomic_inc32(ctrptr);
-    
-    /* 3. decrement sampler skip (if we are sampling) */
-    if(unlikely(sfl_sampler_get_sFlowFsPacketSamplingRate(child->sampler) == 0)) {
+    apr_uint32_t duration_uS = now_uS - r->request_time;
+    apr_uint64_t bytes_in = 0;
+
+    if(counting) {
+        /* 1. increment method_xxx counter */
+        SFLHTTP_counters *ctrs = vhost ? &vhost->http : &child->http_counters.counterBlock.http;
+        apr_uint32_t *ctrptr;
+        switch(method) {
+        case SFHTTP_HEAD: ctrptr = &ctrs->method_head_count; break;
+        case SFHTTP_GET: ctrptr = &ctrs->method_get_count; break;
+        case SFHTTP_PUT: ctrptr = &ctrs->method_put_count; break;
+        case SFHTTP_POST: ctrptr = &ctrs->method_post_count; break;
+        case SFHTTP_DELETE: ctrptr = &ctrs->method_delete_count; break;
+        case SFHTTP_CONNECT: ctrptr = &ctrs->method_connect_count; break;
+        case SFHTTP_OPTIONS: ctrptr = &ctrs->method_option_count; break;
+        case SFHTTP_TRACE: ctrptr = &ctrs->method_trace_count; break;
+        default: ctrptr = &ctrs->method_other_count; break;
+        }
+        apr_atomic_inc32(ctrptr);
+        apr_uint32_t *methodCtr = ctrptr;
+
+        /* 2. increment status_xxx counter */
+        if(r->status < 100) ctrptr = &ctrs->status_other_count;
+        else if(r->status < 200) ctrptr = &ctrs->status_1XX_count;
+        else if(r->status < 300) ctrptr = &ctrs->status_2XX_count;
+        else if(r->status < 400) ctrptr = &ctrs->status_3XX_count;
+        else if(r->status < 500) ctrptr = &ctrs->status_4XX_count;
+        else if(r->status < 600) ctrptr = &ctrs->status_5XX_count;
+        else ctrptr = &ctrs->status_other_count;
+        apr_atomic_inc32(ctrptr);
+        apr_atomic_inc32(sflow_app_operations_counter(&child->app_operations.counterBlock.app_operations, r->status));
+
+        /* 3. increment duration histogram bucket and totals.  The connection id
+           is normally derived from the child and thread number, so this picks
+           out the thread's own slot.  If two threads should land on the same
+           slot it just costs some cache-line sharing. */
+        bytes_in = get_bytes_in(r);
+        SFWBThreadCounters *tctrs = &child->threadSlots[r->connection->id % child->num_threadSlots].c;
+        apr_atomic_inc32(&tctrs->histogram.bucket[sflow_duration_bucket(duration_uS)]);
+        sflow_add64(tctrs->bytes_in, bytes_in);
+        sflow_add64(tctrs->bytes_out, r->bytes_sent);
+        sflow_add64(tctrs->duration_uS, duration_uS);
+
+        /* 3a. and the same again for the URI class (classes.http) and the
+           client group (clients.http),  if the request has them */
+        apr_size_t methodOff = methodCtr - (apr_uint32_t *)ctrs;
+        apr_size_t statusOff = ctrptr - (apr_uint32_t *)ctrs;
+        if(uriClass >= 0) {
+            sflow_count_shard(&child->uriClasses[uriClass], methodOff, statusOff, bytes_in, r->bytes_sent, duration_uS);
+        }
+        if(clientGroup >= 0) {
+            sflow_count_shard(&child->clientGroups[clientGroup], methodOff, statusOff, bytes_in, r->bytes_sent, duration_uS);
+        }
+    }
+
+    /* 4. pick the stratum - just a couple of compares on values we have already.
+       A stratum is only picked if it has a sampling rate, otherwise the
+       request stays in the main one. */
+    SFLSampler *sampler = mainSampler;
+    if(r->status >= 500 && r->status < 600) {
+        if(child->sampler_5xx->sFlowFsPacketSamplingRate) sampler = child->sampler_5xx;
+    }
+    else if(child->slow_uS
+            && duration_uS >= child->slow_uS
+            && child->sampler_slow->sFlowFsPacketSamplingRate) {
+        sampler = child->sampler_slow;
+    }
+
+    /* the phase times go with the sample whichever stratum takes it,  and
+       so does the queue wait,  which is kept for every request */
+    SFWBRequest *phases = (early && early->sampled) ? early : NULL;
+    SFWBRequest *queue = (early && early->queued) ? early : NULL;
+    if(early && sampler != mainSampler) {
+        sflow_early_divert(r, child, early, mainSampler, hash_pool);
+        early = NULL;
+    }
+
+    /* and decrement its sampler skip (if we are sampling),  or in consistent
+       sampling mode just hash the request-id if there is one.  For the main
+       stratum that was usually done already,  at post_read_request. */
+    const char *hash_header = child->hash_header;
+    apr_uint32_t hash_threshold = child->hash_threshold;
+    const char *request_id = NULL;
+    bool_t hashed = false;
+    apr_uint32_t hash = 0;
+    bool_t takeSample = false;
+    if(early) {
+        takeSample = early->sampled;
+        hashed = early->hashed;
+        hash = early->hash;
+    }
+    else if(unlikely(sfl_sampler_get_sFlowFsPacketSamplingRate(sampler) == 0)) {
         /* don't have a sampling-rate setting yet. Check to see... */
             sflow_set_random_skip(child);
     }
-    else if(unlikely(apr_atomic_dec32(&child->sampler->skip) == 0)) {
+    else if(hash_threshold
+            && hash_header
+            && SFL_DS_INSTANCE(sampler->dsi) == SFWB_STRATUM_ALL
+            && (request_id = apr_table_get(r->headers_in, hash_header)) != NULL) {
+        /* the random skip is not involved,  so count this one into the pool separately */
+        apr_atomic_inc32(hash_pool);
+        hashed = true;
+        hash = sflow_request_id_hash(request_id, child->hash_traceparent);
+        takeSample = (hash <= hash_threshold);
+    }
+    else {
+        takeSample = (apr_atomic_dec32(&sampler->skip) == 0);
+    }
+
+    if(unlikely(takeSample)) {
         bool_t ctrl = false;
         bool_t lockingOK = false;
         SEMLOCK_DO(child->mutex, ctrl, lockingOK) {
@@ -1825,30 +5418,71 @@ static int sflow_multi_log_transaction(request_rec *r)
             /* point to the start of the datagram */
             apr_uint32_t *msg = child->receiver->sampleCollector.datap;
 
-            /* msglen, msgType, sample pool and drops */
+            /* msglen, msgType, sample pool, drops, stratum, vhost,  and whether it was
+               picked by its request-id hash and the hash (see collector sampling) */
             sfl_receiver_put32(child->receiver, 0); /* we'll come back and fill this in later */
             sfl_receiver_put32(child->receiver, SFLFLOW_SAMPLE);
             sfl_receiver_put32(child->receiver, SFLFLOW_HTTP);
-            sfl_receiver_put32(child->receiver, child->sampler->samplePool);
-            sfl_receiver_put32(child->receiver, child->sampler->dropEvents);
+            apr_uint32_t samplePool = sampler->samplePool;
+            bool_t mainStratum = (SFL_DS_INSTANCE(sampler->dsi) == SFWB_STRATUM_ALL);
+            if(mainStratum) samplePool += apr_atomic_xchg32(hash_pool, 0);
+            sfl_receiver_put32(child->receiver, samplePool);
+            sfl_receiver_put32(child->receiver, sampler->dropEvents);
+            sfl_receiver_put32(child->receiver, sampler->dsi.ds_instance);
+            sfl_receiver_put32(child->receiver, (vhost && mainStratum) ? vhostIdx : SFWB_NO_VHOST);
+            sfl_receiver_put32(child->receiver, hashed ? 1 : 0);
+            sfl_receiver_put32(child->receiver, hash);
             
             /* reset drops but don't bother using atomic op since we don't mind if this counter
                is imprecise. Under normal conditions it should never be incremented at all. */
-            child->sampler->dropEvents = 0;
+            sampler->dropEvents = 0;
             /* the samplePool is only ever accessed inside this mutex-protected block so we can
                be straightforward about it too */
-            child->sampler->samplePool = 0;
+            sampler->samplePool = 0;
             
             /* accumulate the pktlen here too, to satisfy a sanity-check in the sflow library (receiver) */
-            child->receiver->sampleCollector.pktlen += 20;
+            child->receiver->sampleCollector.pktlen += 36;
 
             const char *referer = apr_table_get(r->headers_in, "Referer");
             const char *useragent = apr_table_get(r->headers_in, "User-Agent");
             const char *contentType = apr_table_get(r->headers_out, "Content-Type");
             const char *xff = apr_table_get(r->headers_in, "X-Forwarded-For");
 
+            if(!counting) bytes_in = get_bytes_in(r);
+
+            SFLFlow_sample_element phasesElem = { 0 };
+            SFLFlow_sample_element resourcesElem = { 0 };
+            SFLFlow_sample_element queueElem = { 0 };
+            SFLFlow_sample_element *extraElems = NULL;
+            if(queue) {
+                queueElem.tag = SFLFLOW_HTTP_QUEUE_WAIT;
+                queueElem.flowType.http_queue_wait.wait_uS = queue->queue_wait_uS;
+                extraElems = &queueElem;
+            }
+            if(phases) {
+                phasesElem.tag = SFLFLOW_HTTP_PHASES;
+                phasesElem.flowType.http_phases.headers_uS = sflow_phase_uS(r, phases->headers);
+                phasesElem.flowType.http_phases.handler_uS = sflow_phase_uS(r, phases->handler);
+                phasesElem.flowType.http_phases.first_byte_uS = sflow_phase_uS(r, phases->first_byte);
+                phasesElem.flowType.http_phases.handler_end_uS = sflow_phase_uS(r, phases->handler_end);
+                /* CPU since post_read_request (0 if there's no clock,  or the
+                   request has moved to another thread since) */
+                apr_uint64_t cpu_nS = 0;
+                if(phases->cpu_nS
+                   && apr_os_thread_equal(phases->thread, apr_os_thread_current())) {
+                    cpu_nS = sflow_thread_cpu_nS();
+                }
+                resourcesElem.tag = SFLFLOW_HTTP_RESOURCES;
+                resourcesElem.flowType.http_resources.cpu_uS = (cpu_nS > phases->cpu_nS)
+                    ? (apr_uint32_t)((cpu_nS - phases->cpu_nS) / 1000)
+                    : 0;
+                resourcesElem.nxt = extraElems;
+                phasesElem.nxt = &resourcesElem;
+                extraElems = &phasesElem;
+            }
+
             /* encode the transaction sample next */
-            sflow_sample_http(child->sampler,
+            sflow_sample_http(sampler,
                               r->connection,
                               method,
                               r->proto_num,
@@ -1859,17 +5493,18 @@ static int sflow_multi_log_transaction(request_rec *r)
                               xff,
                               r->user,
                               contentType,
-                              get_bytes_in(r),
+                              bytes_in,
                               r->bytes_sent,
-                              now_uS - r->request_time,
-                              r->status);
+                              duration_uS,
+                              r->status,
+                              extraElems);
 
             /* get the message bytes including the sample */
             apr_size_t msgBytes = (child->receiver->sampleCollector.datap - msg) << 2;
             /* write this in as the first 32-bit word */
             *msg = msgBytes;
             /* send this http sample up to the master */
-            send_msg_to_master(r, sm, msg, msgBytes, "http sample");
+            send_msg_to_master(r, sm, sampler, msg, msgBytes, "http sample");
             /* reset the encoder for next time */
             sfl_receiver_resetSampleCollector(child->receiver);
 
@@ -1882,8 +5517,10 @@ static int sflow_multi_log_transaction(request_rec *r)
             /* one advantage of this approach is that we only have to generate a new random number when we
                take a sample,  and because we have the mutex locked we don't need to make the random number
                seed a per-thread variable. */
-            while(sflow_add_random_skip(child->sampler) <= 0) {
-                child->sampler->dropEvents++;
+            if(!hashed) {
+                while(sflow_add_random_skip(sampler) <= 0) {
+                    sampler->dropEvents++;
+                }
             }
 
         }
@@ -1895,66 +5532,50 @@ static int sflow_multi_log_transaction(request_rec *r)
             child->sflow_disabled = true;
         }
     }
-        
-            
-    if((now_uS - child->lastTickTime) > SFWB_CHILD_TICK_US) {
-        bool_t ctrl = false;
-        bool_t lockingOK = false;
-        SEMLOCK_DO(child->mutex, ctrl, lockingOK) {
-            child->lastTickTime = now_uS;
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "child tick - sending counters");
 
-            /* read and reset each counter using an atomic exchange
-               because other threads may still be incrementing these under our feet */
-            SFLHTTP_counters ctrs_snapshot;
-            ctrs_snapshot.method_option_count = apr_atomic_xchg32(&ctrs->method_option_count, 0);
-            ctrs_snapshot.method_get_count = apr_atomic_xchg32(&ctrs->method_get_count, 0);
-            ctrs_snapshot.method_head_count = apr_atomic_xchg32(&ctrs->method_head_count, 0);
-            ctrs_snapshot.method_post_count = apr_atomic_xchg32(&ctrs->method_post_count, 0);
-            ctrs_snapshot.method_put_count = apr_atomic_xchg32(&ctrs->method_put_count, 0);
-            ctrs_snapshot.method_delete_count = apr_atomic_xchg32(&ctrs->method_delete_count, 0);
-            ctrs_snapshot.method_trace_count = apr_atomic_xchg32(&ctrs->method_trace_count, 0);
-            ctrs_snapshot.method_connect_count = apr_atomic_xchg32(&ctrs->method_connect_count, 0);
-            ctrs_snapshot.method_other_count = apr_atomic_xchg32(&ctrs->method_other_count, 0);
-            ctrs_snapshot.status_1XX_count = apr_atomic_xchg32(&ctrs->status_1XX_count, 0);
-            ctrs_snapshot.status_2XX_count = apr_atomic_xchg32(&ctrs->status_2XX_count, 0);
-            ctrs_snapshot.status_3XX_count = apr_atomic_xchg32(&ctrs->status_3XX_count, 0);
-            ctrs_snapshot.status_4XX_count = apr_atomic_xchg32(&ctrs->status_4XX_count, 0);
-            ctrs_snapshot.status_5XX_count = apr_atomic_xchg32(&ctrs->status_5XX_count, 0);
-            ctrs_snapshot.status_other_count = apr_atomic_xchg32(&ctrs->status_other_count, 0);
+    sflow_child_tick(r, sm, now_uS);
 
-            /* point to the start of the datagram */
-            apr_uint32_t *msg = child->receiver->sampleCollector.datap;
-            /* msglen, msgType, msgId */
-            sfl_receiver_put32(child->receiver, 0); /* we'll come back and fill this in later */
-            sfl_receiver_put32(child->receiver, SFLCOUNTERS_SAMPLE);
-            sfl_receiver_put32(child->receiver, SFLCOUNTERS_HTTP);
-            /* this assumes that sizeof(SFLHTTP_counters) == XDRSIZ_SFLHTTP_COUNTERS
-               should probably check that with an assertion, perhaps at compile-time? Or
-               we could use a compiler directive to make sure that the struct is packed */
-            sfl_receiver_putOpaque(child->receiver, (char *)&ctrs_snapshot, sizeof(ctrs_snapshot));
-            /* get the msg bytes */
-            apr_size_t msgBytes = (child->receiver->sampleCollector.datap - msg) << 2;
-            /* write this in as the first 32-bit word */
-            *msg = msgBytes;
-            /* send this counter update up to the master */
-            send_msg_to_master(r, sm, msg, msgBytes, "counter update");
-            /* reset the encoder for next time */
-            sfl_receiver_resetSampleCollector(child->receiver);
+    return OK;
+}
 
-            /* This is a convenient time time to check in case the sampling-rate setting has changed. */
-            sflow_set_random_skip(child);
+/*_________________---------------------------__________________
+  _________________      burst sampling       __________________
+  -----------------___________________________------------------
+  POST <handler>?burst=<seconds>[&sampling=<N>] sets a temporary
+  sampling rate in the shared mem.  The children pick it up on their
+  next tick,  and go back to the configured rate when it expires
+  (burst=0 cancels it).  Only honoured if the request was
+  authenticated,  so the <Location> must have an Auth* setup.
+*/
 
-        } /* SEMLOCK_DO */
-        
-        if(!lockingOK) {
-            /* something went wrong with acquiring or releasing the mutex lock.
-               That's a show-stopper. Bow out gracefully. */
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "sFlow mutex locking error - parking module");
-            child->sflow_disabled = true;
-        }
+static int sflow_burst_control(request_rec *r, SFWBShared *shared)
+{
+    apr_uint32_t secs = SFWB_BURST_DEFAULT_S;
+    apr_uint32_t n = SFWB_BURST_DEFAULT_N;
+    char *args, *tok, *last = NULL;
+
+    if(r->method_number != M_POST) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+    if(r->user == NULL) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "sflow burst sampling refused: request not authenticated");
+        return HTTP_FORBIDDEN;
+    }
+
+    args = apr_pstrdup(r->pool, r->args);
+    for(tok = apr_strtok(args, "&", &last); tok; tok = apr_strtok(NULL, "&", &last)) {
+        if(strncmp(tok, "burst=", 6) == 0) secs = strtol(tok + 6, NULL, 0);
+        else if(strncmp(tok, "sampling=", 9) == 0) n = strtol(tok + 9, NULL, 0);
     }
+    if(n == 0) {
+        return HTTP_BAD_REQUEST;
+    }
+    if(secs > SFWB_BURST_MAX_S) secs = SFWB_BURST_MAX_S;
 
+    /* rate first,  so nobody sees the new expiry with the old rate */
+    shared->burst_sampling_n = n;
+    shared->burst_until_S = secs ? (apr_time_sec(apr_time_now()) + secs) : 0;
+    ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "sflow burst sampling 1-in-%u for %u seconds (user %s)", n, secs, r->user);
     return OK;
 }
 
@@ -1963,6 +5584,36 @@ static int sflow_multi_log_transaction(request_rec *r)
   -----------------___________________________------------------
 */
 
+static void sflow_print_shards(request_rec *r, const char *kind, SFWBShardShared *shards, apr_uint32_t num, apr_uint32_t max)
+{
+    apr_uint32_t i;
+    if(num > max) num = max;
+    for(i = 0; i < num; i++) {
+        SFWBShardShared *shard = &shards[i];
+        ap_rprintf(r, "counter %s.%s.requests %"APR_UINT64_T_FMT"\n", kind, shard->name, shard->totals.requests);
+        ap_rprintf(r, "counter %s.%s.status_2XX_count %u\n", kind, shard->name, shard->http.status_2XX_count);
+        ap_rprintf(r, "counter %s.%s.status_3XX_count %u\n", kind, shard->name, shard->http.status_3XX_count);
+        ap_rprintf(r, "counter %s.%s.status_4XX_count %u\n", kind, shard->name, shard->http.status_4XX_count);
+        ap_rprintf(r, "counter %s.%s.status_5XX_count %u\n", kind, shard->name, shard->http.status_5XX_count);
+        ap_rprintf(r, "counter %s.%s.bytes_in %"APR_UINT64_T_FMT"\n", kind, shard->name, shard->totals.bytes_in);
+        ap_rprintf(r, "counter %s.%s.bytes_out %"APR_UINT64_T_FMT"\n", kind, shard->name, shard->totals.bytes_out);
+        ap_rprintf(r, "counter %s.%s.duration_uS %"APR_UINT64_T_FMT"\n", kind, shard->name, shard->totals.duration_uS);
+    }
+}
+
+static void sflow_print_topk(request_rec *r, const char *kind, SFWBTopKShared *pub)
+{
+    apr_uint32_t i, num = pub->num;
+    if(num > SFWB_TOPK_EXPORT) num = SFWB_TOPK_EXPORT;
+    ap_rprintf(r, "gauge %s.window_S %u\n", kind, pub->window_S);
+    ap_rprintf(r, "gauge %s.total %u\n", kind, pub->total);
+    for(i = 0; i < num; i++) {
+        ap_rprintf(r, "string %s.%u %s\n", kind, i + 1, pub->entry[i].name);
+        ap_rprintf(r, "gauge %s.%u.requests %u\n", kind, i + 1, pub->entry[i].count);
+        ap_rprintf(r, "gauge %s.%u.error %u\n", kind, i + 1, pub->entry[i].error);
+    }
+}
+
 static int sflow_handler(request_rec *r)
 {
     if(r == NULL
@@ -1976,10 +5627,21 @@ static int sflow_handler(request_rec *r)
 
     r->content_type = "text/plain";      
 
+    if(r->args && strstr(r->args, "burst=")) {
+        SFWB *sm = r->server ? sfwb_lookup(r->server, NULL) : NULL;
+        if(sm == NULL || sm->child == NULL) {
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+        int status = sflow_burst_control(r, (SFWBShared *)sm->child->shared_mem_base);
+        if(status != OK) {
+            return status;
+        }
+    }
+
     if (!r->header_only) {
         if(r->server) {
-            SFWB *sm = GET_CONFIG_DATA(r->server);
-            if(sm) {
+            SFWB *sm = sfwb_lookup(r->server, NULL);
+            if(sm && sm->child) {
                 SFWBShared *shared = (SFWBShared *)sm->child->shared_mem_base;
                 /* aligned 32-bit reads.  Assume atomic.  No locking required */
                 ap_rprintf(r, "counter method_option_count %u\n", shared->http_counters.counterBlock.http.method_option_count);
@@ -1997,9 +5659,42 @@ static int sflow_handler(request_rec *r)
                 ap_rprintf(r, "counter status_4XX_count %u\n", shared->http_counters.counterBlock.http.status_4XX_count);
                 ap_rprintf(r, "counter status_5XX_count %u\n", shared->http_counters.counterBlock.http.status_5XX_count);
                 ap_rprintf(r, "counter status_other_count %u\n", shared->http_counters.counterBlock.http.status_other_count);
+                ap_rprintf(r, "counter requests %"APR_UINT64_T_FMT"\n", shared->http_totals.counterBlock.http_totals.requests);
+                ap_rprintf(r, "counter bytes_in %"APR_UINT64_T_FMT"\n", shared->http_totals.counterBlock.http_totals.bytes_in);
+                ap_rprintf(r, "counter bytes_out %"APR_UINT64_T_FMT"\n", shared->http_totals.counterBlock.http_totals.bytes_out);
+                ap_rprintf(r, "counter duration_uS %"APR_UINT64_T_FMT"\n", shared->http_totals.counterBlock.http_totals.duration_uS);
+                ap_rprintf(r, "counter excluded_requests %"APR_UINT64_T_FMT"\n", shared->http_excluded.counterBlock.http_excluded.requests);
+                if(shared->queue_wait) {
+                    ap_rprintf(r, "counter queue_wait_uS %"APR_UINT64_T_FMT"\n", shared->http_queue.counterBlock.http_queue.wait_uS);
+                    ap_rprintf(r, "counter queue_waits %"APR_UINT64_T_FMT"\n", shared->http_queue.counterBlock.http_queue.requests);
+                }
+                SFLHTTP_histogram *hist = &shared->http_histogram.counterBlock.http_histogram;
+                ap_rprintf(r, "gauge duration_p50_uS %"APR_UINT64_T_FMT"\n", sflow_duration_percentile(hist, 5000));
+                ap_rprintf(r, "gauge duration_p99_uS %"APR_UINT64_T_FMT"\n", sflow_duration_percentile(hist, 9900));
+                ap_rprintf(r, "gauge duration_p999_uS %"APR_UINT64_T_FMT"\n", sflow_duration_percentile(hist, 9990));
                 /* extra info */
                 ap_rprintf(r, "string hostname %s\n", r->hostname);
                 ap_rprintf(r, "gauge sampling_n %u\n", shared->sflow_skip);
+                ap_rprintf(r, "gauge sampling_n_5xx %u\n", shared->sflow_skip_5xx);
+                ap_rprintf(r, "gauge sampling_n_slow %u\n", shared->sflow_skip_slow);
+                apr_uint32_t now_S = apr_time_sec(apr_time_now());
+                apr_uint32_t burst_until_S = shared->burst_until_S;
+                ap_rprintf(r, "gauge burst_sampling_n %u\n", (burst_until_S > now_S) ? shared->burst_sampling_n : 0);
+                ap_rprintf(r, "gauge burst_seconds_left %u\n", (burst_until_S > now_S) ? (burst_until_S - now_S) : 0);
+                /* URI classes and client groups */
+                sflow_print_shards(r, "uri_class", shared->uri_class, shared->num_uri_classes, SFWB_MAX_URI_CLASSES);
+                sflow_print_shards(r, "client_group", shared->client_group, shared->num_client_groups, SFWB_MAX_CLIENT_GROUPS);
+                /* heavy hitters */
+                if(shared->topk_enabled) {
+                    sflow_print_topk(r, "top_uri", &shared->topk[SFWB_TOPK_URI]);
+                    sflow_print_topk(r, "top_host", &shared->topk[SFWB_TOPK_HOST]);
+                }
+                /* distinct clients and sessions */
+                if(shared->distinct_enabled) {
+                    ap_rprintf(r, "gauge distinct_window_S %u\n", shared->distinct.window_S);
+                    ap_rprintf(r, "gauge distinct_clients %u\n", shared->distinct.clients);
+                    ap_rprintf(r, "gauge distinct_sessions %u\n", shared->distinct.sessions);
+                }
             }
         }
     }
@@ -2019,6 +5714,9 @@ static void sflow_register_hooks(apr_pool_t *p)
     ap_hook_pre_mpm(sflow_pre_mpm, NULL, NULL, APR_HOOK_LAST);
 #endif
     ap_hook_child_init(sflow_init_child,NULL,NULL,APR_HOOK_MIDDLE);
+    ap_hook_post_read_request(sflow_post_read_request, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_insert_filter(sflow_insert_filter, NULL, NULL, APR_HOOK_LAST);
+    sflow_phases_filter_handle = ap_register_output_filter(SFWB_PHASES_FILTER, sflow_phases_filter, NULL, AP_FTYPE_TRANSCODE);
     ap_hook_handler(sflow_handler, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_log_transaction(sflow_multi_log_transaction,NULL,NULL,APR_HOOK_MIDDLE);
 }
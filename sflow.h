@@ -80,6 +80,14 @@ typedef struct _SFLExtended_socket_ipv6 {
 
 #define XDRSIZ_SFLEXTENDED_SOCKET6 44
 
+/* The structures that are not (yet) standard sFlow ones are sent under
+   a private enterprise number,  since the enterprise 0 format numbers
+   are assigned by sFlow.org.  Build with -DSFWB_ENTERPRISE=<number> to
+   use your own IANA enterprise number. */
+#ifndef SFWB_ENTERPRISE
+#define SFWB_ENTERPRISE 4300 /* InMon Corp. */
+#endif
+
 typedef enum {
   SFHTTP_OTHER    = 0,
   SFHTTP_OPTIONS  = 1,
@@ -116,16 +124,51 @@ typedef struct _SFLSampled_http {
 #define SFLHTTP_MAX_AUTHUSER_LEN 32
 #define SFLHTTP_MAX_MIMETYPE_LEN 64
 
+/* where the time went in a sampled request (uS from the start of the
+   request to each point,  or 0 if it never got there) */
+/* opaque = flow_data; enterprise = SFWB_ENTERPRISE; format = 4007 */
+typedef struct _SFLHTTP_phases {
+  apr_uint32_t headers_uS;       /* request headers read and parsed */
+  apr_uint32_t handler_uS;       /* content handler started */
+  apr_uint32_t first_byte_uS;    /* first response bytes (headers) sent on */
+  apr_uint32_t handler_end_uS;   /* end of the response generated */
+} SFLHTTP_phases;
+
+#define XDRSIZ_SFLHTTP_PHASES (4 * 4)
+
+/* what a sampled request cost the server,  as opposed to how long it took */
+/* opaque = flow_data; enterprise = SFWB_ENTERPRISE; format = 4008 */
+typedef struct _SFLHTTP_resources {
+  apr_uint32_t cpu_uS;           /* CPU time of the worker thread (uS) */
+} SFLHTTP_resources;
+
+#define XDRSIZ_SFLHTTP_RESOURCES 4
+
+/* how long a sampled request was readable before a worker started on it */
+/* opaque = flow_data; enterprise = SFWB_ENTERPRISE; format = 4009 */
+typedef struct _SFLHTTP_queue_wait {
+  apr_uint32_t wait_uS;
+} SFLHTTP_queue_wait;
+
+#define XDRSIZ_SFLHTTP_QUEUE_WAIT 4
+
 enum SFLFlow_type_tag {
   /* enterprise = 0, format = ... */
   SFLFLOW_EX_SOCKET4      = 2100,
   SFLFLOW_EX_SOCKET6      = 2101,
   /* SFLFLOW_MEMCACHE        = 2200, */
   SFLFLOW_HTTP            = 2206,
+  /* enterprise = SFWB_ENTERPRISE, format = ... */
+  SFLFLOW_HTTP_PHASES     = (SFWB_ENTERPRISE << 12) | 4007, /* per-phase timing */
+  SFLFLOW_HTTP_RESOURCES  = (SFWB_ENTERPRISE << 12) | 4008, /* CPU and memory */
+  SFLFLOW_HTTP_QUEUE_WAIT = (SFWB_ENTERPRISE << 12) | 4009, /* wait for a worker */
 };
 
 typedef union _SFLFlow_type {
   SFLSampled_http http;
+  SFLHTTP_phases http_phases;
+  SFLHTTP_resources http_resources;
+  SFLHTTP_queue_wait http_queue_wait;
   SFLExtended_socket_ipv4 socket4;
   SFLExtended_socket_ipv6 socket6;
 } SFLFlow_type;
@@ -246,19 +289,175 @@ typedef struct {
 
 #define XDRSIZ_APP_WORKERS (5 * 4)
 
+/* Application operations */
+/* opaque = counter_data; enterprise = 0; format = 2202 */
+
+#define SFLAPP_MAX_APPLICATION_LEN 32
+
+typedef struct {
+  SFLString application;
+  apr_uint32_t status_OK;
+  apr_uint32_t errors_OTHER;
+  apr_uint32_t errors_TIMEOUT;
+  apr_uint32_t errors_INTERNAL_ERROR;
+  apr_uint32_t errors_BAD_REQUEST;
+  apr_uint32_t errors_FORBIDDEN;
+  apr_uint32_t errors_TOO_LARGE;
+  apr_uint32_t errors_NOT_IMPLEMENTED;
+  apr_uint32_t errors_NOT_FOUND;
+  apr_uint32_t errors_UNAVAILABLE;
+  apr_uint32_t errors_UNAUTHORIZED;
+} SFLAPPOperations;
+
+#define SFLAPP_NUM_OPERATIONS_COUNTERS 11
+
+/* (plus the application string) */
+#define XDRSIZ_APP_OPERATIONS (SFLAPP_NUM_OPERATIONS_COUNTERS * 4)
+
+/* Application resources */
+/* opaque = counter_data; enterprise = 0; format = 2203 */
+
+typedef struct {
+  apr_uint32_t user_time;    /* mS */
+  apr_uint32_t system_time;  /* mS */
+  apr_uint64_t mem_used;     /* bytes */
+  apr_uint64_t mem_max;      /* bytes */
+  apr_uint32_t fd_open;
+  apr_uint32_t fd_max;
+  apr_uint32_t conn_open;
+  apr_uint32_t conn_max;
+} SFLAPPResources;
+
+#define XDRSIZ_APP_RESOURCES 40
+
+/* HTTP duration histogram (not a standard sFlow structure) */
+/* opaque = counter_data; enterprise = SFWB_ENTERPRISE; format = 4001 */
+
+/* log-linear buckets over uS:  durations below 2^(SUB_BITS+1) have a
+   bucket each,  and above that every power of 2 is split into
+   2^SUB_BITS equal buckets,  giving 124 buckets for 0 - 2^32 uS
+   and a worst case error of 25%.  Encoded as a counted array. */
+#define SFLHTTP_HISTOGRAM_SUB_BITS 2
+#define SFLHTTP_HISTOGRAM_BUCKETS (((32 - SFLHTTP_HISTOGRAM_SUB_BITS) + 1) << SFLHTTP_HISTOGRAM_SUB_BITS)
+
+typedef struct _SFLHTTP_histogram {
+  apr_uint32_t bucket[SFLHTTP_HISTOGRAM_BUCKETS];
+} SFLHTTP_histogram;
+
+#define XDRSIZ_SFLHTTP_HISTOGRAM (4 + (SFLHTTP_HISTOGRAM_BUCKETS * 4))
+
+/* HTTP transaction totals (not a standard sFlow structure) */
+/* opaque = counter_data; enterprise = SFWB_ENTERPRISE; format = 4002 */
+
+typedef struct _SFLHTTP_totals {
+  apr_uint64_t requests;
+  apr_uint64_t bytes_in;      /* request bytes */
+  apr_uint64_t bytes_out;     /* response bytes */
+  apr_uint64_t duration_uS;   /* sum of the request durations */
+} SFLHTTP_totals;
+
+#define XDRSIZ_SFLHTTP_TOTALS (4 * 8)
+
+/* HTTP worker states from the scoreboard (not a standard sFlow structure) */
+/* opaque = counter_data; enterprise = SFWB_ENTERPRISE; format = 4003 */
+
+typedef struct _SFLHTTP_worker_states {
+  apr_uint32_t starting;
+  apr_uint32_t ready;
+  apr_uint32_t reading;
+  apr_uint32_t writing;
+  apr_uint32_t keepalive;
+  apr_uint32_t logging;
+  apr_uint32_t dns;
+  apr_uint32_t closing;
+  apr_uint32_t graceful;
+  apr_uint32_t idle_kill;
+} SFLHTTP_worker_states;
+
+#define XDRSIZ_SFLHTTP_WORKER_STATES (10 * 4)
+
+/* HTTP heavy hitters (not a standard sFlow structure) */
+/* opaque = counter_data; enterprise = SFWB_ENTERPRISE; format = 4004 (URI paths) or 4005 (Host headers) */
+
+#define SFLHTTP_TOP_MAX 8
+#define SFLHTTP_TOP_MAX_NAME 64
+
+typedef struct _SFLHTTP_top_entry {
+  apr_uint32_t count;         /* requests in the window */
+  apr_uint32_t error;         /* the count may be over by up to this much */
+  SFLString name;
+} SFLHTTP_top_entry;
+
+typedef struct _SFLHTTP_top {
+  apr_uint32_t window_S;      /* length of the window the counts are for */
+  apr_uint32_t total;         /* all requests in the window */
+  apr_uint32_t num_entries;
+  SFLHTTP_top_entry entry[SFLHTTP_TOP_MAX];
+} SFLHTTP_top;
+
+/* HTTP distinct clients and sessions (not a standard sFlow structure) */
+/* opaque = counter_data; enterprise = SFWB_ENTERPRISE; format = 4006 */
+
+typedef struct _SFLHTTP_distinct {
+  apr_uint32_t window_S;      /* length of the window the estimates are for */
+  apr_uint32_t clients;       /* different client addresses (estimate) */
+  apr_uint32_t sessions;      /* different sessions (estimate) */
+} SFLHTTP_distinct;
+
+#define XDRSIZ_SFLHTTP_DISTINCT (3 * 4)
+
+/* HTTP requests left out by exclude.http rules (not a standard sFlow structure) */
+/* opaque = counter_data; enterprise = SFWB_ENTERPRISE; format = 4010 */
+
+typedef struct _SFLHTTP_excluded {
+  apr_uint64_t requests;      /* requests not counted in 4002 or sampled */
+} SFLHTTP_excluded;
+
+#define XDRSIZ_SFLHTTP_EXCLUDED 8
+
+/* HTTP time spent waiting for a worker (not a standard sFlow structure) */
+/* opaque = counter_data; enterprise = SFWB_ENTERPRISE; format = 4011 */
+
+typedef struct _SFLHTTP_queue {
+  apr_uint64_t wait_uS;       /* sum of the time requests waited for a worker */
+  apr_uint64_t requests;      /* requests in that sum */
+} SFLHTTP_queue;
+
+#define XDRSIZ_SFLHTTP_QUEUE (2 * 8)
+
 /* Counters data */
 
 enum SFLCounters_type_tag {
   /* enterprise = 0, format = ... */
   SFLCOUNTERS_HOST_PAR      = 2002, /* host parent */
   SFLCOUNTERS_HTTP          = 2201, /* http counters */
+  SFLCOUNTERS_APP_OPERATIONS = 2202,
+  SFLCOUNTERS_APP_RESOURCES = 2203,
   SFLCOUNTERS_APP_WORKERS   = 2206,
+  /* enterprise = SFWB_ENTERPRISE, format = ... */
+  SFLCOUNTERS_HTTP_HISTOGRAM = (SFWB_ENTERPRISE << 12) | 4001, /* http duration histogram */
+  SFLCOUNTERS_HTTP_TOTALS   = (SFWB_ENTERPRISE << 12) | 4002, /* http bytes and duration totals */
+  SFLCOUNTERS_HTTP_WORKER_STATES = (SFWB_ENTERPRISE << 12) | 4003, /* scoreboard worker states */
+  SFLCOUNTERS_HTTP_TOP_URIS = (SFWB_ENTERPRISE << 12) | 4004, /* busiest URI paths */
+  SFLCOUNTERS_HTTP_TOP_HOSTS = (SFWB_ENTERPRISE << 12) | 4005, /* busiest Host headers */
+  SFLCOUNTERS_HTTP_DISTINCT = (SFWB_ENTERPRISE << 12) | 4006, /* distinct clients and sessions */
+  SFLCOUNTERS_HTTP_EXCLUDED = (SFWB_ENTERPRISE << 12) | 4010, /* requests left out by exclusions */
+  SFLCOUNTERS_HTTP_QUEUE    = (SFWB_ENTERPRISE << 12) | 4011, /* time waiting for a worker */
 };
 
 typedef union _SFLCounters_type {
   SFLHost_par_counters host_par;
   SFLHTTP_counters http;
   SFLAPPWorkers app_workers;
+  SFLAPPOperations app_operations;
+  SFLAPPResources app_resources;
+  SFLHTTP_histogram http_histogram;
+  SFLHTTP_totals http_totals;
+  SFLHTTP_worker_states http_worker_states;
+  SFLHTTP_top http_top;
+  SFLHTTP_distinct http_distinct;
+  SFLHTTP_excluded http_excluded;
+  SFLHTTP_queue http_queue;
 } SFLCounters_type;
 
 typedef struct _SFLCounters_sample_element {
@@ -314,9 +513,14 @@ typedef struct _SFLSample_datagram_hdr {
   apr_uint32_t num_records;           /* Number of tag-len-val flow/counter records to follow */
 } SFLSample_datagram_hdr;
 
-#define SFL_MAX_DATAGRAM_SIZE 1500
+/* the receiver buffer is sized at runtime from sFlowRcvrMaximumDatagramSize,
+   so the max here is just the largest UDP payload we can send (e.g. to a
+   collector on the loopback interface) */
+#define SFL_MAX_DATAGRAM_SIZE 65507
 #define SFL_MIN_DATAGRAM_SIZE 200
 #define SFL_DEFAULT_DATAGRAM_SIZE 1400
+/* datagram header bytes with an IPv6 agent address */
+#define SFL_MAX_DATAGRAM_HEADER 40
 
 #define SFL_DATA_PAD 400
 
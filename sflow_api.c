@@ -19,6 +19,8 @@ static void * sflAlloc(SFLAgent *agent, apr_size_t bytes);
 static void sflFree(SFLAgent *agent, void *obj);
 static void sfl_agent_jumpTableAdd(SFLAgent *agent, SFLSampler *sampler);
 static void sfl_agent_jumpTableRemove(SFLAgent *agent, SFLSampler *sampler);
+static void sfl_agent_wheelAdd(SFLAgent *agent, SFLPoller *poller, apr_time_t due);
+static void sfl_agent_wheelRemove(SFLPoller *poller);
 
 /*_________________---------------------------__________________
   _________________       alloc and free      __________________
@@ -106,10 +108,12 @@ void sfl_agent_release(SFLAgent *agent)
         pl = nextPl;
     }
     agent->pollers = NULL;
+    memset(agent->pollWheel, 0, sizeof(agent->pollWheel));
 
     /* release and free the receivers */
     for( rcv = agent->receivers; rcv != NULL; ) {
         SFLReceiver *nextRcv = rcv->nxt;
+        if(rcv->sampleCollector.data) sflFree(agent, rcv->sampleCollector.data);
         sflFree(agent, rcv);
         rcv = nextRcv;
     }
@@ -125,15 +129,59 @@ void sfl_agent_tick(SFLAgent *agent, apr_time_t now)
 {
     SFLReceiver *rcv;
     SFLSampler *sm;
-    SFLPoller *pl;
+    SFLPoller *pl, *nextPl;
+    apr_time_t last = agent->now, t;
 
     agent->now = now;
     /* receivers use ticks to flush send data */
     for( rcv = agent->receivers; rcv != NULL; rcv = rcv->nxt) sfl_receiver_tick(rcv, now);
     /* samplers use ticks to decide when they are sampling too fast */
     for( sm = agent->samplers; sm != NULL; sm = sm->nxt) sfl_sampler_tick(sm, now);
-    /* pollers use ticks to decide when to ask for counters */
-    for( pl = agent->pollers; pl != NULL; pl = pl->nxt) sfl_poller_tick(pl, now);
+    /* pollers are only visited when their slot on the wheel comes round,  and only
+       asked for counters when their second has come.  If the ticks were held up
+       every slot passed since the last one is visited (once round the wheel is
+       all of them),  and a poller that is overdue is polled just once.  Each one
+       puts itself back on the wheel (maybe in this same slot),  so hold on to the
+       next one first. */
+    if(now <= last) last = now - 1;
+    else if(now - last > SFL_POLL_WHEEL_SIZ) last = now - SFL_POLL_WHEEL_SIZ;
+    for(t = last + 1; t <= now; t++) {
+        for( pl = agent->pollWheel[t % SFL_POLL_WHEEL_SIZ]; pl != NULL; pl = nextPl) {
+            nextPl = pl->wheel_nxt;
+            if(pl->wheelDue <= now) sfl_poller_tick(pl, now);
+        }
+    }
+}
+
+/*_________________---------------------------__________________
+  _________________   poller timer wheel      __________________
+  -----------------___________________________------------------
+  The slot is the second the poller is due,  modulo the wheel size,
+  which must be after the current one.
+*/
+
+static void sfl_agent_wheelAdd(SFLAgent *agent, SFLPoller *poller, apr_time_t due)
+{
+    apr_uint32_t slot;
+    sfl_agent_wheelRemove(poller);
+    if(due <= agent->now) due = agent->now + 1;
+    slot = (apr_uint32_t)(due % SFL_POLL_WHEEL_SIZ);
+    poller->wheelDue = due;
+    /* push onto the front of the slot's list */
+    poller->wheel_nxt = agent->pollWheel[slot];
+    if(poller->wheel_nxt) poller->wheel_nxt->wheel_prev = &poller->wheel_nxt;
+    poller->wheel_prev = &agent->pollWheel[slot];
+    agent->pollWheel[slot] = poller;
+}
+
+static void sfl_agent_wheelRemove(SFLPoller *poller)
+{
+    if(poller->wheel_prev) {
+        *poller->wheel_prev = poller->wheel_nxt;
+        if(poller->wheel_nxt) poller->wheel_nxt->wheel_prev = poller->wheel_prev;
+    }
+    poller->wheel_nxt = NULL;
+    poller->wheel_prev = NULL;
 }
 
 /*_________________---------------------------__________________
@@ -278,6 +326,7 @@ int sfl_agent_removePoller(SFLAgent *agent, SFLDataSource_instance *pdsi)
         if(sfl_dsi_compare(pdsi, &pl->dsi) == 0) {
             if(prev == NULL) agent->pollers = pl->nxt;
             else prev->nxt = pl->nxt;
+            sfl_agent_wheelRemove(pl);
             sflFree(agent, pl);
             return 1;
         }
@@ -713,6 +762,8 @@ void sfl_poller_init(SFLPoller *poller,
 static void resetPoller(SFLPoller *poller)
 {
     SFLDataSource_instance dsi = poller->dsi;
+    /* (polling stops until the interval is set again) */
+    sfl_agent_wheelRemove(poller);
     sfl_poller_init(poller, poller->agent, &dsi, poller->magic, poller->getCountersFn);
 }
 
@@ -737,12 +788,52 @@ apr_uint32_t sfl_poller_get_sFlowCpInterval(SFLPoller *poller) {
     return (apr_uint32_t)poller->sFlowCpInterval;
 }
 
+/* 32-bit FNV-1a over the agent address and the data source,  so that every
+   agent+data source polls at its own fixed offset within the interval */
+
+static apr_uint32_t sfl_fnv1a(apr_uint32_t hash, const apr_byte_t *bytes, apr_size_t len) {
+    apr_size_t i;
+    for(i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static apr_uint32_t sfl_poller_phase(SFLPoller *poller) {
+    SFLAgent *agent = poller->agent;
+    apr_uint32_t hash = 2166136261U;
+    if(agent->myIP.type == SFLADDRESSTYPE_IP_V6) hash = sfl_fnv1a(hash, agent->myIP.address.ip_v6.addr, 16);
+    else hash = sfl_fnv1a(hash, (apr_byte_t *)&agent->myIP.address.ip_v4.addr, 4);
+    hash = sfl_fnv1a(hash, (apr_byte_t *)&agent->subId, sizeof(agent->subId));
+    hash = sfl_fnv1a(hash, (apr_byte_t *)&poller->dsi, sizeof(poller->dsi));
+    return hash;
+}
+
 void sfl_poller_set_sFlowCpInterval(SFLPoller *poller, apr_uint32_t sFlowCpInterval) {
+    SFLAgent *agent = poller->agent;
+    apr_uint32_t delay;
     poller->sFlowCpInterval = sFlowCpInterval;
-    /* Set the countersCountdown to be a randomly selected value between 1 and
-       sFlowCpInterval. That way the counter polling would be desynchronised
-       (on a 200-port switch, polling all the counters in one second could be harmful). */
-    poller->countersCountdown = sfl_random(sFlowCpInterval);
+    if(sFlowCpInterval == 0) {
+        /* counters retrieval is not enabled */
+        sfl_agent_wheelRemove(poller);
+        return;
+    }
+    /* Desynchronise the counter polling (on a 200-port switch, polling all the
+       counters in one second could be harmful,  and so could a whole server farm
+       polling in the same second after a restart).  If we know the agent address
+       then poll whenever (time + hash(agent,dsi)) is a multiple of the interval.
+       That spreads the agents and data sources out evenly,  and keeps each one in
+       the same place if it is set up again (e.g. on a config change).  Otherwise
+       fall back on a random number of seconds between 1 and sFlowCpInterval. */
+    if(agent->myIP.type == SFLADDRESSTYPE_UNDEFINED) {
+        delay = sfl_random(sFlowCpInterval);
+    }
+    else {
+        apr_uint32_t now_S = (apr_uint32_t)agent->now;
+        delay = sFlowCpInterval - ((now_S + (sfl_poller_phase(poller) % sFlowCpInterval)) % sFlowCpInterval);
+    }
+    sfl_agent_wheelAdd(agent, poller, agent->now + delay);
 }
 
 /*_________________---------------------------------__________________
@@ -760,20 +851,21 @@ void sfl_poller_resetCountersSeqNo(SFLPoller *poller) {  poller->countersSampleS
 
 void sfl_poller_tick(SFLPoller *poller, apr_time_t now)
 {
-    if(poller->countersCountdown == 0) return; /* counters retrieval was not enabled */
-    if(poller->sFlowCpReceiver == 0) return;
-
-    if(--poller->countersCountdown == 0) {
-        if(poller->getCountersFn != NULL) {
-            /* call out for counters */
-            SFL_COUNTERS_SAMPLE_TYPE cs;
-            memset(&cs, 0, sizeof(cs));
-            poller->getCountersFn(poller->magic, poller, &cs);
-            /* this countersFn is expected to fill in some counter block elements */
-            /* and then call sfl_poller_writeCountersSample(poller, &cs); */
-        }
-        /* reset the countdown */
-        poller->countersCountdown = poller->sFlowCpInterval;
+    /* the wheel only calls this when the interval is up */
+    if(poller->sFlowCpReceiver != 0
+       && poller->getCountersFn != NULL) {
+        /* call out for counters */
+        SFL_COUNTERS_SAMPLE_TYPE cs;
+        memset(&cs, 0, sizeof(cs));
+        poller->getCountersFn(poller->magic, poller, &cs);
+        /* this countersFn is expected to fill in some counter block elements */
+        /* and then call sfl_poller_writeCountersSample(poller, &cs); */
+    }
+    /* and go round again,  in the same phase even if this one was late */
+    if(poller->sFlowCpInterval) {
+        apr_time_t due = poller->wheelDue + poller->sFlowCpInterval;
+        if(due <= now) due += ((now - due) / poller->sFlowCpInterval + 1) * poller->sFlowCpInterval;
+        sfl_agent_wheelAdd(poller->agent, poller, due);
     }
 }
 
@@ -804,6 +896,7 @@ void sfl_poller_writeCountersSample(SFLPoller *poller, SFL_COUNTERS_SAMPLE_TYPE
 /* ===================== RECEIVER ====================*/
 
 static void resetSampleCollector(SFLReceiver *receiver);
+static int allocSampleCollector(SFLReceiver *receiver, apr_uint32_t mdz);
 static void sendSample(SFLReceiver *receiver);
 static void receiverError(SFLReceiver *receiver, char *errm);
 static void putNet32(SFLReceiver *receiver, apr_uint32_t val);
@@ -817,16 +910,28 @@ static void putOpaque(SFLReceiver *receiver, char *val, int len);
 
 void sfl_receiver_init(SFLReceiver *receiver, SFLAgent *agent)
 {
+    /* hold on to the sample buffer,  in case we are resetting this receiver
+       and it was already allocated */
+    apr_uint32_t *data = receiver->sampleCollector.data;
+    apr_uint32_t dataQuads = receiver->sampleCollector.dataQuads;
+
     /* first clear everything */
     memset(receiver, 0, sizeof(*receiver));
 
     /* now copy in the parameters */
     receiver->agent = agent;
+    receiver->sampleCollector.data = data;
+    receiver->sampleCollector.dataQuads = dataQuads;
+    receiver->sampleCollector.datap = data;
+    if(data) memset((apr_byte_t *)data, 0, dataQuads * sizeof(apr_uint32_t));
 
     /* set defaults */
     receiver->sFlowRcvrMaximumDatagramSize = SFL_DEFAULT_DATAGRAM_SIZE;
     receiver->sFlowRcvrPort = SFL_DEFAULT_COLLECTOR_PORT;
 
+    /* make sure the buffer is big enough for the default datagram size */
+    allocSampleCollector(receiver, SFL_DEFAULT_DATAGRAM_SIZE);
+
     /* prepare to receive the first sample */
     resetSampleCollector(receiver);
 }
@@ -873,7 +978,9 @@ apr_uint32_t sfl_receiver_get_sFlowRcvrMaximumDatagramSize(SFLReceiver *receiver
 void sfl_receiver_set_sFlowRcvrMaximumDatagramSize(SFLReceiver *receiver, apr_uint32_t sFlowRcvrMaximumDatagramSize) {
     apr_uint32_t mdz = sFlowRcvrMaximumDatagramSize;
     if(mdz < SFL_MIN_DATAGRAM_SIZE) mdz = SFL_MIN_DATAGRAM_SIZE;
-    receiver->sFlowRcvrMaximumDatagramSize = mdz;
+    if(mdz > SFL_MAX_DATAGRAM_SIZE) mdz = SFL_MAX_DATAGRAM_SIZE;
+    /* grow the buffer first,  and only accept the new size if that worked */
+    if(allocSampleCollector(receiver, mdz)) receiver->sFlowRcvrMaximumDatagramSize = mdz;
 }
 SFLAddress *sfl_receiver_get_sFlowRcvrAddress(SFLReceiver *receiver) {
     return &receiver->sFlowRcvrAddress;
@@ -1028,6 +1135,9 @@ static int computeFlowSampleSize(SFLReceiver *receiver, SFL_FLOW_SAMPLE_TYPE *fs
         case SFLFLOW_HTTP: elemSiz = httpOpEncodingLength(&elem->flowType.http);  break;
         case SFLFLOW_EX_SOCKET4: elemSiz = XDRSIZ_SFLEXTENDED_SOCKET4;  break;
         case SFLFLOW_EX_SOCKET6: elemSiz = XDRSIZ_SFLEXTENDED_SOCKET6;  break;
+        case SFLFLOW_HTTP_PHASES: elemSiz = XDRSIZ_SFLHTTP_PHASES;  break;
+        case SFLFLOW_HTTP_RESOURCES: elemSiz = XDRSIZ_SFLHTTP_RESOURCES;  break;
+        case SFLFLOW_HTTP_QUEUE_WAIT: elemSiz = XDRSIZ_SFLHTTP_QUEUE_WAIT;  break;
         default:
             {
                 char errm[MAX_ERRMSG_LEN];
@@ -1127,6 +1237,18 @@ int sfl_receiver_writeFlowSample(SFLReceiver *receiver, SFL_FLOW_SAMPLE_TYPE *fs
             putNet32(receiver, elem->flowType.http.uS);
             putNet32(receiver, elem->flowType.http.status);
             break;
+        case SFLFLOW_HTTP_PHASES:
+            putNet32(receiver, elem->flowType.http_phases.headers_uS);
+            putNet32(receiver, elem->flowType.http_phases.handler_uS);
+            putNet32(receiver, elem->flowType.http_phases.first_byte_uS);
+            putNet32(receiver, elem->flowType.http_phases.handler_end_uS);
+            break;
+        case SFLFLOW_HTTP_RESOURCES:
+            putNet32(receiver, elem->flowType.http_resources.cpu_uS);
+            break;
+        case SFLFLOW_HTTP_QUEUE_WAIT:
+            putNet32(receiver, elem->flowType.http_queue_wait.wait_uS);
+            break;
         default:
             {
                 char errm[MAX_ERRMSG_LEN];
@@ -1239,6 +1361,14 @@ int sfl_receiver_writeEncodedFlowSample(SFLReceiver *receiver, SFL_FLOW_SAMPLE_T
     return packedSize;
 }
 
+static apr_uint32_t httpTopEncodingLength(SFLHTTP_top *top) {
+    apr_uint32_t i, siz = 12; /* window_S, total, num_entries */
+    for(i = 0; i < top->num_entries && i < SFLHTTP_TOP_MAX; i++) {
+        siz += 8 + stringEncodingLength(&top->entry[i].name);
+    }
+    return siz;
+}
+
 /*_________________-----------------------------__________________
   _________________ computeCountersSampleSize   __________________
   -----------------_____________________________------------------
@@ -1268,6 +1398,16 @@ static int computeCountersSampleSize(SFLReceiver *receiver, SFL_COUNTERS_SAMPLE_
         case SFLCOUNTERS_HOST_PAR: elemSiz = 8 /*sizeof(elem->counterBlock.host_par)*/;  break;
         case SFLCOUNTERS_HTTP: elemSiz = XDRSIZ_SFLHTTP_COUNTERS /*sizeof(elem->counterBlock.http)*/;  break;
         case SFLCOUNTERS_APP_WORKERS: elemSiz = XDRSIZ_APP_WORKERS /*sizeof(elem->counterBlock.app_workers)*/;  break;
+        case SFLCOUNTERS_APP_OPERATIONS: elemSiz = stringEncodingLength(&elem->counterBlock.app_operations.application) + XDRSIZ_APP_OPERATIONS;  break;
+        case SFLCOUNTERS_APP_RESOURCES: elemSiz = XDRSIZ_APP_RESOURCES;  break;
+        case SFLCOUNTERS_HTTP_HISTOGRAM: elemSiz = XDRSIZ_SFLHTTP_HISTOGRAM;  break;
+        case SFLCOUNTERS_HTTP_TOTALS: elemSiz = XDRSIZ_SFLHTTP_TOTALS;  break;
+        case SFLCOUNTERS_HTTP_WORKER_STATES: elemSiz = XDRSIZ_SFLHTTP_WORKER_STATES;  break;
+        case SFLCOUNTERS_HTTP_TOP_URIS:
+        case SFLCOUNTERS_HTTP_TOP_HOSTS: elemSiz = httpTopEncodingLength(&elem->counterBlock.http_top);  break;
+        case SFLCOUNTERS_HTTP_DISTINCT: elemSiz = XDRSIZ_SFLHTTP_DISTINCT;  break;
+        case SFLCOUNTERS_HTTP_EXCLUDED: elemSiz = XDRSIZ_SFLHTTP_EXCLUDED;  break;
+        case SFLCOUNTERS_HTTP_QUEUE: elemSiz = XDRSIZ_SFLHTTP_QUEUE;  break;
         default:
             {
                 char errm[MAX_ERRMSG_LEN];
@@ -1300,10 +1440,11 @@ int sfl_receiver_writeCountersSample(SFLReceiver *receiver, SFL_COUNTERS_SAMPLE_
     /* it over the limit, then we should send it now. */
     if((packedSize = computeCountersSampleSize(receiver, cs)) == -1) return -1;
   
-    /* check in case this one sample alone is too big for the datagram */
-    /* in fact - if it is even half as big then we should ditch it. Very */
-    /* important to avoid overruning the packet buffer. */
-    if(packedSize > (int)(receiver->sFlowRcvrMaximumDatagramSize / 2)) {
+    /* check in case this one sample alone is too big for the datagram. Very */
+    /* important to avoid overruning the packet buffer. (This used to allow */
+    /* only half the datagram,  but with the app_ and histogram blocks a */
+    /* counter sample no longer fits in half of a 1400-byte datagram.) */
+    if(packedSize > (int)(receiver->sFlowRcvrMaximumDatagramSize - SFL_MAX_DATAGRAM_HEADER)) {
         receiverError(receiver, "counters sample too big for datagram");
         return -1;
     }
@@ -1365,6 +1506,84 @@ int sfl_receiver_writeCountersSample(SFLReceiver *receiver, SFL_COUNTERS_SAMPLE_
             putNet32(receiver, elem->counterBlock.app_workers.req_delayed);
             putNet32(receiver, elem->counterBlock.app_workers.req_dropped);
             break;
+        case SFLCOUNTERS_APP_OPERATIONS:
+            putString(receiver, &elem->counterBlock.app_operations.application);
+            putNet32(receiver, elem->counterBlock.app_operations.status_OK);
+            putNet32(receiver, elem->counterBlock.app_operations.errors_OTHER);
+            putNet32(receiver, elem->counterBlock.app_operations.errors_TIMEOUT);
+            putNet32(receiver, elem->counterBlock.app_operations.errors_INTERNAL_ERROR);
+            putNet32(receiver, elem->counterBlock.app_operations.errors_BAD_REQUEST);
+            putNet32(receiver, elem->counterBlock.app_operations.errors_FORBIDDEN);
+            putNet32(receiver, elem->counterBlock.app_operations.errors_TOO_LARGE);
+            putNet32(receiver, elem->counterBlock.app_operations.errors_NOT_IMPLEMENTED);
+            putNet32(receiver, elem->counterBlock.app_operations.errors_NOT_FOUND);
+            putNet32(receiver, elem->counterBlock.app_operations.errors_UNAVAILABLE);
+            putNet32(receiver, elem->counterBlock.app_operations.errors_UNAUTHORIZED);
+            break;
+        case SFLCOUNTERS_APP_RESOURCES:
+            putNet32(receiver, elem->counterBlock.app_resources.user_time);
+            putNet32(receiver, elem->counterBlock.app_resources.system_time);
+            putNet64(receiver, elem->counterBlock.app_resources.mem_used);
+            putNet64(receiver, elem->counterBlock.app_resources.mem_max);
+            putNet32(receiver, elem->counterBlock.app_resources.fd_open);
+            putNet32(receiver, elem->counterBlock.app_resources.fd_max);
+            putNet32(receiver, elem->counterBlock.app_resources.conn_open);
+            putNet32(receiver, elem->counterBlock.app_resources.conn_max);
+            break;
+        case SFLCOUNTERS_HTTP_HISTOGRAM:
+            {
+                apr_uint32_t b;
+                putNet32(receiver, SFLHTTP_HISTOGRAM_BUCKETS);
+                for(b = 0; b < SFLHTTP_HISTOGRAM_BUCKETS; b++) {
+                    putNet32(receiver, elem->counterBlock.http_histogram.bucket[b]);
+                }
+            }
+            break;
+        case SFLCOUNTERS_HTTP_TOTALS:
+            putNet64(receiver, elem->counterBlock.http_totals.requests);
+            putNet64(receiver, elem->counterBlock.http_totals.bytes_in);
+            putNet64(receiver, elem->counterBlock.http_totals.bytes_out);
+            putNet64(receiver, elem->counterBlock.http_totals.duration_uS);
+            break;
+        case SFLCOUNTERS_HTTP_WORKER_STATES:
+            putNet32(receiver, elem->counterBlock.http_worker_states.starting);
+            putNet32(receiver, elem->counterBlock.http_worker_states.ready);
+            putNet32(receiver, elem->counterBlock.http_worker_states.reading);
+            putNet32(receiver, elem->counterBlock.http_worker_states.writing);
+            putNet32(receiver, elem->counterBlock.http_worker_states.keepalive);
+            putNet32(receiver, elem->counterBlock.http_worker_states.logging);
+            putNet32(receiver, elem->counterBlock.http_worker_states.dns);
+            putNet32(receiver, elem->counterBlock.http_worker_states.closing);
+            putNet32(receiver, elem->counterBlock.http_worker_states.graceful);
+            putNet32(receiver, elem->counterBlock.http_worker_states.idle_kill);
+            break;
+        case SFLCOUNTERS_HTTP_TOP_URIS:
+        case SFLCOUNTERS_HTTP_TOP_HOSTS:
+            {
+                SFLHTTP_top *top = &elem->counterBlock.http_top;
+                apr_uint32_t i, num = (top->num_entries < SFLHTTP_TOP_MAX) ? top->num_entries : SFLHTTP_TOP_MAX;
+                putNet32(receiver, top->window_S);
+                putNet32(receiver, top->total);
+                putNet32(receiver, num);
+                for(i = 0; i < num; i++) {
+                    putNet32(receiver, top->entry[i].count);
+                    putNet32(receiver, top->entry[i].error);
+                    putString(receiver, &top->entry[i].name);
+                }
+            }
+            break;
+        case SFLCOUNTERS_HTTP_DISTINCT:
+            putNet32(receiver, elem->counterBlock.http_distinct.window_S);
+            putNet32(receiver, elem->counterBlock.http_distinct.clients);
+            putNet32(receiver, elem->counterBlock.http_distinct.sessions);
+            break;
+        case SFLCOUNTERS_HTTP_EXCLUDED:
+            putNet64(receiver, elem->counterBlock.http_excluded.requests);
+            break;
+        case SFLCOUNTERS_HTTP_QUEUE:
+            putNet64(receiver, elem->counterBlock.http_queue.wait_uS);
+            putNet64(receiver, elem->counterBlock.http_queue.requests);
+            break;
         default:
             {
                 char errm[MAX_ERRMSG_LEN];
@@ -1433,6 +1652,44 @@ static void sendSample(SFLReceiver *receiver)
     resetSampleCollector(receiver);
 }
 
+/*_________________---------------------------__________________
+  _________________   allocSampleCollector    __________________
+  -----------------___________________________------------------
+  make sure the sample buffer can hold a datagram of mdz bytes (plus
+  the pad).  Any samples waiting in the old buffer are sent first.
+  Returns 1 if the buffer is big enough,  0 if the allocation failed.
+*/
+
+static int allocSampleCollector(SFLReceiver *receiver, apr_uint32_t mdz)
+{
+    apr_uint32_t quads = SFL_SAMPLECOLLECTOR_DATA_QUADS(mdz);
+    apr_uint32_t *data;
+
+    if(receiver->sampleCollector.data && receiver->sampleCollector.dataQuads >= quads) {
+        /* already big enough */
+        return 1;
+    }
+
+    if((data = (apr_uint32_t *)sflAlloc(receiver->agent, quads * sizeof(apr_uint32_t))) == NULL) {
+        sfl_agent_error(receiver->agent, "receiver", "sample buffer allocation failed");
+        return 0;
+    }
+
+    if(receiver->sampleCollector.data) {
+        /* don't lose anything that was already queued */
+        if(receiver->sampleCollector.numSamples > 0) sendSample(receiver);
+        sflFree(receiver->agent, receiver->sampleCollector.data);
+    }
+
+    receiver->sampleCollector.data = data;
+    receiver->sampleCollector.dataQuads = quads;
+    /* the whole buffer is cleared here,  so after this we only need to clear what was used */
+    memset((apr_byte_t *)data, 0, quads * sizeof(apr_uint32_t));
+    receiver->sampleCollector.datap = data;
+    resetSampleCollector(receiver);
+    return 1;
+}
+
 /*_________________---------------------------__________________
   _________________   resetSampleCollector    __________________
   -----------------___________________________------------------
@@ -1440,11 +1697,17 @@ static void sendSample(SFLReceiver *receiver)
 
 static void resetSampleCollector(SFLReceiver *receiver)
 {
+    apr_uint32_t usedBytes = (apr_byte_t *)receiver->sampleCollector.datap - (apr_byte_t *)receiver->sampleCollector.data;
+    if(usedBytes < receiver->sampleCollector.pktlen) usedBytes = receiver->sampleCollector.pktlen;
+    if(usedBytes > (receiver->sampleCollector.dataQuads * 4)) usedBytes = (receiver->sampleCollector.dataQuads * 4);
+
     receiver->sampleCollector.pktlen = 0;
     receiver->sampleCollector.numSamples = 0;
 
-    /* clear the buffer completely (ensures that pad bytes will always be zeros - thank you CW) */
-    memset((apr_byte_t *)receiver->sampleCollector.data, 0, (SFL_SAMPLECOLLECTOR_DATA_QUADS * 4));
+    /* clear the part of the buffer that was written (ensures that pad bytes will always be zeros - thank you CW).
+       With a large datagram size (e.g. for a collector on the loopback interface) clearing the whole buffer
+       every time would be wasteful. */
+    memset((apr_byte_t *)receiver->sampleCollector.data, 0, usedBytes);
 
     /* point the datap to just after the header */
     receiver->sampleCollector.datap = (receiver->agent->myIP.type == SFLADDRESSTYPE_IP_V6) ?
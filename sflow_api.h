@@ -70,10 +70,11 @@ typedef struct _SFLDataSource_instance {
     (dsi).ds_instance = (inst);			\
   } while(0)
 
-#define SFL_SAMPLECOLLECTOR_DATA_QUADS (SFL_MAX_DATAGRAM_SIZE + SFL_DATA_PAD) / sizeof(apr_uint32_t)
+#define SFL_SAMPLECOLLECTOR_DATA_QUADS(mdz) (((mdz) + SFL_DATA_PAD) / sizeof(apr_uint32_t))
 
 typedef struct _SFLSampleCollector {
-  apr_uint32_t data[SFL_SAMPLECOLLECTOR_DATA_QUADS];
+  apr_uint32_t *data;      /* allocated to fit sFlowRcvrMaximumDatagramSize */
+  apr_uint32_t dataQuads;  /* allocated size of data[] */
   apr_uint32_t *datap; /* packet fill pointer */
   apr_uint32_t pktlen; /* accumulated size */
   apr_uint32_t packetSeqNo;
@@ -93,6 +94,7 @@ typedef struct _SFLReceiver {
   apr_uint32_t sFlowRcvrDatagramVersion;
   /* public fields */
   struct _SFLAgent *agent;    /* pointer to my agent */
+  void *userData;             /* can be useful to hang something else here */
   /* private fields */
   SFLSampleCollector sampleCollector;
 } SFLReceiver;
@@ -143,8 +145,11 @@ typedef struct _SFLPoller {
   getCountersFn_t getCountersFn;
   /* private fields */
   SFLReceiver *myReceiver;
-  apr_time_t countersCountdown;
   apr_uint32_t countersSampleSeqNo;
+  /* timer wheel (see sfl_agent_tick) */
+  struct _SFLPoller *wheel_nxt;
+  struct _SFLPoller **wheel_prev;
+  apr_time_t wheelDue; /* the second it is next polled */
 } SFLPoller;
 
 typedef void *(*allocFn_t)(void *magic,               /* callback to allocate space on heap */
@@ -169,10 +174,17 @@ typedef void (*sendFn_t)(void *magic,                 /* optional override fn to
 /* prime numbers are good for hash tables */
 #define SFL_HASHTABLE_SIZ 199
 
+/* pollers wait on a timer wheel with one slot per second,  so each tick
+   only visits the pollers that are due.  Intervals longer than this
+   just go round more than once,  and skip the slot until their second
+   comes. */
+#define SFL_POLL_WHEEL_SIZ 64
+
 typedef struct _SFLAgent {
   SFLSampler *jumpTable[SFL_HASHTABLE_SIZ]; /* fast lookup table for samplers (by ifIndex) */
   SFLSampler *samplers;   /* the list of samplers */
   SFLPoller  *pollers;    /* the list of samplers */
+  SFLPoller  *pollWheel[SFL_POLL_WHEEL_SIZ]; /* pollers by the second they are next due */
   SFLReceiver *receivers; /* the array of receivers */
   apr_time_t bootTime;        /* time when we booted or started */
   apr_time_t now;             /* time now */
@@ -302,7 +314,7 @@ void sfl_poller_init(SFLPoller *poller, SFLAgent *agent, SFLDataSource_instance
 
 
 void sfl_receiver_tick(SFLReceiver *receiver, apr_time_t now);
-void sfl_poller_tick(SFLPoller *poller, apr_time_t now);
+void sfl_poller_tick(SFLPoller *poller, apr_time_t now); /* only called when it is due */
 void sfl_sampler_tick(SFLSampler *sampler, apr_time_t now);
 
 int sfl_receiver_writeFlowSample(SFLReceiver *receiver, SFL_FLOW_SAMPLE_TYPE *fs);